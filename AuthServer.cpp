@@ -2,7 +2,9 @@
  Authorization Server code for CMPT 276, Spring 2016.
  */
 
+#include <cstdint>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -13,22 +15,14 @@
 #include <was/common.h>
 #include <was/table.h>
 
-#include "TableCache.h"
+#include "ClientUtils.h"
+#include "TableStore.h"
+#include "Trace.h"
 #include "make_unique.h"
 
-#include "azure_keys.h"
-
-using azure::storage::storage_exception;
-using azure::storage::cloud_table;
-using azure::storage::cloud_table_client;
 using azure::storage::edm_type;
 using azure::storage::entity_property;
 using azure::storage::table_entity;
-using azure::storage::table_operation;
-using azure::storage::table_query;
-using azure::storage::table_query_iterator;
-using azure::storage::table_request_options;
-using azure::storage::table_result;
 using azure::storage::table_shared_access_policy;
 
 using std::cin;
@@ -72,9 +66,9 @@ const string get_update_token_op {"GetUpdateToken"};
 const string get_update_data_op {"GetUpdateData"};
 
 /*
-  Cache of opened tables
+  Where the tables are kept, chosen in main()
  */
-TableCache table_cache {};
+std::unique_ptr<TableStore> store {};
 
 /*
   Convert properties represented in Azure Storage type
@@ -103,45 +97,7 @@ value build_json_object (const vector<pair<string,string>>& properties) {
 }
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
- */
-unordered_map<string,string> get_json_body(http_request message) {
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
-      }
-      else {
-        results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
-}
-
-/*
-  Return a token for 24 hours of access to the specified table,
+  Return a token for 24 hours of access to DataTable,
   for the single entity defind by the partition and row.
 
   permissions: A bitwise OR ('|')  of table_shared_access_poligy::permission
@@ -153,35 +109,49 @@ unordered_map<string,string> get_json_body(http_request message) {
       table_shared_access_policy::permissions::read |
       table_shared_access_policy::permissions::update
  */
-pair<status_code,string> do_get_token (const cloud_table& data_table,
-                   const string& partition,
+pair<status_code,string> do_get_token (const string& partition,
                    const string& row,
                    uint8_t permissions) {
 
   utility::datetime exptime {utility::datetime::utc_now() + utility::datetime::from_days(1)};
-  try {
-    string limited_access_token {
-      data_table.get_shared_access_signature(table_shared_access_policy {
-                                               exptime,
-                                               permissions},
-                                             string(), // Unnamed policy
-                                             // Start of range (inclusive)
-                                             partition,
-                                             row,
-                                             // End of range (inclusive)
-                                             partition,
-                                             row)
-        // Following token allows read access to entire table
-        //table.get_shared_access_signature(table_shared_access_policy {exptime, permissions})
-      };
-    cout << "Token " << limited_access_token << endl;
-    return make_pair(status_codes::OK, limited_access_token);
-  }
-  catch (const storage_exception& e) {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
-    return make_pair(status_codes::InternalError, string{});
+  pair<status_code,string> token {store->get_token(data_table_name, partition, row, permissions, exptime)};
+  if (token.first == status_codes::OK)
+    cout << "Token " << token.second << endl;
+  return token;
+}
+
+/*
+  Look up userid in AuthTable and check password against the one
+  stored for it. If they match, set data_part and data_row to the key
+  of the DataTable entity userid may access and return OK. Otherwise
+  return NotFound, or the status of a read of AuthTable that failed.
+ */
+status_code find_user (const string& userid, const unordered_map<string,string>& json_body,
+                       string& data_part, string& data_row) {
+  auto password (json_body.find(auth_table_password_prop));
+  if (password == json_body.end())
+    return status_codes::NotFound;
+  table_entity entity {};
+  status_code found {store->retrieve(auth_table_name, auth_table_userid_partition, userid, entity)};
+  if (found != status_codes::OK)
+    return found;
+
+  string passToStore;
+  const table_entity::properties_type& propertyPWD {entity.properties()};
+  for( auto v = propertyPWD.begin(); v != propertyPWD.end(); ++v ) {
+    if (v->first == auth_table_password_prop ) {
+      passToStore = v->second.str();
+    }
+    if ( v->first == auth_table_partition_prop ) {
+      data_part = v->second.str();
+    }
+    if ( v->first == auth_table_row_prop ){
+      data_row = v->second.str();
+    }
   }
+  if (password->second != passToStore)
+    return status_codes::NotFound;
+  return status_codes::OK;
 }
 
 /*
@@ -189,6 +159,10 @@ pair<status_code,string> do_get_token (const cloud_table& data_table,
  */
 
 void handle_get(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
 
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** AuthServer GET " << path << endl;
@@ -202,53 +176,24 @@ void handle_get(http_request message) {
     message.reply(status_codes::BadRequest);    // Need at least an operation and userid
     return;
   }
-  cloud_table table {table_cache.lookup_table(auth_table_name)};
-  if ( ! table.exists()) {
+  if ( ! store->exists(auth_table_name)) {
     message.reply(status_codes::NotFound);//reply NotFound status if table doesn't exist
     return;
 
   }
   else if(paths[0] == get_read_token_op){ //operation for GetReadToken
-
-    string passToStore;
     string dataPart;
     string dataRow;
-    vector<string> passwordVector;
-    table_query query {};
-    table_query_iterator end;
-    table_query_iterator it = table.execute_query(query);
-    for( auto v = json_body.begin(); v != json_body.end(); ++v ) {
-      if (v->first == auth_table_password_prop) {
-        passwordVector.push_back(v->second);
-      }
-    }
-    while( it != end ){
-      const table_entity::properties_type& propertyPWD {it->properties()};
-      for( auto v = propertyPWD.begin(); v != propertyPWD.end(); ++v ) {
-
-        if (v->first == auth_table_password_prop ) {
-          passToStore = v->second.str();
-        }
-
-        if ( v->first == auth_table_partition_prop ) {
-          dataPart = v->second.str();
-        }
-        if ( v->first == auth_table_row_prop ){
-          dataRow = v->second.str();
-        }
-      }
-      if(it->row_key() == paths[1] && passwordVector[0] == passToStore){
-          //if the userID, and its password matches, return the token with permission of read-only
-          cloud_table table2 {table_cache.lookup_table(data_table_name)};
-          pair<status_code,string> tempPair = do_get_token(table2, dataPart, dataRow, table_shared_access_policy::permissions::read);
-          vector<pair<string,string>> pairToReturn {make_pair("token", tempPair.second)};
-          value returnToken = build_json_object(pairToReturn);
-          message.reply(tempPair.first, returnToken);
-          return;
-      }
-      ++it; //iteration
+    status_code found {find_user(paths[1], json_body, dataPart, dataRow)};
+    if (found != status_codes::OK) {
+      message.reply(found); //Here, the userid not found
+      return;
     }
-    message.reply(status_codes::NotFound); //Here, the userid not found
+    //if the userID, and its password matches, return the token with permission of read-only
+    pair<status_code,string> tempPair = do_get_token(dataPart, dataRow, table_shared_access_policy::permissions::read);
+    vector<pair<string,string>> pairToReturn {make_pair("token", tempPair.second)};
+    value returnToken = build_json_object(pairToReturn);
+    message.reply(tempPair.first, returnToken);
   }
 
   else if (paths[0] == get_update_token_op){  //oepration for GetUpdateToken
@@ -256,94 +201,35 @@ void handle_get(http_request message) {
     This operation has the same specification as 'GetReadToken',
     except the returned token permits update operation as well as reads
     */
-    string passToStore;
     string dataPart;
     string dataRow;
-    vector<string> passwordVector;
-    table_query query {};
-    table_query_iterator end;
-    table_query_iterator it = table.execute_query(query);
-    for( auto v = json_body.begin(); v != json_body.end(); ++v ) {
-      if (v->first == auth_table_password_prop) {
-        passwordVector.push_back(v->second);
-      }
-    }
-    while( it != end ){
-      const table_entity::properties_type& propertyPWD {it->properties()};
-      for( auto v = propertyPWD.begin(); v != propertyPWD.end(); ++v ) {
-
-        if (v->first == auth_table_password_prop ) {
-          passToStore = v->second.str();
-        }
-
-        if ( v->first == auth_table_partition_prop ) {
-          dataPart = v->second.str();
-        }
-        if ( v->first == auth_table_row_prop ){
-          dataRow = v->second.str();
-        }
-      }
-      if(it->row_key() == paths[1] && passwordVector[0] == passToStore){
-          //if the userID, and its password matches, return the token with permission of read and write
-          cloud_table table2 {table_cache.lookup_table(data_table_name)};
-          pair<status_code,string> tempPair =   do_get_token(table2, dataPart, dataRow, table_shared_access_policy::permissions::read |
-                                                                                      table_shared_access_policy::permissions::update);
-          vector<pair<string,string>> pairToReturn {make_pair("token", tempPair.second)};
-          value returnToken = build_json_object(pairToReturn);
-          message.reply(tempPair.first, returnToken);
-          return;
-      }
-      ++it;
+    status_code found {find_user(paths[1], json_body, dataPart, dataRow)};
+    if (found != status_codes::OK) {
+      message.reply(found);  //userid is not found
+      return;
     }
-    message.reply(status_codes::NotFound);  //userid is not found
+    //if the userID, and its password matches, return the token with permission of read and write
+    pair<status_code,string> tempPair =   do_get_token(dataPart, dataRow, table_shared_access_policy::permissions::read |
+                                                                          table_shared_access_policy::permissions::update);
+    vector<pair<string,string>> pairToReturn {make_pair("token", tempPair.second)};
+    value returnToken = build_json_object(pairToReturn);
+    message.reply(tempPair.first, returnToken);
   }else if(paths[0] == get_update_data_op){
-    string passToStore;
     string dataPart;
     string dataRow;
-    vector<string> passwordVector;
-    table_query query {};
-    table_query_iterator end;
-    table_query_iterator it = table.execute_query(query);
-    for( auto v = json_body.begin(); v != json_body.end(); ++v ) {
-      if (v->first == auth_table_password_prop) {
-        passwordVector.push_back(v->second);
-      }
+    status_code found {find_user(paths[1], json_body, dataPart, dataRow)};
+    if (found != status_codes::OK) {
+      message.reply(found);  //userid is not found
+      return;
     }
-    while( it != end ){
-      const table_entity::properties_type& propertyPWD {it->properties()};
-      for( auto v = propertyPWD.begin(); v != propertyPWD.end(); ++v ) {
-
-        if (v->first == auth_table_password_prop ) {
-          passToStore = v->second.str();
-        }
-
-        if ( v->first == auth_table_partition_prop ) {
-          dataPart = v->second.str();
-        }
-        if ( v->first == auth_table_row_prop ){
-          dataRow = v->second.str();
-        }
-      }
-      cout << "it->row_key() = " << it->row_key() << endl;
-      cout << "passwordVector[0] = " << passwordVector[0] << endl;
-      cout << "paths[1] = " << paths[1] << endl;
-      cout << "passToStore = " << passToStore << endl;
-
-      if(it->row_key() == paths[1] && passwordVector[0] == passToStore){
-          //if the userID, and its password matches, return the token with permission of read and write
-          cloud_table table2 {table_cache.lookup_table(data_table_name)};
-          pair<status_code,string> tempPair =   do_get_token(table2, dataPart, dataRow, table_shared_access_policy::permissions::read |
-                                                                                      table_shared_access_policy::permissions::update);
-          vector<pair<string,string>> pairToReturn {make_pair("token", tempPair.second)};
-          pairToReturn.push_back( make_pair("DataPartition", dataPart));
-          pairToReturn.push_back( make_pair("DataRow", dataRow));
-          value returnToken = build_json_object(pairToReturn);
-          message.reply(tempPair.first, returnToken);
-          return;
-      }
-      ++it;
-    }
-    message.reply(status_codes::NotFound);  //userid is not found
+    //if the userID, and its password matches, return the token with permission of read and write
+    pair<status_code,string> tempPair =   do_get_token(dataPart, dataRow, table_shared_access_policy::permissions::read |
+                                                                          table_shared_access_policy::permissions::update);
+    vector<pair<string,string>> pairToReturn {make_pair("token", tempPair.second)};
+    pairToReturn.push_back( make_pair("DataPartition", dataPart));
+    pairToReturn.push_back( make_pair("DataRow", dataRow));
+    value returnToken = build_json_object(pairToReturn);
+    message.reply(tempPair.first, returnToken);
   }
 } //End of Handle-Get
 
@@ -393,11 +279,18 @@ void handle_delete(http_request message) {
   the call below that hooks in a the appropriate
   listener.
 
+  Usage: authserver [memory [seed_file] | disk directory]
+    Keeps the tables in memory, loaded from seed_file, or in files in
+    directory, instead of in the Azure account in azure_keys.h (see
+    open_table_store()).
+  If TRACE_FILE is set, spans are written to it (see Trace.h).
+
   Wait for a carriage return, then shut the server down.
  */
 int main (int argc, char const * argv[]) {
 
-  table_cache.init(storage_connection_string);
+  start_tracing("AuthServer");
+  store = open_table_store(argc > 1 ? argv[1] : "azure", argc > 2 ? argv[2] : "");
 
   cout << "AuthServer: Parsing connection string" << endl;
 
@@ -0,0 +1,238 @@
+#include "AzureTableStore.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/base_uri.h>
+#include <cpprest/http_msg.h>
+
+#include <was/common.h>
+#include <was/storage_account.h>
+#include <was/table.h>
+
+using azure::storage::cloud_table;
+using azure::storage::cloud_table_client;
+using azure::storage::query_comparison_operator;
+using azure::storage::query_logical_operator;
+using azure::storage::storage_credentials;
+using azure::storage::storage_exception;
+using azure::storage::storage_uri;
+using azure::storage::table_batch_operation;
+using azure::storage::table_entity;
+using azure::storage::table_operation;
+using azure::storage::table_query;
+using azure::storage::table_query_iterator;
+using azure::storage::table_result;
+using azure::storage::table_shared_access_policy;
+
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+using web::http::uri;
+
+namespace {
+  // The status TableStore reports for e
+  status_code storage_status (const storage_exception& e) {
+    cout << "Azure Table Storage error: " << e.what() << endl;
+    cout << e.result().extended_error().message() << endl;
+    status_code code {static_cast<status_code>(e.result().http_status_code())};
+    if (code == status_codes::NotFound || code == status_codes::Conflict ||
+        code == status_codes::PreconditionFailed || code == status_codes::Forbidden)
+      return code;
+    return status_codes::InternalError;
+  }
+
+  table_operation to_operation (const store_op_t& op) {
+    switch (op.kind) {
+    case store_op_t::insert:            return table_operation::insert_entity(op.entity);
+    case store_op_t::merge:             return table_operation::merge_entity(op.entity);
+    case store_op_t::insert_or_merge:   return table_operation::insert_or_merge_entity(op.entity);
+    case store_op_t::insert_or_replace: return table_operation::insert_or_replace_entity(op.entity);
+    case store_op_t::replace:           return table_operation::replace_entity(op.entity);
+    default:                            return table_operation::delete_entity(op.entity);
+    }
+  }
+
+  void add_to_batch (table_batch_operation& batch, const store_op_t& op) {
+    switch (op.kind) {
+    case store_op_t::insert:            batch.insert_entity(op.entity); break;
+    case store_op_t::merge:             batch.merge_entity(op.entity); break;
+    case store_op_t::insert_or_merge:   batch.insert_or_merge_entity(op.entity); break;
+    case store_op_t::insert_or_replace: batch.insert_or_replace_entity(op.entity); break;
+    case store_op_t::replace:           batch.replace_entity(op.entity); break;
+    default:                            batch.delete_entity(op.entity); break;
+    }
+  }
+
+  status_code do_retrieve (const cloud_table& table, const string& partition, const string& row,
+                           table_entity& entity) {
+    try {
+      table_result result {table.execute(table_operation::retrieve_entity(partition, row))};
+      if (result.http_status_code() == status_codes::NotFound)
+        return status_codes::NotFound;
+      entity = result.entity();
+      entity.set_etag(result.etag());
+      return status_codes::OK;
+    }
+    catch (const storage_exception& e) {
+      return storage_status(e);
+    }
+  }
+
+  status_code do_write (const cloud_table& table, const store_op_t& op) {
+    try {
+      table.execute(to_operation(op));
+      return status_codes::OK;
+    }
+    catch (const storage_exception& e) {
+      return storage_status(e);
+    }
+  }
+
+  // Add condition to filter, which may be empty
+  void and_filter (string& filter, const string& condition) {
+    filter = filter.empty() ? condition
+      : table_query::combine_filter_conditions(filter, query_logical_operator::op_and, condition);
+  }
+
+  // The query filter that selects the entities of spec
+  string filter_of (const scan_t& spec) {
+    string filter {};
+    if ( ! spec.partition.empty())
+      and_filter(filter, table_query::generate_filter_condition("PartitionKey", query_comparison_operator::equal,
+                                                                spec.partition));
+    if ( ! spec.low.empty())
+      and_filter(filter, table_query::generate_filter_condition("RowKey",
+                                                                spec.low_inclusive ? query_comparison_operator::greater_than_or_equal
+                                                                                   : query_comparison_operator::greater_than,
+                                                                spec.low));
+    if ( ! spec.high.empty())
+      and_filter(filter, table_query::generate_filter_condition("RowKey",
+                                                                spec.high_inclusive ? query_comparison_operator::less_than_or_equal
+                                                                                    : query_comparison_operator::less_than,
+                                                                spec.high));
+    if ( ! spec.below_prop.empty())
+      and_filter(filter, table_query::generate_filter_condition(spec.below_prop, query_comparison_operator::less_than,
+                                                                spec.below_value));
+    if ( ! spec.start_partition.empty()) {
+      const string same_partition {
+        table_query::combine_filter_conditions(
+          table_query::generate_filter_condition("PartitionKey", query_comparison_operator::equal, spec.start_partition),
+          query_logical_operator::op_and,
+          table_query::generate_filter_condition("RowKey", query_comparison_operator::greater_than_or_equal, spec.start_row))};
+      and_filter(filter, table_query::combine_filter_conditions(
+                   table_query::generate_filter_condition("PartitionKey", query_comparison_operator::greater_than,
+                                                          spec.start_partition),
+                   query_logical_operator::op_or, same_partition));
+    }
+    return filter;
+  }
+}
+
+bool AzureTableStore::exists (const string& table) {
+  return table_cache.lookup_table(table).exists();
+}
+
+bool AzureTableStore::create_table (const string& table) {
+  return table_cache.lookup_table(table).create_if_not_exists();
+}
+
+bool AzureTableStore::delete_table (const string& table) {
+  bool existed {table_cache.lookup_table(table).delete_table_if_exists()};
+  table_cache.delete_entry(table);
+  return existed;
+}
+
+status_code AzureTableStore::retrieve (const string& table, const string& partition, const string& row,
+                                       table_entity& entity) {
+  return do_retrieve(table_cache.lookup_table(table), partition, row, entity);
+}
+
+status_code AzureTableStore::write (const string& table, const store_op_t& op) {
+  return do_write(table_cache.lookup_table(table), op);
+}
+
+status_code AzureTableStore::write_batch (const string& table, const vector<store_op_t>& ops) {
+  if (ops.empty())
+    return status_codes::OK;
+  table_batch_operation batch {};
+  for (const auto& op : ops)
+    add_to_batch(batch, op);
+  try {
+    table_cache.lookup_table(table).execute_batch(batch);
+    return status_codes::OK;
+  }
+  catch (const storage_exception& e) {
+    return storage_status(e);
+  }
+}
+
+status_code AzureTableStore::scan (const string& table, const scan_t& spec, const entity_fn& on_entity) {
+  table_query query {};
+  string filter {filter_of(spec)};
+  if ( ! filter.empty())
+    query.set_filter_string(filter);
+  if (spec.limit > 0)
+    query.set_take_count(static_cast<int>(spec.limit));
+  try {
+    size_t visited {0};
+    table_query_iterator end;
+    for (table_query_iterator it = table_cache.lookup_table(table).execute_query(query); it != end; ++it) {
+      if ( ! on_entity(*it) || (spec.limit > 0 && ++visited == spec.limit))
+        break;
+    }
+    return status_codes::OK;
+  }
+  catch (const storage_exception& e) {
+    return storage_status(e);
+  }
+}
+
+pair<status_code,string> AzureTableStore::get_token (const string& table, const string& partition, const string& row,
+                                                     uint8_t permissions, const utility::datetime& expiry) {
+  try {
+    string token {
+      table_cache.lookup_table(table).get_shared_access_signature(table_shared_access_policy {expiry, permissions},
+                                                                  string(), // Unnamed policy
+                                                                  // Start of range (inclusive)
+                                                                  partition,
+                                                                  row,
+                                                                  // End of range (inclusive)
+                                                                  partition,
+                                                                  row)};
+    return make_pair(status_codes::OK, token);
+  }
+  catch (const storage_exception& e) {
+    return make_pair(storage_status(e), string {});
+  }
+}
+
+/*
+  table as seen by a client holding only token. Tokens can contain
+  %2F ('/'), so token is passed on undecoded.
+ */
+cloud_table AzureTableStore::token_table (const string& table, const string& token) {
+  cloud_table_client client {storage_uri {uri {endpoint}}, storage_credentials {token}};
+  return client.get_table_reference(table);
+}
+
+status_code AzureTableStore::retrieve_with_token (const string& table, const string& token,
+                                                  const string& partition, const string& row,
+                                                  table_entity& entity) {
+  return do_retrieve(token_table(table, token), partition, row, entity);
+}
+
+status_code AzureTableStore::write_with_token (const string& table, const string& token, const store_op_t& op) {
+  return do_write(token_table(table, token), op);
+}
@@ -0,0 +1,61 @@
+#ifndef AzureTableStore_h
+#define AzureTableStore_h
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <was/table.h>
+
+#include "TableCache.h"
+#include "TableStore.h"
+
+/*
+  TableStore kept in an Azure Table Storage account
+
+  connection: the account's connection string
+  endpoint: the account's table endpoint, "http://STORAGE.table.core.windows.net/",
+    against which the *_with_token() operations are made
+
+  Storage exceptions are reported as the status they carry, if it is
+  one TableStore defines, and otherwise as InternalError. The table
+  operations (exists, create_table, delete_table) let them through.
+ */
+class AzureTableStore : public TableStore {
+private:
+  TableCache table_cache;
+  std::string endpoint;
+
+  azure::storage::cloud_table token_table (const std::string& table, const std::string& token);
+public:
+  AzureTableStore (const std::string& connection, const std::string& endpoint) :
+    table_cache {},
+    endpoint {endpoint}
+    {
+      table_cache.init(connection);
+    };
+
+  bool exists (const std::string& table) override;
+  bool create_table (const std::string& table) override;
+  bool delete_table (const std::string& table) override;
+
+  web::http::status_code retrieve (const std::string& table, const std::string& partition,
+                                   const std::string& row, azure::storage::table_entity& entity) override;
+  web::http::status_code write (const std::string& table, const store_op_t& op) override;
+  web::http::status_code write_batch (const std::string& table, const std::vector<store_op_t>& ops) override;
+  web::http::status_code scan (const std::string& table, const scan_t& spec, const entity_fn& on_entity) override;
+
+  std::pair<web::http::status_code,std::string>
+  get_token (const std::string& table, const std::string& partition, const std::string& row,
+             uint8_t permissions, const utility::datetime& expiry) override;
+  web::http::status_code retrieve_with_token (const std::string& table, const std::string& token,
+                                              const std::string& partition, const std::string& row,
+                                              azure::storage::table_entity& entity) override;
+  web::http::status_code write_with_token (const std::string& table, const std::string& token,
+                                           const store_op_t& op) override;
+};
+
+#endif
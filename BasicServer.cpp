@@ -3,7 +3,13 @@
  */
 
 #include <exception>
+#include <iterator>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -20,25 +26,20 @@
 #include <was/storage_account.h>
 #include <was/table.h>
 
-#include "TableCache.h"
+#include "ClientUtils.h"
+#include "DedupTable.h"
+#include "TableStore.h"
+#include "Trace.h"
+#include "WorkScheduler.h"
 //#include "config.h"
 #include "ServerUtils.h"
 #include "make_unique.h"
 
-#include "azure_keys.h"
-
 using azure::storage::cloud_storage_account;
 using azure::storage::storage_credentials;
-using azure::storage::storage_exception;
-using azure::storage::cloud_table;
-using azure::storage::cloud_table_client;
 using azure::storage::edm_type;
 using azure::storage::entity_property;
 using azure::storage::table_entity;
-using azure::storage::table_operation;
-using azure::storage::table_query;
-using azure::storage::table_query_iterator;
-using azure::storage::table_result;
 
 using pplx::extensibility::critical_section_t;
 using pplx::extensibility::scoped_critical_section_t;
@@ -50,11 +51,14 @@ using std::getline;
 using std::make_pair;
 using std::pair;
 using std::string;
+using std::map;
+using std::size_t;
 using std::unordered_map;
 using std::vector;
 
 using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
 using web::http::methods;
 using web::http::status_codes;
 using web::http::status_code;
@@ -64,7 +68,6 @@ using web::json::value;
 
 using web::http::experimental::listener::http_listener;
 
-using prop_vals_t = vector<pair<string,value>>;
 
 constexpr const char* def_url = "http://localhost:34568";
 
@@ -77,79 +80,131 @@ const string Update_Property {"UpdatePropertyAdmin"};
 const string read_entity {"ReadEntityAdmin"};
 const string read_entity_auth {"ReadEntityAuth"};
 const string update_entity_auth {"UpdateEntityAuth"};
+const string insert_entity_batch {"InsertEntityBatchAdmin"};
+const string read_entity_range {"ReadEntityRangeAdmin"};
+const string delete_entities_before {"DeleteEntitiesBeforeAdmin"};
+
+// Most operations Azure Table Storage accepts in one batch
+constexpr size_t max_batch_size {100};
+
+// Most entities ReadEntityRangeAdmin returns when no limit is given
+constexpr int default_range_limit {1000};
 
 /*
-  Cache of opened tables
+  Where the tables are kept, chosen in main()
  */
-TableCache table_cache {};
+std::unique_ptr<TableStore> store {};
 
 /*
-  Convert properties represented in Azure Storage type
-  to prop_vals_t type.
+  PUTs done recently, by idempotency key, so that a retried write
+  is acknowledged rather than applied twice
  */
-prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values = prop_vals_t {}) {
-  for (const auto v : properties) {
-    if (v.second.property_type() == edm_type::string) {
-      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
-    }
-    else if (v.second.property_type() == edm_type::datetime) {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-    else if(v.second.property_type() == edm_type::int32) {
-      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));
-    }
-    else if(v.second.property_type() == edm_type::int64) {
-      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));
-    }
-    else if(v.second.property_type() == edm_type::double_floating_point) {
-      values.push_back(make_pair(v.first, value::number(v.second.double_value())));
-    }
-    else if(v.second.property_type() == edm_type::boolean) {
-      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));
+DedupTable put_dedup {100000, std::chrono::seconds {600}};
+
+/*
+  Workers that run the handlers. Single-entity operations are
+  interactive; scans and the batch operations PushServer issues are
+  bulk, which may hold at most bulk_workers of them, so a burst of
+  bulk work cannot hold up the interactive requests queued behind it.
+ */
+enum work_class {interactive_work, bulk_work};
+constexpr size_t request_workers {16};
+constexpr size_t bulk_workers {12};
+WorkScheduler scheduler {{
+    work_class_t {"interactive", 4, request_workers, 10000},
+    work_class_t {"bulk", 1, bulk_workers, 1000}}};
+
+/*
+  Work class of message: full-table and whole-partition reads and the
+  operations on many entities are bulk, everything else interactive
+ */
+size_t request_class (const http_request& message) {
+  auto paths = uri::split_path(uri::decode(message.relative_uri().path()));
+  if (paths.empty())
+    return interactive_work;
+  if (paths[0] == insert_entity_batch || paths[0] == delete_entities_before)
+    return bulk_work;
+  if (message.method() == methods::GET && paths[0] == read_entity &&
+      (paths.size() < 4 || paths[3] == "*"))
+    return bulk_work;
+  return interactive_work;
+}
+
+/*
+  Read a batch request body, which maps each row key to an object of
+  property values, into rows. Returns false if the body is malformed.
+ */
+bool get_batch_rows (const unordered_map<string,string>& json_body,
+                     map<string,unordered_map<string,string>>& rows) {
+  for (const auto r : json_body) {
+    value row_props {};
+    try {
+      row_props = value::parse(r.second);
     }
-    else {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    catch (const web::json::json_exception&) {
     }
+    if ( ! row_props.is_object())
+      return false;
+    unordered_map<string,string>& props = rows[r.first];
+    for (const auto& v : row_props.as_object())
+      props[v.first] = v.second.is_string() ? v.second.as_string() : v.second.serialize();
   }
-  return values;
+  return true;
 }
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
+  Insert, or replace, one entity per row of one partition, with
+  max_batch_size entities in each batch. Nothing is read first, and
+  writing the same rows again leaves the same result.
+ */
+status_code insert_entities_batch (const string& table, const string& partition,
+                                   const map<string,unordered_map<string,string>>& rows) {
+  vector<store_op_t> batch {};
+  for (auto r = rows.begin(); r != rows.end(); ++r) {
+    table_entity entity {partition, r->first};
+    table_entity::properties_type& properties = entity.properties();
+    for (const auto v : r->second)
+      properties[v.first] = entity_property {v.second};
+    batch.push_back(store_op_t {store_op_t::insert_or_replace, entity});
 
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
+    if (batch.size() == max_batch_size || std::next(r) == rows.end()) {
+      if (store->write_batch(table, batch) != status_codes::OK)
+        return status_codes::InternalError;
+      batch.clear();
+    }
+  }
+  return status_codes::OK;
+}
+
+/*
+  Delete every entity whose string property prop sorts before before,
+  max_batch_size entities of one partition at a time.
+  Returns the number deleted.
  */
-unordered_map<string,string> get_json_body(http_request message) {
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-	  {
-            json = v;
-	    return true;
-	  })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-	results[v.first] = v.second.as_string();
-      }
-      else {
-	results[v.first] = v.second.serialize();
-      }
+size_t delete_before (const string& table, const string& prop, const string& before) {
+  scan_t older {};
+  older.below_prop = prop;
+  older.below_value = before;
+  map<string,vector<table_entity>> by_partition {};
+  store->scan(table, older, [&by_partition] (const table_entity& e)
+              {
+                by_partition[e.partition_key()].push_back(e);
+                return true;
+              });
+
+  size_t deleted {0};
+  for (const auto& p : by_partition) {
+    for (size_t i {0}; i < p.second.size(); i += max_batch_size) {
+      vector<store_op_t> batch {};
+      size_t n {std::min(max_batch_size, p.second.size() - i)};
+      for (size_t j {i}; j < i + n; ++j)
+        batch.push_back(store_op_t {store_op_t::remove, p.second[j]});
+      // On failure, most likely deleted by someone else meanwhile; the rest go next time
+      if (store->write_batch(table, batch) == status_codes::OK)
+        deleted += n;
     }
   }
-  return results;
+  return deleted;
 }
 
 /*
@@ -159,6 +214,10 @@ unordered_map<string,string> get_json_body(http_request message) {
   operands specify the value(s) to be retrieved.
  */
 void handle_get(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** GET " << path << endl;
   auto paths = uri::split_path(path);
@@ -170,64 +229,93 @@ void handle_get(http_request message) {
   //
   //initialize json_body
   unordered_map<string,string> json_body {get_json_body (message)};
-  //look up table and check if table exists or not
-  cloud_table table {table_cache.lookup_table(paths[1])};
+  //check if table exists or not
+  const string& table = paths[1];
 
-  if ( ! table.exists()) {
+  if ( ! store->exists(table)) {
     message.reply(status_codes::NotFound);//reply NotFound status if table doesn't exist
     return;
   }
 
 
+  /*
+    Entities of one partition with rows strictly between after and before,
+    in row order; "*" leaves that end of the range open:
+      GET ReadEntityRangeAdmin/<table>/<partition>/<after>/<before>[?limit=<n>]
+   */
+  if (paths[0] == read_entity_range) {
+    if (paths.size() != 5) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    int limit {default_range_limit};
+    auto query_params = uri::split_query(message.relative_uri().query());
+    auto limit_param (query_params.find("limit"));
+    if (limit_param != query_params.end())
+      limit = std::atoi(uri::decode(limit_param->second).c_str());
+    if (limit <= 0 || limit > default_range_limit)
+      limit = default_range_limit;
+
+    scan_t range {};
+    range.partition = paths[2];
+    if (paths[3] != "*")
+      range.low = paths[3];
+    if (paths[4] != "*")
+      range.high = paths[4];
+    range.limit = static_cast<size_t>(limit);
+
+    vector<value> key_vec;
+    store->scan(table, range, [&key_vec] (const table_entity& e)
+                {
+                  prop_vals_t keys {
+                    make_pair("Partition",value::string(e.partition_key())),
+                    make_pair("Row", value::string(e.row_key()))};
+                  keys = get_properties(e.properties(), keys);
+                  key_vec.push_back(value::object(keys));
+                  return true;
+                });
+    message.reply(status_codes::OK, value::array(key_vec));
+    return;
+  }
+
   if (paths[0] == read_entity) {
 
     // GET all entries in table or GET all entities containing all specified properties
     if (paths.size() == 2) {
-      table_query query {};
-      table_query_iterator end;
-      table_query_iterator it = table.execute_query(query);
       vector<value> key_vec;
 
 
-      int matching_property_num = 0;//initialize number of matching properties
-
-
       //if JSON body exits GET all entities containing all specified properties
       if(json_body.size() > 0){
-        while (it != end) {//goes through the table, entity by entity
-          matching_property_num = 0;
-          for (const auto v : json_body) {//goes through json body pair by pair
-            for (const auto p : it->properties()) {//goes through all the properties in each entity
-              if(v.first == p.first){
-                //increment by 1 whenever there's a matching property and break
+        store->scan(table, scan_t {}, [&json_body, &key_vec] (const table_entity& e) {//goes through the table, entity by entity
+            size_t matching_property_num = 0;//initialize number of matching properties
+            for (const auto& v : json_body) {//goes through json body pair by pair
+              //increment by 1 whenever the entity has a matching property
+              if (e.properties().find(v.first) != e.properties().end())
                 matching_property_num++;
-                break;
-              }
             }
-          }
-          //if all property names in JSON are included in the entity push keys to key_vec
-          if(matching_property_num == json_body.size()){
-            prop_vals_t keys {
-        make_pair("Partition",value::string(it->partition_key())),
-        make_pair("Row", value::string(it->row_key()))};
-            keys = get_properties(it->properties(), keys);
-            key_vec.push_back(value::object(keys));
-          }
-          ++it;
-        }
+            //if all property names in JSON are included in the entity push keys to key_vec
+            if(matching_property_num == json_body.size()){
+              prop_vals_t keys {
+                make_pair("Partition",value::string(e.partition_key())),
+                make_pair("Row", value::string(e.row_key()))};
+              keys = get_properties(e.properties(), keys);
+              key_vec.push_back(value::object(keys));
+            }
+            return true;
+          });
       }
       //GET all entries in table
       else{
-        while (it != end) {
-          cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-          prop_vals_t keys {
-      make_pair("Partition",value::string(it->partition_key())),
-      make_pair("Row", value::string(it->row_key()))};
-          keys = get_properties(it->properties(), keys);
-          key_vec.push_back(value::object(keys));
-
-          ++it;
-        }
+        store->scan(table, scan_t {}, [&key_vec] (const table_entity& e) {
+            cout << "Key: " << e.partition_key() << " / " << e.row_key() << endl;
+            prop_vals_t keys {
+              make_pair("Partition",value::string(e.partition_key())),
+              make_pair("Row", value::string(e.row_key()))};
+            keys = get_properties(e.properties(), keys);
+            key_vec.push_back(value::object(keys));
+            return true;
+          });
       }
       message.reply(status_codes::OK, value::array(key_vec));
       return;
@@ -240,39 +328,34 @@ void handle_get(http_request message) {
     }
     //Get all entities containing all specified properties:
     if(paths[3] == "*"){
-      table_query query {};
-      table_query_iterator end;
-      table_query_iterator it = table.execute_query(query);
+      scan_t partition {};
+      partition.partition = paths[2];
       vector<value> key_vec;
-      //if partition name the entity equals the parameter partition push keys to key_vec
-      while (it != end) {
-        cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-        prop_vals_t keys {
-    make_pair("Partition",value::string(it->partition_key())),
-    make_pair("Row", value::string(it->row_key()))};
-        keys = get_properties(it->properties(), keys);
-        if(paths[2] == it->partition_key()){
+      //push keys of each entity of the partition to key_vec
+      store->scan(table, partition, [&key_vec] (const table_entity& e) {
+          cout << "Key: " << e.partition_key() << " / " << e.row_key() << endl;
+          prop_vals_t keys {
+            make_pair("Partition",value::string(e.partition_key())),
+            make_pair("Row", value::string(e.row_key()))};
+          keys = get_properties(e.properties(), keys);
           key_vec.push_back(value::object(keys));
-        }
-
-        ++it;
-      }
+          return true;
+        });
 
       message.reply(status_codes::OK, value::array(key_vec));
       return;
     }
     // GET specific entry: Partition == paths[2], Row == paths[3]
 
-    table_operation retrieve_operation {table_operation::retrieve_entity(paths[2], paths[3])};
-    table_result retrieve_result {table.execute(retrieve_operation)};
-    cout << "HTTP code: " << retrieve_result.http_status_code() << endl;
-    if (retrieve_result.http_status_code() == status_codes::NotFound) {
-      message.reply(status_codes::NotFound);
+    table_entity entity {};
+    status_code retrieved {store->retrieve(table, paths[2], paths[3], entity)};
+    cout << "HTTP code: " << retrieved << endl;
+    if (retrieved != status_codes::OK) {
+      message.reply(retrieved);
       return;
     }
 
-    table_entity entity {retrieve_result.entity()};
-    table_entity::properties_type properties {entity.properties()};
+    const table_entity::properties_type& properties = entity.properties();
 
     // If the entity has any properties, return them as JSON
     prop_vals_t values (get_properties(properties));
@@ -286,17 +369,20 @@ void handle_get(http_request message) {
       message.reply(status_codes::BadRequest);
       return;
     }
-    pair<status_code, table_entity> p1 = read_with_token (message, tables_endpoint);
+    pair<status_code, table_entity> p1 = read_with_token (message, *store);
 
     table_entity entity {p1.second};
     table_entity::properties_type properties {entity.properties()};
 
     // If the entity has any properties, return them as JSON
     prop_vals_t values (get_properties(properties));
+    http_response response {values.size() > 0 ? status_codes::OK : p1.first};
+    // Expose the ETag so the client can make a conditional UpdateEntityAuth
+    if (p1.first == status_codes::OK && ! entity.etag().empty())
+      response.headers().add("ETag", entity.etag());
     if (values.size() > 0)
-      message.reply(status_codes::OK, value::object(values));
-    else
-      message.reply(p1.first);
+      response.set_body(value::object(values));
+    message.reply(response);
     return;
   }
 
@@ -306,6 +392,10 @@ void handle_get(http_request message) {
   Top-level routine for processing all HTTP POST requests.
  */
 void handle_post(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** POST " << path << endl;
   auto paths = uri::split_path(path);
@@ -316,13 +406,11 @@ void handle_post(http_request message) {
   }
 
   string table_name {paths[1]};
-  cloud_table table {table_cache.lookup_table(table_name)};
 
   // Create table (idempotent if table exists)
   if (paths[0] == create_table) {
     cout << "Create " << table_name << endl;
-    bool created {table.create_if_not_exists()};
-    cout << "Administrative table URI " << table.uri().primary_uri().to_string() << endl;
+    bool created {store->create_table(table_name)};
     if (created)
       message.reply(status_codes::Created);
     else
@@ -346,19 +434,45 @@ status_codes::OK (200): Table found and all entities extended with the specified
 
 
 void handle_put(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
+  if (reply_if_repeated(message, put_dedup))
+    return;
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** PUT " << path << endl;
   auto paths = uri::split_path(path);
   // Need at least an operation, table name, partition, and row
   unordered_map<string,string> json_body {get_json_body (message)}; //getting json body
 
+  /*
+    Replace, without reading, many entities in one partition:
+      PUT InsertEntityBatchAdmin/<table>/<partition>
+    The body maps each row key to an object of its properties
+   */
+  if (paths.size() == 3 && paths[0] == insert_entity_batch) {
+    if ( ! store->exists(paths[1])) {
+      message.reply(status_codes::NotFound);
+      return;
+    }
+    map<string,unordered_map<string,string>> rows {};
+    if ( ! get_batch_rows(json_body, rows)) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    cout << paths[0] << " of " << rows.size() << " in " << paths[2] << endl;
+    message.reply(insert_entities_batch(paths[1], paths[2], rows));
+    return;
+  }
+
   if (paths.size() < 4) {
     message.reply(status_codes::BadRequest);
     return;
   }
 
-  cloud_table table {table_cache.lookup_table(paths[1])};
-  if ( ! table.exists()) {
+  const string& table = paths[1];
+  if ( ! store->exists(table)) {
     message.reply(status_codes::NotFound);
     return;
   }
@@ -367,17 +481,12 @@ void handle_put(http_request message) {
 
 
   if(paths[0] == update_entity_auth){
-    try{//reply status code which update_with_token (message, tables_endpoint, json_body) returns
-      message.reply( update_with_token (message, tables_endpoint, json_body));
-    }
-    catch (const storage_exception& e) {//catch exception
-      cout << "Azure Table Storage error: " << e.what() << endl;
-      cout << e.result().extended_error().message() << endl;
-      if (e.result().http_status_code() == status_codes::Forbidden)
-        message.reply(status_codes::Forbidden);
-      else
-        message.reply(status_codes::InternalError);
-    }
+    //reply status code which update_with_token (message, *store, json_body) returns
+    // An If-Match header makes the write conditional on the entity's ETag
+    const http_headers& headers {message.headers()};
+    auto if_match (headers.find("If-Match"));
+    string etag {if_match == headers.end() ? string {} : if_match->second};
+    message.reply( update_with_token (message, *store, json_body, etag));
     return;
   }
 
@@ -448,10 +557,7 @@ void handle_put(http_request message) {
       properties[v.first] = entity_property {v.second};
     }
 
-    table_operation operation {table_operation::insert_or_merge_entity(entity)};
-    table_result op_result {table.execute(operation)};
-
-    message.reply(status_codes::OK);
+    message.reply(store->write(table, store_op_t {store_op_t::insert_or_merge, entity}));
   }
   else {
     message.reply(status_codes::BadRequest);
@@ -462,6 +568,10 @@ void handle_put(http_request message) {
   Top-level routine for processing all HTTP DELETE requests.
  */
 void handle_delete(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** DELETE " << path << endl;
   auto paths = uri::split_path(path);
@@ -472,16 +582,30 @@ void handle_delete(http_request message) {
   }
 
   string table_name {paths[1]};
-  cloud_table table {table_cache.lookup_table(table_name)};
 
   // Delete table
   if (paths[0] == delete_table) {
     cout << "Delete " << table_name << endl;
-    if ( ! table.exists()) {
+    if ( ! store->delete_table(table_name))
       message.reply(status_codes::NotFound);
+    else
+      message.reply(status_codes::OK);
+  }
+  /*
+    Delete every entity whose property sorts before a value:
+      DELETE DeleteEntitiesBeforeAdmin/<table>/<property>/<before>
+   */
+  else if (paths[0] == delete_entities_before) {
+    if (paths.size() != 4) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    if ( ! store->exists(table_name)) {
+      message.reply(status_codes::NotFound);
+      return;
     }
-    table.delete_table();
-    table_cache.delete_entry(table_name);
+    size_t deleted {delete_before(table_name, paths[2], paths[3])};
+    cout << "Deleted " << deleted << " with " << paths[2] << " before " << paths[3] << endl;
     message.reply(status_codes::OK);
   }
   // Delete entity
@@ -494,15 +618,7 @@ void handle_delete(http_request message) {
     table_entity entity {paths[2], paths[3]};
     cout << "Delete " << entity.partition_key() << " / " << entity.row_key()<< endl;
 
-    table_operation operation {table_operation::delete_entity(entity)};
-    table_result op_result {table.execute(operation)};
-
-    int code {op_result.http_status_code()};
-    if (code == status_codes::OK ||
-	code == status_codes::NoContent)
-      message.reply(status_codes::OK);
-    else
-      message.reply(code);
+    message.reply(store->write(table_name, store_op_t {store_op_t::remove, entity}));
   }
   else {
     message.reply(status_codes::BadRequest);
@@ -512,6 +628,12 @@ void handle_delete(http_request message) {
 /*
   Main server routine
 
+  Usage: basicserver [memory [seed_file] | disk directory]
+    Keeps the tables in memory, loaded from seed_file, or in files in
+    directory, instead of in the Azure account in azure_keys.h (see
+    open_table_store()).
+  If TRACE_FILE is set, spans are written to it (see Trace.h).
+
   Install handlers for the HTTP requests and open the listener,
   which processes each request asynchronously.
 
@@ -519,13 +641,20 @@ void handle_delete(http_request message) {
  */
 int main (int argc, char const * argv[]) {
 
-  table_cache.init(storage_connection_string);
+  start_tracing("BasicServer");
+  store = open_table_store(argc > 1 ? argv[1] : "azure", argc > 2 ? argv[2] : "");
+
+  scheduler.start(request_workers);
 
   http_listener listener {def_url};
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
-  listener.support(methods::DEL, &handle_delete);
+  listener.support(methods::GET, [] (http_request message) {
+      schedule_request(scheduler, request_class(message), message, &handle_get); });
+  listener.support(methods::POST, [] (http_request message) {
+      schedule_request(scheduler, request_class(message), message, &handle_post); });
+  listener.support(methods::PUT, [] (http_request message) {
+      schedule_request(scheduler, request_class(message), message, &handle_put); });
+  listener.support(methods::DEL, [] (http_request message) {
+      schedule_request(scheduler, request_class(message), message, &handle_delete); });
   listener.open().wait(); // Wait for listener to complete starting
 
   cout << "Enter carriage return to stop server." << endl;
@@ -534,5 +663,6 @@ int main (int argc, char const * argv[]) {
 
   // Shut it down
   listener.close().wait();
+  scheduler.stop();
   cout << "Closed" << endl;
 }
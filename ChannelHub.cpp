@@ -0,0 +1,141 @@
+#include "ChannelHub.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+#include <pplx/threadpool.h>
+
+using std::make_shared;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::uint64_t;
+using std::vector;
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+using boost::asio::steady_timer;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using web::json::value;
+
+/*
+  One waiting poll. Whichever of publish() and the timer gets to it
+  first sets done and completes it.
+ */
+struct ChannelHub::waiter_t {
+  pplx::task_completion_event<poll_result_t> tce;
+  uint64_t after;
+  std::atomic<bool> done;
+
+  explicit waiter_t (uint64_t after) :
+    tce {},
+    after {after},
+    done {false}
+    {};
+};
+
+poll_result_t ChannelHub::events_after (const channel_t& channel, uint64_t after) {
+  // A poller from before a restart may be ahead of the new channel
+  if (after > channel.last_seq)
+    after = 0;
+  poll_result_t result {channel.last_seq, vector<value> {}};
+  for (const auto& e : channel.recent) {
+    if (e.first > after)
+      result.events.push_back(e.second);
+  }
+  return result;
+}
+
+/*
+  Drop the channels nobody has polled for idle_time
+ */
+void ChannelHub::prune () {
+  steady_clock::time_point now {steady_clock::now()};
+  for (auto it = channels.begin(); it != channels.end(); ) {
+    if (it->second->waiters.empty() && now - it->second->last_used > idle_time)
+      it = channels.erase(it);
+    else
+      ++it;
+  }
+}
+
+pplx::task<poll_result_t> ChannelHub::poll (const string& key, uint64_t after, milliseconds timeout) {
+  shared_ptr<waiter_t> waiter {};
+  {
+    scoped_critical_section_t lock {hublock};
+    if (++polls % 1024 == 0)
+      prune();
+    shared_ptr<channel_t>& channel = channels[key];
+    if ( ! channel)
+      channel = make_shared<channel_t>(channel_t {{}, 0, {}, steady_clock::now()});
+    channel->last_used = steady_clock::now();
+    poll_result_t ready {events_after(*channel, after)};
+    if ( ! ready.events.empty() || timeout.count() <= 0)
+      return pplx::task_from_result(ready);
+    waiter = make_shared<waiter_t>(after);
+    channel->waiters.push_back(waiter);
+  }
+
+  shared_ptr<steady_timer> timer {make_shared<steady_timer>(crossplat::threadpool::shared_instance().service())};
+  timer->expires_from_now(timeout);
+  timer->async_wait([this, key, waiter, timer] (const boost::system::error_code&)
+                    {
+                      if (waiter->done.exchange(true))
+                        return;
+                      uint64_t next {waiter->after};
+                      {
+                        scoped_critical_section_t lock {hublock};
+                        auto channel (channels.find(key));
+                        if (channel != channels.end()) {
+                          auto& waiters = channel->second->waiters;
+                          waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+                          channel->second->last_used = steady_clock::now();
+                          next = std::min(next, channel->second->last_seq);
+                        }
+                      }
+                      waiter->tce.set(poll_result_t {next, vector<value> {}});
+                    });
+  return pplx::create_task(waiter->tce);
+}
+
+void ChannelHub::publish (const string& key, const value& event) {
+  vector<std::pair<shared_ptr<waiter_t>,poll_result_t>> completed {};
+  {
+    scoped_critical_section_t lock {hublock};
+    auto found (channels.find(key));
+    if (found == channels.end())
+      return;
+    channel_t& channel = *found->second;
+    channel.recent.push_back(std::make_pair(++channel.last_seq, event));
+    if (channel.recent.size() > max_recent)
+      channel.recent.pop_front();
+    for (const auto& w : channel.waiters) {
+      if ( ! w->done.exchange(true))
+        completed.push_back(std::make_pair(w, events_after(channel, w->after)));
+    }
+    channel.waiters.clear();
+  }
+  // Outside the lock, as completing a poll runs its reply
+  for (const auto& c : completed)
+    c.first->tce.set(c.second);
+}
+
+size_t ChannelHub::waiting () {
+  scoped_critical_section_t lock {hublock};
+  size_t n {0};
+  for (const auto& c : channels)
+    n += c.second->waiters.size();
+  return n;
+}
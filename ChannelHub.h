@@ -0,0 +1,76 @@
+#ifndef ChannelHub_h
+#define ChannelHub_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  What a long poll returns: the events after the sequence number the
+  caller gave, and the number to pass next time
+ */
+struct poll_result_t {
+  std::uint64_t next;
+  std::vector<web::json::value> events;
+};
+
+/*
+  In-memory channels of events, one per user, for long polls
+
+  publish() adds an event to a user's channel and completes every
+  poll waiting on it. Only users who have polled recently have a
+  channel; events for anyone else are dropped, as they will read
+  them from storage. Each channel keeps its most recent events so a
+  poller that was briefly away between polls does not miss them.
+ */
+class ChannelHub {
+private:
+  struct waiter_t;
+
+  struct channel_t {
+    std::deque<std::pair<std::uint64_t,web::json::value>> recent;
+    std::uint64_t last_seq;
+    std::vector<std::shared_ptr<waiter_t>> waiters;
+    std::chrono::steady_clock::time_point last_used;
+  };
+
+  std::unordered_map<std::string,std::shared_ptr<channel_t>> channels;
+  pplx::extensibility::critical_section_t hublock;
+  std::size_t max_recent;
+  std::chrono::minutes idle_time;
+  std::size_t polls;
+
+  static poll_result_t events_after (const channel_t& channel, std::uint64_t after);
+  void prune ();
+public:
+  ChannelHub () :
+    channels {},
+    hublock {},
+    max_recent {64},
+    idle_time {5},
+    polls {0}
+    {};
+
+  /*
+    Wait for the events of key's channel after sequence number after.
+    Completes at once if there are some, otherwise with the first
+    event published, or with no events once timeout passes.
+   */
+  pplx::task<poll_result_t> poll (const std::string& key, std::uint64_t after, std::chrono::milliseconds timeout);
+
+  void publish (const std::string& key, const web::json::value& event);
+
+  // Number of polls waiting now
+  std::size_t waiting ();
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include "CircuitBreaker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <pplx/pplxtasks.h>
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+
+using std::chrono::duration_cast;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+/*
+  Return the bucket for the current second, clearing it if it
+  last held an older second that has rotated out of the window
+ */
+CircuitBreaker::bucket_t& CircuitBreaker::current_bucket(steady_clock::time_point now) {
+  long long second {duration_cast<seconds>(now.time_since_epoch()).count()};
+  bucket_t& b (buckets[second % buckets.size()]);
+  if (b.second != second)
+    b = bucket_t {second, 0, 0};
+  return b;
+}
+
+void CircuitBreaker::open(steady_clock::time_point now) {
+  state = state_t::open;
+  opened_at = now;
+  probe_in_flight = false;
+}
+
+/*
+  Return true if a request may be sent now
+
+  A caller that is allowed through must report the outcome with record().
+ */
+bool CircuitBreaker::allow_request() {
+  scoped_critical_section_t lock {breakerlock};
+  steady_clock::time_point now {steady_clock::now()};
+  if (state == state_t::open && now - opened_at >= config.open_time)
+    state = state_t::half_open;
+  if (state == state_t::closed)
+    return true;
+  if (state == state_t::half_open && ! probe_in_flight) {
+    probe_in_flight = true;
+    return true;
+  }
+  return false;
+}
+
+void CircuitBreaker::record(bool success) {
+  scoped_critical_section_t lock {breakerlock};
+  steady_clock::time_point now {steady_clock::now()};
+  bucket_t& b (current_bucket(now));
+  ++b.requests;
+  if ( ! success)
+    ++b.failures;
+  if (success)
+    retry_tokens = std::min(config.max_retry_tokens, retry_tokens + config.retry_ratio);
+
+  if (state == state_t::half_open) {
+    if (success) {
+      state = state_t::closed;
+      probe_in_flight = false;
+      for (auto& old : buckets)
+        old = bucket_t {-1, 0, 0};
+    }
+    else
+      open(now);
+    return;
+  }
+  if (state != state_t::closed || success)
+    return;
+
+  // Only a failure can trip the breaker, so only then total the window
+  long long oldest {b.second - static_cast<long long>(buckets.size()) + 1};
+  unsigned int requests {0};
+  unsigned int failures {0};
+  for (const auto& w : buckets) {
+    if (w.second >= oldest) {
+      requests += w.requests;
+      failures += w.failures;
+    }
+  }
+  if (requests >= config.min_requests &&
+      failures >= config.failure_ratio * requests)
+    open(now);
+}
+
+/*
+  Return true, spending one retry from the budget, if a failed
+  request may be retried
+ */
+bool CircuitBreaker::allow_retry() {
+  scoped_critical_section_t lock {breakerlock};
+  if (state != state_t::closed || retry_tokens < 1.0)
+    return false;
+  retry_tokens -= 1.0;
+  return true;
+}
+
+CircuitBreaker::state_t CircuitBreaker::current_state() {
+  scoped_critical_section_t lock {breakerlock};
+  return state;
+}
+
+shared_ptr<CircuitBreaker> BreakerCache::lookup_breaker(const string& host) {
+  scoped_critical_section_t lock {resplock};
+
+  auto entry (breaker_cache.find(host));
+  if (entry == breaker_cache.end()) {
+    shared_ptr<CircuitBreaker> breaker {make_shared<CircuitBreaker>(config)};
+    breaker_cache[host] = breaker;
+    return breaker;
+  }
+  return entry->second;
+}
@@ -0,0 +1,105 @@
+#ifndef CircuitBreaker_h
+#define CircuitBreaker_h
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+// Settings shared by every CircuitBreaker in a BreakerCache
+struct breaker_config_t {
+  // Seconds of history in the rolling error-rate window
+  unsigned int window_seconds;
+  // Fewest requests in the window before the breaker may open
+  unsigned int min_requests;
+  // Fraction of failed requests in the window that opens the breaker
+  double failure_ratio;
+  // How long an open breaker rejects requests before letting a probe through
+  std::chrono::milliseconds open_time;
+  // Retries allowed per successful request, on average
+  double retry_ratio;
+  // Most retries that can be banked while things are healthy
+  double max_retry_tokens;
+};
+
+/*
+  Circuit breaker for one downstream host
+
+  Closed: requests flow, and their outcomes are counted in a rolling
+    window of one-second buckets. When the window holds at least
+    min_requests and failure_ratio of them failed, the breaker opens.
+  Open: requests are rejected without being sent until open_time
+    has passed, then the breaker becomes half-open.
+  Half-open: a single probe request is let through. Its success
+    closes the breaker; its failure opens it again.
+
+  The breaker also keeps a retry budget: each success earns
+  retry_ratio of a retry, and each retry spends one, so retries
+  can never multiply the load on a host that is failing.
+ */
+class CircuitBreaker {
+public:
+  enum class state_t { closed, open, half_open };
+private:
+  struct bucket_t {
+    long long second;
+    unsigned int requests;
+    unsigned int failures;
+  };
+
+  breaker_config_t config;
+  std::vector<bucket_t> buckets;
+  state_t state;
+  std::chrono::steady_clock::time_point opened_at;
+  bool probe_in_flight;
+  double retry_tokens;
+  pplx::extensibility::critical_section_t breakerlock;
+
+  bucket_t& current_bucket(std::chrono::steady_clock::time_point now);
+  void open(std::chrono::steady_clock::time_point now);
+public:
+  explicit CircuitBreaker (const breaker_config_t& conf) :
+    config (conf),
+    buckets (conf.window_seconds, bucket_t {-1, 0, 0}),
+    state {state_t::closed},
+    opened_at {},
+    probe_in_flight {false},
+    retry_tokens {conf.max_retry_tokens},
+    breakerlock {}
+    {};
+
+  bool allow_request();
+  void record(bool success);
+  bool allow_retry();
+  state_t current_state();
+};
+
+/*
+  Cache of circuit breakers, one per host
+ */
+class BreakerCache {
+private:
+  breaker_config_t config;
+  std::unordered_map<std::string,std::shared_ptr<CircuitBreaker>> breaker_cache;
+  pplx::extensibility::critical_section_t resplock;
+public:
+  BreakerCache () :
+    config {10, 20, 0.5, std::chrono::milliseconds {5000}, 0.1, 10.0},
+    breaker_cache {},
+    resplock {}
+    {};
+
+  // Replace the settings and forget every breaker's history
+  void init(const breaker_config_t& conf) {
+    pplx::extensibility::scoped_critical_section_t lock {resplock};
+    config = conf;
+    breaker_cache.clear();
+  };
+
+  std::shared_ptr<CircuitBreaker> lookup_breaker(const std::string& host);
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include "ClientCache.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <cpprest/http_client.h>
+
+#include <pplx/pplxtasks.h>
+
+using pplx::extensibility::critical_section_t;
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::make_shared;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::uri;
+
+using web::http::client::http_client;
+using web::http::client::http_client_config;
+
+pplx::task<void> HostSlots::acquire() {
+  scoped_critical_section_t lock {slotlock};
+  if (available > 0) {
+    --available;
+    return pplx::task_from_result();
+  }
+  pplx::task_completion_event<void> waiter {};
+  waiters.push_back(waiter);
+  return pplx::create_task(waiter);
+}
+
+void HostSlots::release() {
+  pplx::task_completion_event<void> next {};
+  {
+    scoped_critical_section_t lock {slotlock};
+    if (waiters.empty()) {
+      ++available;
+      return;
+    }
+    next = waiters.front();
+    waiters.pop_front();
+  }
+  // Hand the slot straight to the oldest waiter, outside the lock
+  next.set();
+}
+
+ClientCache::host_entry ClientCache::lookup_host(const uri& base_uri) {
+  scoped_critical_section_t lock {resplock};
+
+  const string key {base_uri.to_string()};
+  auto entry (client_cache.find(key));
+  if (entry != client_cache.end())
+    return entry->second;
+
+  http_client_config config {};
+  config.set_timeout(client_timeout);
+  host_entry host {make_shared<http_client>(base_uri, config),
+                   max_connections_per_host > 0 ? make_shared<HostSlots>(max_connections_per_host)
+                                                : shared_ptr<HostSlots> {}};
+  if (pooled)
+    client_cache[key] = host;
+  return host;
+}
+
+/*
+  Send request to the host at base_uri
+
+  The request's URI must be relative to base_uri. If the host already
+  has max_connections_per_host requests in flight, the request waits
+  for one of them to finish. Cancelling token abandons the request,
+  whether it is still waiting or already sent.
+ */
+pplx::task<http_response> ClientCache::request(const uri& base_uri, http_request request,
+                                               const pplx::cancellation_token& token) {
+  if ( ! keep_alive)
+    request.headers().add("Connection", "close");
+
+  host_entry host {lookup_host(base_uri)};
+  if ( ! host.slots)
+    return host.client->request(request, token);
+
+  shared_ptr<HostSlots> slots {host.slots};
+  shared_ptr<http_client> client {host.client};
+  return slots->acquire()
+    .then([client, request, token] ()
+          {
+            // Don't send a request whose caller gave up while it queued
+            if (token.is_canceled())
+              pplx::cancel_current_task();
+            return client->request(request, token);
+          })
+    .then([slots] (pplx::task<http_response> response)
+          {
+            slots->release();
+            return response;
+          });
+}
+
+bool ClientCache::delete_entry(const string& base_uri) {
+  scoped_critical_section_t lock {resplock};
+
+  size_t count {client_cache.erase(base_uri)};
+  return count == 1;
+}
@@ -0,0 +1,100 @@
+#ifndef ClientCache_h
+#define ClientCache_h
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <cpprest/http_client.h>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Counting semaphore bounding the requests in flight to one host
+
+  acquire() returns a task that completes once a slot is free,
+  so callers queue without tying up a thread.
+ */
+class HostSlots {
+private:
+  std::size_t available;
+  std::deque<pplx::task_completion_event<void>> waiters;
+  pplx::extensibility::critical_section_t slotlock;
+public:
+  explicit HostSlots (std::size_t slots) :
+    available {slots},
+    waiters {},
+    slotlock {}
+    {};
+
+  pplx::task<void> acquire();
+  void release();
+};
+
+/*
+  Cache of http_clients, one per base URI (scheme, host, and port)
+
+  Reusing a client lets cpprest keep its connections to that host
+  open between requests instead of connecting for every request.
+ */
+class ClientCache {
+private:
+  struct host_entry {
+    std::shared_ptr<web::http::client::http_client> client;
+    std::shared_ptr<HostSlots> slots;
+  };
+
+  std::unordered_map<std::string,host_entry> client_cache;
+  pplx::extensibility::critical_section_t resplock;
+  std::size_t max_connections_per_host;
+  bool keep_alive;
+  bool pooled;
+  std::chrono::seconds client_timeout;
+
+  host_entry lookup_host(const web::uri& base_uri);
+public:
+  ClientCache () :
+    client_cache {},
+    resplock {},
+    max_connections_per_host {32},
+    keep_alive {true},
+    pooled {true},
+    client_timeout {30}  // cpprest's default
+    {};
+
+  /*
+    max_connections: most requests in flight to one host (0 for no limit)
+    timeout: longest the clients wait on the reply to a request
+   */
+  ClientCache (std::size_t max_connections, std::chrono::seconds timeout) :
+    client_cache {},
+    resplock {},
+    max_connections_per_host {max_connections},
+    keep_alive {true},
+    pooled {true},
+    client_timeout {timeout}
+    {};
+
+  /*
+    max_connections: most requests in flight to one host (0 for no limit)
+    keep: keep connections open between requests
+    reuse: reuse clients; false creates a client per request, as
+      do_request() did before clients were pooled
+   */
+  void init(std::size_t max_connections, bool keep, bool reuse) {
+    pplx::extensibility::scoped_critical_section_t lock {resplock};
+    max_connections_per_host = max_connections;
+    keep_alive = keep;
+    pooled = reuse;
+    client_cache.clear();
+  };
+
+  pplx::task<web::http::http_response> request(const web::uri& base_uri, web::http::http_request request,
+                                               const pplx::cancellation_token& token = pplx::cancellation_token::none());
+  bool delete_entry(const std::string& base_uri);
+};
+
+#endif
@@ -9,33 +9,76 @@
 #include "ClientUtils.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <utility>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/utility/string_ref.hpp>
+
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
+#include <cpprest/streams.h>
 
 #include <pplx/pplxtasks.h>
+#include <pplx/threadpool.h>
+
+#include "Trace.h"
+
+using boost::asio::steady_timer;
 
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::atomic;
 using std::make_pair;
+using std::make_shared;
 using std::pair;
+using std::shared_ptr;
+using std::size_t;
 using std::string;
 using std::unordered_map;
 using std::vector;
 
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::chrono::time_point;
+
 using web::http::http_headers;
 using web::http::http_request;
 using web::http::http_response;
 using web::http::method;
+using web::http::methods;
 using web::http::status_code;
 using web::http::status_codes;
-
-using web::http::client::http_client;
+using web::http::uri;
 
 using web::json::object;
 using web::json::value;
 
+ClientCache client_cache {};
+
+// The clients' own timeout only backs up the request's deadline
+ClientCache long_poll_cache {0, std::chrono::seconds {600}};
+
+BreakerCache breaker_cache {};
+
 /*
   Make an HTTP request, returning the status code and any JSON value in the body
 
@@ -62,42 +105,548 @@ using web::json::value;
   ambiguous in some edge cases that don't matter for these 
   assignments.
 
+  If the request does not complete by its deadline (see
+  do_request_async() below), the status code is GatewayTimeout.
+
+  The five-argument version additionally sends req_headers with
+  the request and copies every header of the response into
+  resp_headers. Use it for conditional requests, such as
+  reading an entity's ETag and passing it back as If-Match.
+
+  Requests are sent through client_cache, which keeps one http_client
+  per scheme/host/port so that connections to the other servers are
+  reused rather than opened afresh for every request. Call
+  client_cache.init() to change the per-host connection limit or
+  to turn keep-alive or pooling off. Long polls (call_opts_t::long_poll)
+  go through long_poll_cache instead, which has no such limit.
+
   You're welcome to read this code but bear in mind: It's the single
   trickiest part of the sample code. You can just call it without
   attending to its internals, if you prefer.
  */
 
-// Version with explicit third argument
-pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body) {
-  http_request request {http_method};
-  if (req_body != value {}) {
+const string deadline_header {"X-Deadline-Ms"};
+
+const string idempotency_key_header {"Idempotency-Key"};
+
+milliseconds default_request_timeout {30000};
+
+double hedge_percentile {0.95};
+
+unsigned int max_retries {2};
+
+milliseconds retry_backoff {50};
+
+namespace {
+  // Deadline of the DeadlineScope currently open on this thread
+  thread_local deadline_t scope_deadline {deadline_t::max()};
+
+  // Fewest samples an endpoint needs before its GETs are hedged
+  constexpr size_t min_hedge_samples {20};
+  // Most recent latencies kept per endpoint
+  constexpr size_t latency_window {128};
+
+  /*
+    Recent latencies of successful requests, per endpoint
+
+    An endpoint is a host plus the operation (first path segment),
+    so that a slow full-table read does not set the hedging delay
+    for single-entity reads on the same server.
+   */
+  class LatencyTracker {
+  private:
+    struct window_t {
+      vector<microseconds> samples;
+      size_t next;
+    };
+    unordered_map<string,window_t> windows;
+    pplx::extensibility::critical_section_t latlock;
+  public:
+    LatencyTracker () :
+      windows {},
+      latlock {}
+      {};
+
+    void record (const string& endpoint, microseconds latency) {
+      scoped_critical_section_t lock {latlock};
+      window_t& w (windows[endpoint]);
+      if (w.samples.size() < latency_window)
+        w.samples.push_back(latency);
+      else
+        w.samples[w.next] = latency;
+      w.next = (w.next + 1) % latency_window;
+    }
+
+    // Latency below which fraction p of recent requests completed,
+    // or zero if the endpoint has too few samples to say
+    microseconds percentile (const string& endpoint, double p) {
+      vector<microseconds> sorted {};
+      {
+        scoped_critical_section_t lock {latlock};
+        auto w (windows.find(endpoint));
+        if (w == windows.end() || w->second.samples.size() < min_hedge_samples)
+          return microseconds {0};
+        sorted = w->second.samples;
+      }
+      size_t rank {std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))};
+      std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+      return sorted[rank];
+    }
+  };
+
+  LatencyTracker latency_tracker {};
+
+  /*
+    Endpoint of full_uri for latency_tracker and span names: the host
+    and the operation, such as "http://localhost:34568/ReadEntityAdmin",
+    leaving out the table and keys that follow
+   */
+  string endpoint_of (const uri& full_uri) {
+    const vector<string> paths {uri::split_path(uri::decode(full_uri.path()))};
+    return full_uri.authority().to_string() + (paths.empty() ? string {} : paths[0]);
+  }
+
+  // Everything needed to build a fresh copy of an outgoing request
+  struct outgoing_t {
+    method http_method;
+    uri resource;
+    value body;
+    header_vals_t headers;
+    bool long_poll;  // Sent through long_poll_cache
+  };
+
+  http_request build_request (const outgoing_t& out) {
+    http_request request {out.http_method};
+    request.set_request_uri(out.resource);
     http_headers& headers (request.headers());
-    headers.add("Content-Type", "application/json");
-    request.set_body(req_body);
+    if (out.body != value {}) {
+      headers.add("Content-Type", "application/json");
+      request.set_body(out.body);
+    }
+    for (const auto& h : out.headers)
+      headers.add(h.first, h.second);
+    return request;
   }
 
-  status_code code;
-  value resp_body;
-  http_client client {uri_string};
-  client.request (request)
-    .then([&code](http_response response)
-          {
-            code = response.status_code();
-            const http_headers& headers {response.headers()};
-            auto content_type (headers.find("Content-Type"));
-            if (content_type == headers.end() ||
-                content_type->second != "application/json")
-              return pplx::task<value> ([] { return value::object ();});
-            else
-              return response.extract_json();
-          })
-    .then([&resp_body](value v) -> void
-          {
-            resp_body = v;
-            return;
-          })
-    .wait();
-  return make_pair(code, resp_body);
+  req_res_t timed_out () {
+    return make_pair(status_codes::GatewayTimeout, value::object ());
+  }
+
+  /*
+    When a call with opts gives up: opts.deadline, or if the caller set
+    none, default_request_timeout from now, unless the thread's
+    DeadlineScope ends sooner
+   */
+  deadline_t call_deadline (const call_opts_t& opts) {
+    deadline_t deadline {opts.deadline};
+    if (deadline == deadline_t::max() && default_request_timeout.count() > 0)
+      deadline = steady_clock::now() + default_request_timeout;
+    return std::min(deadline, scope_deadline);
+  }
+
+  // Return a timer on the cpprest thread pool set to expire at when
+  shared_ptr<steady_timer> make_timer (deadline_t when) {
+    shared_ptr<steady_timer> timer {make_shared<steady_timer>(crossplat::threadpool::shared_instance().service())};
+    timer->expires_at(when);
+    return timer;
+  }
+
+  /*
+    Send a copy of out to authority, giving up at deadline
+
+    The remaining time is passed to the receiver in deadline_header.
+    If the deadline passes first, the result is GatewayTimeout.
+    Cancelling cts abandons the attempt, making its task throw.
+   */
+  pplx::task<req_res_t> send_attempt (const uri& authority, const outgoing_t& out, deadline_t deadline,
+                                      const string& endpoint, pplx::cancellation_token_source cts,
+                                      shared_ptr<header_vals_t> resp_headers) {
+    http_request request {build_request (out)};
+    const time_point<steady_clock> start {steady_clock::now()};
+    shared_ptr<steady_timer> timer {};
+    if (deadline != deadline_t::max()) {
+      milliseconds remaining {duration_cast<milliseconds>(deadline - start)};
+      if (remaining.count() <= 0)
+        return pplx::task_from_result(timed_out ());
+      request.headers().add(deadline_header, remaining.count());
+      timer = make_timer (deadline);
+      timer->async_wait([cts] (const boost::system::error_code& ec)
+                        {
+                          if ( ! ec)
+                            cts.cancel();
+                        });
+    }
+
+    shared_ptr<status_code> code {make_shared<status_code>()};
+    ClientCache& clients (out.long_poll ? long_poll_cache : client_cache);
+    return clients.request (authority, request, cts.get_token())
+      .then([code, resp_headers](http_response response)
+            {
+              *code = response.status_code();
+              const http_headers& headers {response.headers()};
+              if (resp_headers)
+                for (const auto& h : headers)
+                  (*resp_headers)[h.first] = h.second;
+              auto content_type (headers.find("Content-Type"));
+              if (content_type == headers.end() ||
+                  content_type->second != "application/json")
+                return pplx::task<value> ([] { return value::object ();});
+              else
+                return response.extract_json();
+            })
+      .then([code](value v)
+            {
+              return make_pair(*code, v);
+            })
+      .then([timer, deadline, start, endpoint](pplx::task<req_res_t> result) -> req_res_t
+            {
+              if (timer)
+                timer->cancel();
+              try {
+                req_res_t res {result.get()};
+                latency_tracker.record(endpoint, duration_cast<microseconds>(steady_clock::now() - start));
+                return res;
+              }
+              catch (...) {
+                if (steady_clock::now() >= deadline)
+                  return timed_out ();
+                throw;
+              }
+            });
+  }
+
+  // State shared by the two copies of a hedged request
+  struct hedge_t {
+    pplx::task_completion_event<req_res_t> done;
+    atomic<bool> decided;
+    atomic<int> outstanding;
+    pplx::cancellation_token_source copies[2];
+    shared_ptr<header_vals_t> headers[2];
+    shared_ptr<steady_timer> timer;
+
+    hedge_t () :
+      done {},
+      decided {false},
+      outstanding {1},
+      copies {},
+      headers {make_shared<header_vals_t>(), make_shared<header_vals_t>()},
+      timer {}
+      {};
+  };
+
+  /*
+    Record the outcome of copy which of a hedged request
+
+    The first copy to succeed decides the result and cancels the other.
+    The request only fails if every copy that was sent fails.
+   */
+  void finish_copy (shared_ptr<hedge_t> hedge, int which, pplx::task<req_res_t> result,
+                    shared_ptr<header_vals_t> resp_headers) {
+    try {
+      req_res_t res {result.get()};
+      if ( ! hedge->decided.exchange(true)) {
+        hedge->copies[1 - which].cancel();
+        if (resp_headers)
+          *resp_headers = *hedge->headers[which];
+        hedge->done.set(res);
+      }
+    }
+    catch (...) {
+      if (--hedge->outstanding == 0 && ! hedge->decided.exchange(true))
+        hedge->done.set_exception(std::current_exception());
+    }
+  }
+
+  /*
+    Send out, and if it has not finished after delay, send a second
+    copy. Whichever copy finishes first supplies the result.
+   */
+  pplx::task<req_res_t> send_hedged (const uri& authority, const outgoing_t& out, deadline_t deadline,
+                                     const string& endpoint, microseconds delay,
+                                     shared_ptr<header_vals_t> resp_headers) {
+    shared_ptr<hedge_t> hedge {make_shared<hedge_t>()};
+    hedge->timer = make_timer (steady_clock::now() + delay);
+    hedge->timer->async_wait([hedge, authority, out, deadline, endpoint, resp_headers]
+                             (const boost::system::error_code& ec)
+                             {
+                               if (ec || hedge->decided)
+                                 return;
+                               ++hedge->outstanding;
+                               send_attempt (authority, out, deadline, endpoint,
+                                             hedge->copies[1], hedge->headers[1])
+                                 .then([hedge, resp_headers](pplx::task<req_res_t> result)
+                                       {
+                                         finish_copy (hedge, 1, result, resp_headers);
+                                       });
+                             });
+    send_attempt (authority, out, deadline, endpoint, hedge->copies[0], hedge->headers[0])
+      .then([hedge, resp_headers](pplx::task<req_res_t> result)
+            {
+              finish_copy (hedge, 0, result, resp_headers);
+            });
+    return pplx::create_task(hedge->done);
+  }
+
+  // Statuses that suggest the host, not the request, is at fault
+  bool is_failure (status_code code) {
+    return code == status_codes::InternalError ||
+           code == status_codes::BadGateway ||
+           code == status_codes::ServiceUnavailable ||
+           code == status_codes::GatewayTimeout;
+  }
+
+  // Methods whose requests can be repeated without changing the outcome
+  bool is_idempotent (const method& http_method) {
+    return http_method == methods::GET ||
+           http_method == methods::PUT ||
+           http_method == methods::DEL ||
+           http_method == methods::HEAD;
+  }
+
+  // Return a task that completes at when
+  pplx::task<void> wait_until (deadline_t when) {
+    shared_ptr<steady_timer> timer {make_timer (when)};
+    pplx::task_completion_event<void> fired {};
+    timer->async_wait([timer, fired] (const boost::system::error_code&)
+                      {
+                        fired.set();
+                      });
+    return pplx::create_task(fired);
+  }
+
+  /*
+    Backoff before retry number attempt (counting from 1): a random
+    time up to retry_backoff * 2^(attempt-1), so that clients retrying
+    after the same failure spread out instead of arriving together
+   */
+  milliseconds retry_delay (unsigned int attempt) {
+    static thread_local std::mt19937 gen {std::random_device {} ()};
+    long long ceiling {retry_backoff.count() << std::min(attempt - 1, 10u)};
+    std::uniform_int_distribution<long long> jitter {0, ceiling};
+    return milliseconds {jitter(gen)};
+  }
+
+  /*
+    Send out through the circuit breaker for authority, retrying
+    idempotent requests that fail while the retry budget, the
+    attempts allowed, and the time before deadline last
+
+    A request rejected by an open breaker is not sent at all and
+    results in ServiceUnavailable.
+   */
+  pplx::task<req_res_t> send_guarded (const uri& authority, const outgoing_t& out, deadline_t deadline,
+                                      const string& endpoint, microseconds hedge_delay,
+                                      shared_ptr<header_vals_t> resp_headers, unsigned int attempt) {
+    shared_ptr<CircuitBreaker> breaker {breaker_cache.lookup_breaker(authority.to_string())};
+    if ( ! breaker->allow_request())
+      return pplx::task_from_result(make_pair(status_codes::ServiceUnavailable, value::object ()));
+
+    pplx::task<req_res_t> sent {hedge_delay.count() > 0
+        ? send_hedged (authority, out, deadline, endpoint, hedge_delay, resp_headers)
+        : send_attempt (authority, out, deadline, endpoint, pplx::cancellation_token_source {}, resp_headers)};
+    return sent.then([breaker, authority, out, deadline, endpoint, hedge_delay, resp_headers, attempt]
+                     (pplx::task<req_res_t> result) -> pplx::task<req_res_t>
+      {
+        std::exception_ptr error {};
+        req_res_t res {};
+        try {
+          res = result.get();
+        }
+        catch (...) {
+          error = std::current_exception();
+        }
+        bool failed {error || is_failure (res.first)};
+        breaker->record( ! failed);
+        if ( ! failed)
+          return pplx::task_from_result(res);
+
+        if (attempt < max_retries &&
+            (is_idempotent (out.http_method) || out.headers.count(idempotency_key_header) > 0)) {
+          deadline_t retry_at {steady_clock::now() + retry_delay (attempt + 1)};
+          if (retry_at < deadline && breaker->allow_retry())
+            return wait_until (retry_at)
+              .then([authority, out, deadline, endpoint, hedge_delay, resp_headers, attempt] ()
+                    {
+                      return send_guarded (authority, out, deadline, endpoint, hedge_delay,
+                                           resp_headers, attempt + 1);
+                    });
+        }
+        if (error)
+          return pplx::task_from_exception<req_res_t>(error);
+        return pplx::task_from_result(res);
+      });
+  }
+}
+
+/*
+  Open a deadline scope on this thread, nested inside any already open
+
+  The effective deadline is the earlier of the new and enclosing ones.
+ */
+DeadlineScope::DeadlineScope (deadline_t deadline) :
+  saved {scope_deadline}
+{
+  scope_deadline = std::min(saved, deadline);
+}
+
+DeadlineScope::~DeadlineScope () {
+  scope_deadline = saved;
+}
+
+string new_idempotency_key () {
+  static thread_local std::mt19937_64 gen {std::random_device {} ()};
+  char key[33];
+  std::snprintf(key, sizeof key, "%016llx%016llx",
+                static_cast<unsigned long long>(gen()), static_cast<unsigned long long>(gen()));
+  return string {key};
+}
+
+/*
+  Return the deadline a caller set for message through deadline_header,
+  or deadline_t::max() if the caller set none
+ */
+deadline_t request_deadline (const http_request& message) {
+  const http_headers& headers {message.headers()};
+  auto remaining (headers.find(deadline_header));
+  if (remaining == headers.end())
+    return deadline_t::max();
+  try {
+    return steady_clock::now() + milliseconds {std::stoll(remaining->second)};
+  }
+  catch (const std::exception&) {
+    return deadline_t::max();
+  }
+}
+
+/*
+  If deadline has passed, reply GatewayTimeout to message and return true
+
+  Servers call this before starting work, so a request whose caller
+  has already given up is dropped instead of being processed.
+ */
+bool reply_if_expired (const http_request& message, deadline_t deadline) {
+  if (steady_clock::now() < deadline)
+    return false;
+  message.reply(status_codes::GatewayTimeout);
+  return true;
+}
+
+/*
+  Given an HTTP message with a JSON body, return the JSON
+  body as an unordered map of strings to strings.
+
+  Note that all types of JSON values are returned as strings.
+  Use C++ conversion utilities to convert to numbers or dates
+  as necessary.
+ */
+unordered_map<string,string> get_json_body (http_request message) {
+  const http_headers& headers {message.headers()};
+  auto content_type (headers.find("Content-Type"));
+  if (content_type == headers.end() ||
+      content_type->second != "application/json")
+    return unordered_map<string,string> {};
+
+  value json {message.extract_json(true).get()};
+  if ( ! json.is_object())
+    return unordered_map<string,string> {};
+  return unpack_json_object (json);
+}
+
+/*
+  Asynchronous version: returns a task that completes with the result
+  instead of waiting for it. Exceptions, including a malformed URI,
+  are delivered through the task.
+
+  If resp_headers is not null, the response headers are copied into it
+  before the task completes.
+
+  The call is recorded as a span of the trace open on the calling
+  thread, whose traceparent it sends (see Trace.h).
+
+  The request gives up at opts.deadline, or if that is not set, at
+  default_request_timeout from now, or earlier if the deadline of a
+  DeadlineScope open on the calling thread comes first. A request that
+  gives up results in GatewayTimeout. If opts.hedge is set on a GET and the request takes
+  longer than the hedge_percentile latency of recent requests to the
+  same endpoint, a second copy is sent and the first reply wins. Only
+  hedge requests that are safe to repeat.
+
+  Requests to a host pass through its circuit breaker in breaker_cache.
+  While the breaker is open the request fails at once with
+  ServiceUnavailable instead of waiting on a host that is down.
+  Idempotent requests (GET, PUT, DELETE) that throw or get a 5xx reply
+  are retried up to max_retries times after a jittered exponential
+  backoff, as long as the breaker's retry budget and the deadline allow.
+ */
+pplx::task<req_res_t> do_request_async (const method& http_method, const string& uri_string, const value& req_body,
+                                        const header_vals_t& req_headers, shared_ptr<header_vals_t> resp_headers,
+                                        const call_opts_t& opts) {
+  try {
+    uri full_uri {uri_string};
+    outgoing_t out {http_method, full_uri.resource(), req_body, req_headers, opts.long_poll};
+
+    deadline_t deadline {call_deadline (opts)};
+
+    const string endpoint {endpoint_of (full_uri)};
+
+    microseconds hedge_delay {0};
+    if (opts.hedge && http_method == methods::GET)
+      hedge_delay = latency_tracker.percentile(endpoint, hedge_percentile);
+
+    // One span for the call, however many attempts and copies it takes
+    span_t span {begin_span(http_method + " " + endpoint, "client", current_trace())};
+    if ( ! span.context.trace_id.empty())
+      out.headers[traceparent_header] = traceparent(span.context);
+    pplx::task<req_res_t> sent {send_guarded (full_uri.authority(), out, deadline, endpoint, hedge_delay,
+                                              resp_headers, 0)};
+    if ( ! tracing())
+      return sent;
+    return sent.then([span] (pplx::task<req_res_t> result)
+                     {
+                       span_t done {span};
+                       try {
+                         req_res_t res {result.get()};
+                         done.status = std::to_string(res.first);
+                         end_span(done);
+                         return res;
+                       }
+                       catch (...) {
+                         done.status = "exception";
+                         end_span(done);
+                         throw;
+                       }
+                     });
+  }
+  catch (...) {
+    return pplx::task_from_exception<req_res_t>(std::current_exception());
+  }
+}
+
+// Asynchronous version with options but no extra headers
+pplx::task<req_res_t> do_request_async (const method& http_method, const string& uri_string, const value& req_body,
+                                        const call_opts_t& opts) {
+  return do_request_async (http_method, uri_string, req_body, header_vals_t {}, nullptr, opts);
+}
+
+// Version with call options
+pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body,
+                                    const call_opts_t& opts) {
+  return do_request_async (http_method, uri_string, req_body, opts).get();
+}
+
+// Version with explicit request headers, also returning the response headers
+pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body,
+                                    const header_vals_t& req_headers, header_vals_t& resp_headers) {
+  shared_ptr<header_vals_t> headers {make_shared<header_vals_t>()};
+  req_res_t result {do_request_async (http_method, uri_string, req_body, req_headers, headers).get()};
+  resp_headers = *headers;
+  return result;
+}
+
+// Version with explicit third argument
+pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body) {
+  header_vals_t resp_headers {};
+  return do_request (http_method, uri_string, req_body, header_vals_t {}, resp_headers);
 }
 
 // Version that defaults third argument
@@ -105,6 +654,283 @@ pair<status_code,value> do_request (const method& http_method, const string& uri
   return do_request (http_method, uri_string, value {});
 }
 
+namespace {
+  // Shared by the lanes of one do_requests_async() call
+  struct fan_out_t {
+    vector<request_spec_t> requests;
+    vector<req_res_t> results;
+    atomic<size_t> next;
+    call_opts_t opts;
+    trace_context_t trace;
+
+    fan_out_t (const vector<request_spec_t>& reqs, deadline_t deadline, const trace_context_t& context) :
+      requests (reqs),
+      results (reqs.size()),
+      next {0},
+      opts {},
+      trace (context)
+      {
+        opts.deadline = deadline;
+      };
+  };
+
+  /*
+    Issue the next unclaimed request of fan_out, then keep going
+    until none are left. Each lane has at most one request in flight.
+   */
+  pplx::task<void> run_lane (shared_ptr<fan_out_t> fan_out) {
+    size_t i {fan_out->next++};
+    if (i >= fan_out->requests.size())
+      return pplx::task_from_result();
+
+    const request_spec_t& req {fan_out->requests[i]};
+    TraceScope trace_scope {fan_out->trace};
+    return do_request_async (req.http_method, req.uri_string, req.req_body, req.req_headers, nullptr, fan_out->opts)
+      .then([fan_out, i](pplx::task<req_res_t> result)
+            {
+              try {
+                fan_out->results[i] = result.get();
+              }
+              catch (const std::exception&) {
+                fan_out->results[i] = make_pair(status_codes::ServiceUnavailable, value::object ());
+              }
+              return run_lane (fan_out);
+            });
+  }
+}
+
+/*
+  Issue a batch of requests with at most max_in_flight outstanding
+  at once (0 means no limit), returning a task for all their results.
+
+  The results are in the same order as requests. A request that
+  throws, for example because its server is not running, is reported
+  with status ServiceUnavailable and an empty object rather than
+  failing the whole batch. Every request shares the deadline of the
+  calling thread's DeadlineScope.
+ */
+pplx::task<vector<req_res_t>> do_requests_async (const vector<request_spec_t>& requests, size_t max_in_flight) {
+  if (requests.empty())
+    return pplx::task_from_result(vector<req_res_t> {});
+  // Lanes continue on pool threads, so pass this thread's deadline and trace explicitly
+  shared_ptr<fan_out_t> fan_out {make_shared<fan_out_t>(requests, scope_deadline, current_trace())};
+  size_t lanes {max_in_flight == 0 ? requests.size() : std::min(max_in_flight, requests.size())};
+  vector<pplx::task<void>> running {};
+  for (size_t l {0}; l < lanes; ++l)
+    running.push_back(run_lane (fan_out));
+  return pplx::when_all(running.begin(), running.end())
+    .then([fan_out] ()
+          {
+            return fan_out->results;
+          });
+}
+
+// Blocking version of do_requests_async()
+vector<req_res_t> do_requests (const vector<request_spec_t>& requests, size_t max_in_flight) {
+  return do_requests_async (requests, max_in_flight).get();
+}
+
+namespace {
+  constexpr size_t stream_chunk_size {64 * 1024};
+
+  /*
+    Splits a JSON array that arrives in pieces into its elements,
+    parsing and delivering each as soon as its last character is fed.
+    Only the brackets, braces and strings of the current element are
+    tracked. A body that is not an array is kept and parsed whole.
+   */
+  class ArraySplitter {
+  public:
+    explicit ArraySplitter (json_element_fn on_element) :
+      on_element {on_element},
+      state {state_t::before},
+      depth {0},
+      in_string {false},
+      escaped {false},
+      element {}
+      {};
+
+    // Feed the next n characters; returns false once no more are wanted
+    bool feed (const char* p, size_t n) {
+      for (const char* end {p + n}; p != end; ++p) {
+        char c {*p};
+        if (state == state_t::before) {
+          if (std::isspace (static_cast<unsigned char>(c)))
+            continue;
+          state = c == '[' ? state_t::in_array : state_t::not_array;
+          if (state == state_t::in_array)
+            continue;
+        }
+        if (state == state_t::not_array) {
+          element.append (p, end - p);
+          return true;
+        }
+        if (state == state_t::done)
+          return false;
+
+        if (in_string) {
+          element += c;
+          if (escaped)
+            escaped = false;
+          else if (c == '\\')
+            escaped = true;
+          else if (c == '"')
+            in_string = false;
+          continue;
+        }
+        if (depth == 0 && (c == ',' || c == ']')) {
+          if ( ! emit ())
+            return false;
+          if (c == ']') {
+            state = state_t::done;
+            return false;
+          }
+          continue;
+        }
+        if (depth == 0 && std::isspace (static_cast<unsigned char>(c)))
+          continue;
+        element += c;
+        if (c == '"')
+          in_string = true;
+        else if (c == '{' || c == '[')
+          ++depth;
+        else if (c == '}' || c == ']')
+          --depth;
+      }
+      return true;
+    }
+
+    // The body has ended; deliver a body that was not an array
+    void finish () {
+      if (state == state_t::not_array)
+        emit ();
+      else if (state == state_t::in_array)
+        throw web::json::json_exception ("Unterminated JSON array");
+    }
+
+  private:
+    enum class state_t {before, in_array, not_array, done};
+
+    json_element_fn on_element;
+    state_t state;
+    int depth;
+    bool in_string;
+    bool escaped;
+    string element;
+
+    bool emit () {
+      if (element.empty())
+        return true;
+      value v {value::parse (element)};
+      element.clear();
+      return on_element (v);
+    }
+  };
+
+  pplx::task<status_code> read_elements (concurrency::streams::streambuf<uint8_t> body,
+                                         shared_ptr<ArraySplitter> splitter,
+                                         shared_ptr<vector<uint8_t>> buffer,
+                                         status_code code, deadline_t deadline) {
+    return body.getn (buffer->data(), buffer->size())
+      .then([body, splitter, buffer, code, deadline] (size_t n) -> pplx::task<status_code>
+            {
+              if (n == 0) {
+                splitter->finish ();
+                return pplx::task_from_result(code);
+              }
+              if ( ! splitter->feed (reinterpret_cast<const char*>(buffer->data()), n))
+                return pplx::task_from_result(code);
+              if (steady_clock::now() >= deadline)
+                return pplx::task_from_result(status_codes::GatewayTimeout);
+              return read_elements (body, splitter, buffer, code, deadline);
+            });
+  }
+}
+
+pplx::task<status_code> do_request_each_async (const method& http_method, const string& uri_string,
+                                               json_element_fn on_element, const value& req_body,
+                                               const call_opts_t& opts) {
+  try {
+    uri full_uri {uri_string};
+    outgoing_t out {http_method, full_uri.resource(), req_body, header_vals_t {}, false};
+
+    deadline_t deadline {call_deadline (opts)};
+
+    shared_ptr<CircuitBreaker> breaker {breaker_cache.lookup_breaker(full_uri.authority().to_string())};
+    if ( ! breaker->allow_request())
+      return pplx::task_from_result(status_codes::ServiceUnavailable);
+
+    http_request request {build_request (out)};
+    pplx::cancellation_token_source cts {};
+    shared_ptr<steady_timer> timer {};
+    if (deadline != deadline_t::max()) {
+      milliseconds remaining {duration_cast<milliseconds>(deadline - steady_clock::now())};
+      if (remaining.count() <= 0)
+        return pplx::task_from_result(status_codes::GatewayTimeout);
+      request.headers().add(deadline_header, remaining.count());
+      timer = make_timer (deadline);
+      timer->async_wait([cts] (const boost::system::error_code& ec)
+                        {
+                          if ( ! ec)
+                            cts.cancel();
+                        });
+    }
+    span_t span {begin_span(http_method + " " + endpoint_of (full_uri), "client", current_trace())};
+    if ( ! span.context.trace_id.empty())
+      request.headers().add(traceparent_header, traceparent(span.context));
+
+    return client_cache.request (full_uri.authority(), request, cts.get_token())
+      .then([on_element, deadline] (http_response response) -> pplx::task<status_code>
+            {
+              const http_headers& headers {response.headers()};
+              auto content_type (headers.find("Content-Type"));
+              if (content_type == headers.end() || content_type->second != "application/json")
+                return pplx::task_from_result(response.status_code());
+              return read_elements (response.body().streambuf(),
+                                    make_shared<ArraySplitter>(on_element),
+                                    make_shared<vector<uint8_t>>(stream_chunk_size),
+                                    response.status_code(), deadline);
+            })
+      .then([breaker, timer, deadline, span] (pplx::task<status_code> result) -> status_code
+            {
+              if (timer)
+                timer->cancel();
+              span_t done {span};
+              try {
+                status_code code {result.get()};
+                breaker->record( ! is_failure (code));
+                done.status = std::to_string(code);
+                end_span(done);
+                return code;
+              }
+              catch (const web::json::json_exception&) {
+                // The host answered, with a malformed body
+                breaker->record(true);
+                done.status = "exception";
+                end_span(done);
+                throw;
+              }
+              catch (...) {
+                breaker->record(false);
+                done.status = "exception";
+                end_span(done);
+                if (steady_clock::now() >= deadline)
+                  return status_codes::GatewayTimeout;
+                throw;
+              }
+            });
+  }
+  catch (...) {
+    return pplx::task_from_exception<status_code>(std::current_exception());
+  }
+}
+
+status_code do_request_each (const method& http_method, const string& uri_string,
+                             json_element_fn on_element, const value& req_body,
+                             const call_opts_t& opts) {
+  return do_request_each_async (http_method, uri_string, on_element, req_body, opts).get();
+}
+
 /*
  Return a JSON object value whose (0 or more) properties are specified as a 
  vector of <string,string> pairs
@@ -163,8 +989,9 @@ value build_json_value (const string& pname1, const string& pval1,
 unordered_map<string,string> unpack_json_object (const value& v) {
   assert(v.is_object());
   
+  const object& obj {v.as_object()};
   unordered_map<string,string> res {};
-  object obj {v.as_object()};
+  res.reserve (obj.size());
   for (const auto& p : obj) {
     if (p.second.is_string())
       res[p.first] = p.second.as_string();
@@ -188,8 +1015,8 @@ unordered_map<string,string> unpack_json_object (const value& v) {
 value get_json_object_prop_val (const value& v, const string& propname) {
   assert(v.is_object());
 
-  object obj {v.as_object()};
-  return obj [propname];
+  const value* propval {find_json_object_prop (v, propname)};
+  return propval ? *propval : value::null();
 }
 
 /*
@@ -209,24 +1036,58 @@ value get_json_object_prop_val (const value& v, const string& propname) {
   - if the property is any non-null, non-string type, return its serialization
  */
 string get_json_object_prop (const value& v, const string& propname) {
-  value propval {get_json_object_prop_val (v, propname)};
-  if (propval.is_null())
+  assert(v.is_object());
+
+  const value* propval {find_json_object_prop (v, propname)};
+  if ( ! propval || propval->is_null())
     return string {};
-  else if (propval.is_string())
-    return propval.as_string();
+  else if (propval->is_string())
+    return propval->as_string();
   else
-    return propval.serialize();
+    return propval->serialize();
 }
 
-using pos_t = string::size_type;
+const value* find_json_object_prop (const value& v, const string& propname) {
+  if ( ! v.is_object())
+    return nullptr;
+  const object& obj {v.as_object()};
+  auto found (obj.find (propname));
+  return found == obj.end() ? nullptr : &found->second;
+}
+
+const string& get_json_object_string (const value& v, const string& propname) {
+  static const string empty {};
+  const value* propval {find_json_object_prop (v, propname)};
+  return propval && propval->is_string() ? propval->as_string() : empty;
+}
 
 char pair_separator {'|'};
 char pair_delimiter {';'};
 
-static pos_t next_delim (const string& s, char delim, pos_t start) {
-  return s.find(delim, start);
+/*
+  Return the first of a or b in [p, end), or end if there is neither.
+  Compares 16 characters at a time where SSE2 is available.
+ */
+static const char* find_either (const char* p, const char* end, char a, char b) {
+#ifdef __SSE2__
+  const __m128i va {_mm_set1_epi8(a)};
+  const __m128i vb {_mm_set1_epi8(b)};
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))};
+    int hits {_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)))};
+    if (hits != 0)
+      return p + __builtin_ctz(hits);
+  }
+#endif
+  for (; p != end; ++p) {
+    if (*p == a || *p == b)
+      return p;
+  }
+  return end;
 }
 
+static friends_view_t parse_compact_friends_view (const string& friends_list);
+
 /*
  Return a vector of (country, name) pairs representing a list of friends
 
@@ -257,43 +1118,234 @@ static pos_t next_delim (const string& s, char delim, pos_t start) {
 
    "USAMadonna|Canada" (no delimiter in opening "pair")
 
- Note: gcc 4.8.4's version of STL does not include full support for <regexp>,
- so this algorthm uses the more basic (and entirely adequate) string::find.
+ The pairs are slices of friends_list, found in a single pass over it:
+ the country ends at the first pair_delimiter or pair_separator, and
+ the name at the next pair_separator. A friends list in the compact
+ form is decoded instead.
  */
-friends_list_t parse_friends_list (const string& friends_list) {
-  friends_list_t res {};
+friends_view_t parse_friends_view (const string& friends_list) {
+  if (is_compact_friends_list (friends_list))
+    return parse_compact_friends_view (friends_list);
 
-  pos_t start {0};
-  if (friends_list[start] == pair_separator)
-    start++; // Skip any initial separator
-  for (pos_t delim {next_delim (friends_list, pair_delimiter, start)};
-       delim != string::npos; 
-       delim = next_delim (friends_list, pair_delimiter, start)) {
-    pos_t end {next_delim (friends_list, pair_separator, start)};
-    if (end == string::npos)
-      end = friends_list.size();
-    if (end <= delim+1)
+  friends_view_t res {};
+
+  const char* p {friends_list.data()};
+  const char* const end {p + friends_list.size()};
+  if (p != end && *p == pair_separator)
+    p++; // Skip any initial separator
+  while (p < end) {
+    const char* delim {find_either (p, end, pair_delimiter, pair_separator)};
+    if (delim == end)
+      break; // Trailing characters without a delimiter
+    if (*delim == pair_separator) {
+      // A pair without a delimiter is only allowed at the end
+      if (std::memchr (delim, pair_delimiter, end - delim) != nullptr)
+        throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+      break;
+    }
+    const char* sep {static_cast<const char*>(std::memchr (delim+1, pair_separator, end - delim - 1))};
+    if (sep == nullptr)
+      sep = end;
+    if (sep == delim+1)
       throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
-    string country {friends_list.substr (start, delim-start)};
-    string name {friends_list.substr (delim+1, end-delim-1)};
-    res.push_back (make_pair (country, name));
-    start = end+1;
+    res.emplace_back (boost::string_ref {p, static_cast<size_t>(delim - p)},
+                      boost::string_ref {delim+1, static_cast<size_t>(sep - delim - 1)});
+    p = sep+1;
   }
   return res;
 }
 
+/*
+  As parse_friends_view, copying each pair into strings
+ */
+friends_list_t parse_friends_list (const string& friends_list) {
+  friends_view_t view {parse_friends_view (friends_list)};
+  friends_list_t res {};
+  res.reserve (view.size());
+  for (const auto& v : view)
+    res.emplace_back (v.first.to_string(), v.second.to_string());
+  return res;
+}
+
 /*
   Return the string representation of a friends list 
  */
 string friends_list_to_string (const friends_list_t& list) {
+  size_t size {list.empty() ? 0 : 2 * list.size() - 1};
+  for (const auto& p : list)
+    size += p.first.size() + p.second.size();
+
   string result {};
+  result.reserve (size);
   bool started {false};
-
   for (const auto& p : list) {
     if (started)
       result += pair_separator;
-    result += p.first + pair_delimiter + p.second;
+    result.append (p.first);
+    result += pair_delimiter;
+    result.append (p.second);
     started = true;
   }
   return result;
 }
+
+const string compact_friends_marker {"~F1;"};
+
+bool compact_friends_lists {false};
+
+/*
+  Varints in printable characters: five bits to a character, least
+  significant first, from varint_more except for the last, which is
+  from varint_final
+ */
+static const char varint_final[] {"ABCDEFGHIJKLMNOPQRSTUVWXYZ012345"};
+static const char varint_more[] {"abcdefghijklmnopqrstuvwxyz6789-."};
+
+static size_t varint_size (size_t n) {
+  size_t size {1};
+  for (; n >= 32; n >>= 5)
+    ++size;
+  return size;
+}
+
+static void put_varint (string& out, size_t n) {
+  for (; n >= 32; n >>= 5)
+    out += varint_more[n & 31];
+  out += varint_final[n];
+}
+
+/*
+  Read a varint at p into n and advance p past it.
+  Returns false if there is no well-formed varint at p.
+ */
+static bool get_varint (const char*& p, const char* end, size_t& n) {
+  n = 0;
+  for (unsigned shift {0}; p != end && shift < 8 * sizeof n; shift += 5) {
+    char c {*p++};
+    if (c >= 'A' && c <= 'Z') {
+      n |= static_cast<size_t>(c - 'A') << shift;
+      return true;
+    }
+    if (c >= '0' && c <= '5') {
+      n |= static_cast<size_t>(c - '0' + 26) << shift;
+      return true;
+    }
+    size_t digit {};
+    if (c >= 'a' && c <= 'z')
+      digit = c - 'a';
+    else if (c >= '6' && c <= '9')
+      digit = c - '6' + 26;
+    else if (c == '-' || c == '.')
+      digit = c == '-' ? 30 : 31;
+    else
+      return false;
+    n |= digit << shift;
+  }
+  return false;
+}
+
+/*
+  Return the compact form of a friends list, sized exactly before it is written
+ */
+string friends_list_to_compact (const friends_list_t& list) {
+  if (list.empty())
+    return string {};
+
+  vector<const string*> countries {};
+  unordered_map<string,size_t> index {};
+  vector<size_t> country_of {};
+  country_of.reserve (list.size());
+  size_t size {compact_friends_marker.size() + 1};
+  for (const auto& p : list) {
+    auto found (index.find(p.first));
+    if (found == index.end()) {
+      found = index.emplace(p.first, countries.size()).first;
+      size += p.first.size() + (countries.empty() ? 0 : 1);
+      countries.push_back (&p.first);
+    }
+    country_of.push_back (found->second);
+    size += varint_size (found->second) + varint_size (p.second.size()) + p.second.size();
+  }
+
+  string result {};
+  result.reserve (size);
+  result.append (compact_friends_marker);
+  for (size_t i {0}; i < countries.size(); ++i) {
+    if (i > 0)
+      result += pair_separator;
+    result.append (*countries[i]);
+  }
+  result += pair_delimiter;
+  for (size_t i {0}; i < list.size(); ++i) {
+    put_varint (result, country_of[i]);
+    put_varint (result, list[i].second.size());
+    result.append (list[i].second);
+  }
+  return result;
+}
+
+bool is_compact_friends_list (const string& friends_list) {
+  return friends_list.compare (0, compact_friends_marker.size(), compact_friends_marker) == 0;
+}
+
+string encode_friends_list (const friends_list_t& list) {
+  return compact_friends_lists ? friends_list_to_compact (list) : friends_list_to_string (list);
+}
+
+/*
+  parse_friends_view for the compact form
+ */
+static friends_view_t parse_compact_friends_view (const string& friends_list) {
+  const char* p {friends_list.data() + compact_friends_marker.size()};
+  const char* const end {friends_list.data() + friends_list.size()};
+  const char* dict_end {static_cast<const char*>(std::memchr (p, pair_delimiter, end - p))};
+  if (dict_end == nullptr)
+    throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+
+  vector<boost::string_ref> countries {};
+  while (true) {
+    const char* sep {static_cast<const char*>(std::memchr (p, pair_separator, dict_end - p))};
+    if (sep == nullptr)
+      sep = dict_end;
+    countries.emplace_back (p, static_cast<size_t>(sep - p));
+    if (sep == dict_end)
+      break;
+    p = sep+1;
+  }
+
+  friends_view_t res {};
+  for (p = dict_end+1; p != end; ) {
+    size_t country {};
+    size_t length {};
+    if ( ! get_varint (p, end, country) || country >= countries.size() ||
+         ! get_varint (p, end, length) || length > static_cast<size_t>(end - p))
+      throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+    res.emplace_back (countries[country], boost::string_ref {p, length});
+    p += length;
+  }
+  return res;
+}
+
+const string timeline_table_name {"TimelineTable"};
+const string outbox_table_name {"OutboxTable"};
+const string high_degree_table_name {"HighDegreeTable"};
+const string high_degree_partition {"Authors"};
+
+string timeline_key (std::int64_t accepted_ms, std::uint64_t id) {
+  char key[40];
+  std::snprintf(key, sizeof key, "%015lld-%016llx",
+                static_cast<long long>(accepted_ms), static_cast<unsigned long long>(id));
+  return string {key};
+}
+
+string timeline_row (const string& name, const string& key) {
+  return name + pair_delimiter + key;
+}
+
+string timeline_rows_after (const string& name) {
+  return name + pair_delimiter;
+}
+
+string timeline_rows_before (const string& name) {
+  return name + static_cast<char>(pair_delimiter + 1);
+}
@@ -1,6 +1,11 @@
 #ifndef CLIENT_UTILS_H
 #define CLIENT_UTILS_H
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -9,21 +14,176 @@
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
+#include <pplx/pplxtasks.h>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "CircuitBreaker.h"
+#include "ClientCache.h"
+
 // Alias for a type representing the result of do_request()
 using req_res_t = std::pair<web::http::status_code,web::json::value>;
 
 // Alias for a vector representing a friends list
 using friends_list_t = std::vector<std::pair<std::string,std::string>>;
 
+// Alias for a vector of (country, name) slices of a friends list string
+using friends_view_t = std::vector<std::pair<boost::string_ref,boost::string_ref>>;
+
 // Alias for an unordered_map representing a JSON object's property/value pairs
 using value_string_t = std::unordered_map<std::string,std::string>;
 
+// Alias for an unordered_map representing HTTP header name/value pairs
+using header_vals_t = std::unordered_map<std::string,std::string>;
+
+// Alias for the time by which a request must have completed
+using deadline_t = std::chrono::steady_clock::time_point;
+
+// Options for a single do_request() or do_request_async() call
+struct call_opts_t {
+  // Give up on the request at this time
+  deadline_t deadline;
+  // For GETs, send a second copy if the first is slower than usual
+  bool hedge;
+  // The server holds the reply until it has news or its own timeout
+  // passes, so send it through long_poll_cache, where waiting polls do
+  // not take the connection slots of other requests to the host
+  bool long_poll;
+
+  call_opts_t () :
+    deadline {deadline_t::max()},
+    hedge {false},
+    long_poll {false}
+    {};
+
+  call_opts_t (std::chrono::milliseconds timeout, bool hedge_get = false) :
+    deadline {std::chrono::steady_clock::now() + timeout},
+    hedge {hedge_get},
+    long_poll {false}
+    {};
+};
+
+/*
+  Deadline applying to every do_request() made by this thread
+  while the scope is alive
+
+  A server handler opens one with request_deadline() of its incoming
+  message, so that all its downstream calls share the caller's budget.
+ */
+class DeadlineScope {
+private:
+  deadline_t saved;
+public:
+  explicit DeadlineScope (deadline_t deadline);
+  ~DeadlineScope ();
+};
+
+// Header carrying the milliseconds a receiver has left to answer
+extern const std::string deadline_header;
+
+// Header carrying a request id; a receiver does a request with the
+// same id only once, so requests carrying one are safe to retry
+extern const std::string idempotency_key_header;
+
+// Return a new random id for idempotency_key_header
+std::string new_idempotency_key ();
+
+// Timeout applied to requests whose call_opts_t sets no deadline
+extern std::chrono::milliseconds default_request_timeout;
+
+// Latency percentile (0-1) after which a hedged GET sends its backup
+extern double hedge_percentile;
+
+// Most times a failed idempotent request is retried
+extern unsigned int max_retries;
+
+// Backoff before the first retry; it doubles for each further retry
+extern std::chrono::milliseconds retry_backoff;
+
+deadline_t
+request_deadline (const web::http::http_request& message);
+
+bool
+reply_if_expired (const web::http::http_request& message, deadline_t deadline);
+
+value_string_t
+get_json_body (web::http::http_request message);
+
+// One request in a batch issued by do_requests()
+struct request_spec_t {
+  web::http::method http_method;
+  std::string uri_string;
+  web::json::value req_body;
+  header_vals_t req_headers;  // Such as an idempotency_key_header
+};
+
+// Process-wide pool of http_clients used by do_request()
+extern ClientCache client_cache;
+
+// Pool for long polls, with no limit on the requests to one host
+extern ClientCache long_poll_cache;
+
+// Process-wide circuit breakers, one per host, used by do_request()
+extern BreakerCache breaker_cache;
+
 req_res_t
 do_request (const web::http::method& http_method, const std::string& uri_string, const web::json::value& req_body);
 
 req_res_t
 do_request (const web::http::method& http_method, const std::string& uri_string);
 
+req_res_t
+do_request (const web::http::method& http_method, const std::string& uri_string, const web::json::value& req_body,
+            const call_opts_t& opts);
+
+req_res_t
+do_request (const web::http::method& http_method, const std::string& uri_string, const web::json::value& req_body,
+            const header_vals_t& req_headers, header_vals_t& resp_headers);
+
+pplx::task<req_res_t>
+do_request_async (const web::http::method& http_method, const std::string& uri_string,
+                  const web::json::value& req_body = web::json::value {},
+                  const header_vals_t& req_headers = header_vals_t {},
+                  std::shared_ptr<header_vals_t> resp_headers = nullptr,
+                  const call_opts_t& opts = call_opts_t {});
+
+pplx::task<req_res_t>
+do_request_async (const web::http::method& http_method, const std::string& uri_string,
+                  const web::json::value& req_body, const call_opts_t& opts);
+
+pplx::task<std::vector<req_res_t>>
+do_requests_async (const std::vector<request_spec_t>& requests, std::size_t max_in_flight);
+
+std::vector<req_res_t>
+do_requests (const std::vector<request_spec_t>& requests, std::size_t max_in_flight);
+
+/*
+  Streaming requests, for responses too large to hold as one value
+
+  If the response is a JSON array, on_element is called with each
+  element, in order, as soon as it has arrived, so memory is bounded
+  by the largest element rather than the whole array. Any other JSON
+  response is passed to on_element whole. on_element returns false to
+  stop reading. The result is the response status.
+
+  Deadlines, circuit breakers and tracing apply as for do_request_async(), but
+  the request is never retried or hedged, as on_element may already
+  have seen part of the response.
+ */
+using json_element_fn = std::function<bool (const web::json::value&)>;
+
+pplx::task<web::http::status_code>
+do_request_each_async (const web::http::method& http_method, const std::string& uri_string,
+                       json_element_fn on_element,
+                       const web::json::value& req_body = web::json::value {},
+                       const call_opts_t& opts = call_opts_t {});
+
+web::http::status_code
+do_request_each (const web::http::method& http_method, const std::string& uri_string,
+                 json_element_fn on_element,
+                 const web::json::value& req_body = web::json::value {},
+                 const call_opts_t& opts = call_opts_t {});
+
 web::json::value
 build_json_value (const std::vector<std::pair<std::string,std::string>>& props);
 
@@ -46,12 +206,77 @@ get_json_object_prop_val (const web::json::value& v, const std::string& propname
 std::string
 get_json_object_prop (const web::json::value& v, const std::string& propname);
 
+// Property propname of v, or nullptr if v is not an object or has no
+// such property. Points into v; nothing is copied.
+const web::json::value*
+find_json_object_prop (const web::json::value& v, const std::string& propname);
+
+// String property propname of v, or an empty string if v has no such
+// property or it is not a string. Refers into v; nothing is copied.
+const std::string&
+get_json_object_string (const web::json::value& v, const std::string& propname);
+
 extern char pair_separator;
 extern char pair_delimiter;
 
 friends_list_t
 parse_friends_list (const std::string& friends_list);
 
+// As parse_friends_list, but the pairs point into friends_list,
+// and are only valid while it is unchanged
+friends_view_t
+parse_friends_view (const std::string& friends_list);
+
 std::string friends_list_to_string(const friends_list_t& list);
 
+/*
+  Compact friends lists
+
+  compact_friends_marker, the distinct countries separated by
+  pair_separator and ended by pair_delimiter, then for each friend the
+  index of their country and the length of their name, each a varint,
+  followed by the name. The varints are written in printable characters
+  so the encoding can be stored as an ordinary string property.
+  parse_friends_list and parse_friends_view read both forms.
+ */
+extern const std::string compact_friends_marker;
+
+// Whether encode_friends_list writes the compact form
+extern bool compact_friends_lists;
+
+std::string friends_list_to_compact (const friends_list_t& list);
+
+bool is_compact_friends_list (const std::string& friends_list);
+
+// friends_list_to_compact if compact_friends_lists, otherwise friends_list_to_string
+std::string encode_friends_list (const friends_list_t& list);
+
+/*
+  Timelines
+
+  Each status pushed to a user is one entity of the timeline table,
+  in the user's country partition, with row "<name>;<time key>".
+  Time keys sort in the order the statuses were accepted, so one
+  user's entries are a contiguous, time-ordered range of rows.
+ */
+extern const std::string timeline_table_name;
+
+/*
+  Statuses of authors with more than the degree threshold of friends
+  are not pushed to each friend. They are stored once, in the author's
+  outbox, laid out like a timeline, and readers merge in the outboxes
+  of the friends listed in the high-degree table.
+ */
+extern const std::string outbox_table_name;
+extern const std::string high_degree_table_name;
+extern const std::string high_degree_partition;
+
+// accepted_ms: when the status was accepted; id: unique for that millisecond
+std::string timeline_key (std::int64_t accepted_ms, std::uint64_t id);
+std::string timeline_row (const std::string& name, const std::string& key);
+
+// Rows strictly between these are exactly the entries of name
+std::string timeline_rows_after (const std::string& name);
+std::string timeline_rows_before (const std::string& name);
+
 #endif
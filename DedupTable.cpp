@@ -0,0 +1,117 @@
+#include "DedupTable.h"
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <string>
+#include <utility>
+
+#include <cpprest/http_msg.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "ClientUtils.h"
+
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::string;
+
+using std::chrono::steady_clock;
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using web::http::http_headers;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::status_code;
+using web::http::status_codes;
+using web::http::uri;
+
+/*
+  Forget the ids past their time, and the oldest ones over max_entries
+ */
+void DedupTable::expire (steady_clock::time_point now) {
+  while ( ! oldest_first.empty()) {
+    auto oldest (entries.find(oldest_first.front()));
+    if (entries.size() <= max_entries && oldest->second.expires > now)
+      break;
+    entries.erase(oldest);
+    oldest_first.pop_front();
+  }
+}
+
+pair<bool,pplx::task<status_code>> DedupTable::claim (const string& id) {
+  scoped_critical_section_t lock {dedup_lock};
+  steady_clock::time_point now {steady_clock::now()};
+  expire(now);
+
+  auto found (entries.find(id));
+  if (found != entries.end()) {
+    if (found->second.done)
+      return make_pair(false, pplx::task_from_result(found->second.status));
+    return make_pair(false, pplx::create_task(found->second.tce));
+  }
+
+  oldest_first.push_back(id);
+  entries[id] = entry_t {false, status_codes::OK, pplx::task_completion_event<status_code> {},
+                         now + ttl, std::prev(oldest_first.end())};
+  expire(now);
+  return make_pair(true, pplx::task_from_result(status_codes::OK));
+}
+
+void DedupTable::complete (const string& id, status_code status) {
+  pplx::task_completion_event<status_code> tce {};
+  {
+    scoped_critical_section_t lock {dedup_lock};
+    auto found (entries.find(id));
+    if (found == entries.end())
+      return;
+    tce = found->second.tce;
+    if (status >= status_codes::InternalError) {
+      oldest_first.erase(found->second.age);
+      entries.erase(found);
+    }
+    else {
+      found->second.done = true;
+      found->second.status = status;
+    }
+  }
+  // Repeats that arrived meanwhile get the same answer
+  tce.set(status);
+}
+
+size_t DedupTable::size () {
+  scoped_critical_section_t lock {dedup_lock};
+  return entries.size();
+}
+
+bool reply_if_repeated (const http_request& message, DedupTable& dedup) {
+  const http_headers& headers {message.headers()};
+  auto key (headers.find(idempotency_key_header));
+  if (key == headers.end() || key->second.empty())
+    return false;
+
+  string id {message.method() + " " + uri::decode(message.relative_uri().path()) + " " + key->second};
+  pair<bool,pplx::task<status_code>> claimed {dedup.claim(id)};
+  if ( ! claimed.first) {
+    claimed.second.then([message] (status_code status)
+                        {
+                          message.reply(status);
+                        });
+    return true;
+  }
+
+  message.get_response().then([&dedup, id] (pplx::task<http_response> response)
+                              {
+                                status_code status {status_codes::InternalError};
+                                try {
+                                  status = response.get().status_code();
+                                }
+                                catch (const std::exception&) {
+                                }
+                                dedup.complete(id, status);
+                              });
+  return false;
+}
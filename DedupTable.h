@@ -0,0 +1,70 @@
+#ifndef DedupTable_h
+#define DedupTable_h
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <cpprest/http_msg.h>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  Bounded, expiring record of the requests already done, by request id
+
+  claim() the id when a request arrives. The first claim returns true
+  and the request goes ahead; it must complete() the id with the
+  status it replied. Later claims of the same id return false with a
+  task giving that status, once it is known, so the repeat can be
+  acknowledged without being done again.
+
+  Ids are forgotten after ttl, or oldest first once there are
+  max_entries. A failed request (5xx) is forgotten at once, so that
+  retrying it does the work again.
+ */
+class DedupTable {
+private:
+  struct entry_t {
+    bool done;
+    web::http::status_code status;
+    pplx::task_completion_event<web::http::status_code> tce;
+    std::chrono::steady_clock::time_point expires;
+    std::list<std::string>::iterator age;
+  };
+
+  std::unordered_map<std::string,entry_t> entries;
+  std::list<std::string> oldest_first;
+  pplx::extensibility::critical_section_t dedup_lock;
+  std::size_t max_entries;
+  std::chrono::seconds ttl;
+
+  void expire (std::chrono::steady_clock::time_point now);
+public:
+  DedupTable (std::size_t max_entries, std::chrono::seconds ttl) :
+    entries {},
+    oldest_first {},
+    dedup_lock {},
+    max_entries {max_entries},
+    ttl {ttl}
+    {};
+
+  std::pair<bool,pplx::task<web::http::status_code>> claim (const std::string& id);
+  void complete (const std::string& id, web::http::status_code status);
+  std::size_t size ();
+};
+
+/*
+  Deduplicate message by its idempotency_key_header, if it has one.
+
+  If the id was seen before, replies to message with the first
+  request's status, once that is known, and returns true.
+  Otherwise returns false, and the status message is replied with is
+  recorded for later repeats. The id is scoped to the method and path,
+  so reusing it for a different request does not suppress that one.
+ */
+bool reply_if_repeated (const web::http::http_request& message, DedupTable& dedup);
+
+#endif
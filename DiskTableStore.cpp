@@ -0,0 +1,985 @@
+#include "DiskTableStore.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/utility/string_ref.hpp>
+
+#include <cpprest/http_msg.h>
+
+#include <was/table.h>
+
+#include "StoreUtils.h"
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+using azure::storage::table_shared_access_policy;
+
+using boost::string_ref;
+
+using std::cerr;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+namespace {
+  // Most entities a scan copies out under the lock at once
+  constexpr size_t scan_page_size {256};
+
+  // Value length of a tombstone, in logs and segments
+  constexpr uint32_t tombstone_length {0xffffffff};
+
+  // Last 8 bytes of every segment
+  constexpr uint64_t segment_magic {0x31544c42534b5344};  // "DSKSBLT1"
+
+  // Bytes written to a file at once when writing a segment
+  constexpr size_t write_chunk {1 << 20};
+
+  // Type tags of the property values in an encoded entity
+  enum : char {string_tag = 's', boolean_tag = 'b', int32_tag = 'i', int64_tag = 'l', double_tag = 'd'};
+
+  void put_u32 (string& out, uint32_t n) {
+    out.append(reinterpret_cast<const char*>(&n), sizeof n);
+  }
+
+  void put_u64 (string& out, uint64_t n) {
+    out.append(reinterpret_cast<const char*>(&n), sizeof n);
+  }
+
+  void put_string (string& out, string_ref s) {
+    put_u32(out, static_cast<uint32_t>(s.size()));
+    out.append(s.data(), s.size());
+  }
+
+  // Reads the encodings above from bytes, throwing if they run out
+  class reader_t {
+  private:
+    const char* p;
+    const char* end;
+  public:
+    reader_t (string_ref bytes) : p {bytes.data()}, end {bytes.data() + bytes.size()} {};
+
+    bool done () const { return p == end; }
+
+    const char* take (size_t n) {
+      if (static_cast<size_t>(end - p) < n)
+        throw std::runtime_error("Truncated record");
+      const char* start {p};
+      p += n;
+      return start;
+    }
+
+    uint32_t u32 () {
+      uint32_t n {0};
+      std::memcpy(&n, take(sizeof n), sizeof n);
+      return n;
+    }
+
+    uint64_t u64 () {
+      uint64_t n {0};
+      std::memcpy(&n, take(sizeof n), sizeof n);
+      return n;
+    }
+
+    string_ref str (uint32_t n) {
+      return string_ref {take(n), n};
+    }
+
+    string_ref str () {
+      return str(u32());
+    }
+  };
+
+  uint32_t crc32 (string_ref bytes) {
+    static const vector<uint32_t> table {[] {
+        vector<uint32_t> t (256);
+        for (uint32_t i {0}; i < 256; ++i) {
+          uint32_t c {i};
+          for (int k {0}; k < 8; ++k)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+          t[i] = c;
+        }
+        return t;
+      }()};
+    uint32_t crc {0xffffffff};
+    for (unsigned char c : bytes)
+      crc = table[(crc ^ c) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+  }
+
+  /*
+    Keys: a table is table + '\0', and each of its entities is
+    table + '\0' + partition + '\0' + row. Azure forbids control
+    characters in keys, so these sort as Azure scans them.
+   */
+  string table_key (const string& table) {
+    return table + '\0';
+  }
+
+  string entity_key (const string& table, const string& partition, const string& row) {
+    return table + '\0' + partition + '\0' + row;
+  }
+
+  string encode_entity (const string& etag, const table_entity::properties_type& properties) {
+    string out {};
+    put_string(out, etag);
+    put_u32(out, static_cast<uint32_t>(properties.size()));
+    for (const auto& v : properties) {
+      put_string(out, v.first);
+      const entity_property& p = v.second;
+      switch (p.property_type()) {
+      case edm_type::string:
+        out += string_tag;
+        put_string(out, p.string_value());
+        break;
+      case edm_type::boolean:
+        out += boolean_tag;
+        out += static_cast<char>(p.boolean_value());
+        break;
+      case edm_type::int32:
+        out += int32_tag;
+        put_u32(out, static_cast<uint32_t>(p.int32_value()));
+        break;
+      case edm_type::int64:
+        out += int64_tag;
+        put_u64(out, static_cast<uint64_t>(p.int64_value()));
+        break;
+      case edm_type::double_floating_point: {
+        double d {p.double_value()};
+        uint64_t bits {0};
+        std::memcpy(&bits, &d, sizeof bits);
+        out += double_tag;
+        put_u64(out, bits);
+        break;
+      }
+      default:
+        // Kept as its string form
+        out += string_tag;
+        put_string(out, p.str());
+        break;
+      }
+    }
+    return out;
+  }
+
+  string decode_etag (string_ref value) {
+    reader_t in {value};
+    return in.str().to_string();
+  }
+
+  table_entity decode_entity (const string& partition, const string& row, string_ref value) {
+    reader_t in {value};
+    table_entity entity {partition, row};
+    entity.set_etag(in.str().to_string());
+    table_entity::properties_type& properties = entity.properties();
+    for (uint32_t n {in.u32()}; n > 0; --n) {
+      string name {in.str().to_string()};
+      char tag {*in.take(1)};
+      switch (tag) {
+      case string_tag:  properties[name] = entity_property {in.str().to_string()}; break;
+      case boolean_tag: properties[name] = entity_property {*in.take(1) != 0}; break;
+      case int32_tag:   properties[name] = entity_property {static_cast<int32_t>(in.u32())}; break;
+      case int64_tag:   properties[name] = entity_property {static_cast<int64_t>(in.u64())}; break;
+      case double_tag: {
+        uint64_t bits {in.u64()};
+        double d {0};
+        std::memcpy(&d, &bits, sizeof d);
+        properties[name] = entity_property {d};
+        break;
+      }
+      default:
+        throw std::runtime_error("Unknown property type");
+      }
+    }
+    return entity;
+  }
+
+  // Split the key of an entity of the table with key prefix table_prefix
+  void split_entity_key (string_ref key, size_t table_prefix, string& partition, string& row) {
+    string_ref rest {key.substr(table_prefix)};
+    size_t sep {rest.find('\0')};
+    partition = rest.substr(0, sep).to_string();
+    row = rest.substr(sep + 1).to_string();
+  }
+
+  void write_all (int fd, const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t n {::write(fd, data, size)};
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        throw std::runtime_error(string {"Write failed: "} + std::strerror(errno));
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+  }
+
+  void sync_fd (int fd) {
+    if (::fdatasync(fd) != 0)
+      throw std::runtime_error(string {"Sync failed: "} + std::strerror(errno));
+  }
+
+  // Make the creation, renaming and removal of files in dir durable
+  void sync_dir (const string& dir) {
+    int fd {::open(dir.c_str(), O_RDONLY | O_DIRECTORY)};
+    if (fd < 0)
+      throw std::runtime_error("Cannot open " + dir + ": " + std::strerror(errno));
+    ::fsync(fd);
+    ::close(fd);
+  }
+
+  // Write contents to path via a temporary file, so path is never seen half written
+  void replace_file (const string& dir, const string& path, const string& contents) {
+    const string tmp {path + ".tmp"};
+    int fd {::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+    if (fd < 0)
+      throw std::runtime_error("Cannot create " + tmp + ": " + std::strerror(errno));
+    try {
+      write_all(fd, contents.data(), contents.size());
+      sync_fd(fd);
+    }
+    catch (...) {
+      ::close(fd);
+      throw;
+    }
+    ::close(fd);
+    if (::rename(tmp.c_str(), path.c_str()) != 0)
+      throw std::runtime_error("Cannot rename " + tmp + ": " + std::strerror(errno));
+    sync_dir(dir);
+  }
+
+  // File number of name if it is prefix + number + suffix
+  bool file_number (const string& name, const string& prefix, const string& suffix, uint64_t& number) {
+    if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+      return false;
+    const string digits {name.substr(prefix.size(), name.size() - prefix.size() - suffix.size())};
+    if (digits.find_first_not_of("0123456789") != string::npos)
+      return false;
+    number = std::stoull(digits);
+    return true;
+  }
+}
+
+/*
+  A sorted, immutable run of entries, read in place through mmap:
+
+    entries   for each: key length (u32), value length (u32, or
+              tombstone_length), key, value
+    index     offset of each entry (u64), in key order
+    footer    offset of index (u64), number of entries (u64), segment_magic
+ */
+class Segment {
+private:
+  string file;
+  int fd;
+  const char* data;
+  size_t bytes;
+  size_t index;
+  size_t count;
+
+  size_t offset (size_t i) const {
+    uint64_t at {0};
+    std::memcpy(&at, data + index + i * sizeof at, sizeof at);
+    return static_cast<size_t>(at);
+  }
+
+  uint32_t length (size_t at) const {
+    uint32_t n {0};
+    std::memcpy(&n, data + at, sizeof n);
+    return n;
+  }
+public:
+  Segment (const string& dir, const string& file) :
+    file {file},
+    fd {-1},
+    data {nullptr},
+    bytes {0},
+    index {0},
+    count {0}
+  {
+    const string path {dir + "/" + file};
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0 || st.st_size < 24) {
+      if (fd >= 0)
+        ::close(fd);
+      throw std::runtime_error("Cannot open segment " + path);
+    }
+    bytes = static_cast<size_t>(st.st_size);
+    void* mapped {::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0)};
+    if (mapped == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("Cannot map segment " + path);
+    }
+    data = static_cast<const char*>(mapped);
+    reader_t footer {string_ref {data + bytes - 24, 24}};
+    index = static_cast<size_t>(footer.u64());
+    count = static_cast<size_t>(footer.u64());
+    if (footer.u64() != segment_magic || index > bytes - 24 || count > (bytes - 24 - index) / 8) {
+      ::munmap(const_cast<char*>(data), bytes);
+      ::close(fd);
+      throw std::runtime_error("Corrupt segment " + path);
+    }
+  }
+
+  ~Segment () {
+    ::munmap(const_cast<char*>(data), bytes);
+    ::close(fd);
+  }
+
+  Segment (const Segment&) = delete;
+  Segment& operator= (const Segment&) = delete;
+
+  const string& name () const { return file; }
+  size_t size () const { return count; }
+
+  string_ref key (size_t i) const {
+    size_t at {offset(i)};
+    return string_ref {data + at + 8, length(at)};
+  }
+
+  bool tombstone (size_t i) const {
+    return length(offset(i) + 4) == tombstone_length;
+  }
+
+  string_ref value (size_t i) const {
+    size_t at {offset(i)};
+    return string_ref {data + at + 8 + length(at), length(at + 4)};
+  }
+
+  // Index of the first entry not less than k
+  size_t lower_bound (string_ref k) const {
+    size_t low {0};
+    size_t high {count};
+    while (low < high) {
+      size_t mid {low + (high - low) / 2};
+      if (key(mid) < k)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    return low;
+  }
+};
+
+/*
+  A position in one source of entries, a memtable or a segment
+ */
+struct DiskTableStore::cursor_t {
+  shared_ptr<const memtable_t> memtable;
+  memtable_t::const_iterator it;
+  shared_ptr<const Segment> segment;
+  size_t pos;
+
+  bool done () const { return memtable ? it == memtable->end() : pos == segment->size(); }
+  string_ref key () const { return memtable ? string_ref {it->first} : segment->key(pos); }
+  bool tombstone () const { return memtable ? it->second.tombstone : segment->tombstone(pos); }
+  string_ref value () const { return memtable ? string_ref {it->second.value} : segment->value(pos); }
+  void next () {
+    if (memtable)
+      ++it;
+    else
+      ++pos;
+  }
+};
+
+namespace {
+  /*
+    Sources are newest first. Returns the index of the newest source
+    at the smallest key, whose entry wins, or sources.size() once all
+    are done.
+   */
+  template<typename Cursor>
+  size_t smallest (const vector<Cursor>& sources) {
+    size_t best {sources.size()};
+    for (size_t i {0}; i < sources.size(); ++i) {
+      if ( ! sources[i].done() && (best == sources.size() || sources[i].key() < sources[best].key()))
+        best = i;
+    }
+    return best;
+  }
+
+  // Move every source at key past it
+  template<typename Cursor>
+  void advance_past (vector<Cursor>& sources, const string& key) {
+    for (auto& s : sources) {
+      if ( ! s.done() && s.key() == key)
+        s.next();
+    }
+  }
+}
+
+DiskTableStore::DiskTableStore (const string& dir, const string& secret, bool sync_writes,
+                                size_t memtable_bytes, size_t max_segments) :
+  dir {dir},
+  secret {secret},
+  sync_writes {sync_writes},
+  memtable_bytes {memtable_bytes},
+  max_segments {max_segments},
+  store_lock {},
+  changed {},
+  active {std::make_shared<memtable_t>()},
+  active_bytes {0},
+  frozen {},
+  frozen_log {0},
+  segments {},
+  log_fd {-1},
+  log_number {0},
+  log_size {0},
+  flushed_log {0},
+  next_file {1},
+  etag_count {0},
+  stopping {false},
+  background {}
+{
+  if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    throw std::runtime_error("Cannot create " + dir + ": " + std::strerror(errno));
+
+  std::set<string> live {};
+  std::ifstream manifest {dir + "/MANIFEST"};
+  string word {};
+  while (manifest >> word) {
+    if (word == "flushed")
+      manifest >> flushed_log;
+    else if (word == "segment" && manifest >> word) {
+      segments.push_back(std::make_shared<const Segment>(dir, word));
+      live.insert(word);
+    }
+  }
+
+  // Clear away what a crash left behind, and find the logs to replay
+  vector<uint64_t> logs {};
+  DIR* listing {::opendir(dir.c_str())};
+  if (listing == nullptr)
+    throw std::runtime_error("Cannot list " + dir + ": " + std::strerror(errno));
+  while (struct dirent* entry = ::readdir(listing)) {
+    const string name {entry->d_name};
+    uint64_t number {0};
+    bool log {file_number(name, "wal-", ".log", number)};
+    bool segment { ! log && file_number(name, "seg-", ".sst", number)};
+    if (log || segment)
+      next_file = std::max(next_file, number + 1);
+    if ((log && number > flushed_log))
+      logs.push_back(number);
+    else if (log || (segment && live.count(name) == 0) ||
+             (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0))
+      ::unlink((dir + "/" + name).c_str());
+  }
+  ::closedir(listing);
+
+  std::sort(logs.begin(), logs.end());
+  if ( ! logs.empty()) {
+    memtable_t replayed {};
+    size_t replayed_bytes {0};
+    for (auto n : logs)
+      replay(path("wal-", n, ".log"), replayed, replayed_bytes);
+    if ( ! replayed.empty()) {
+      shared_ptr<const memtable_t> memtable {std::make_shared<const memtable_t>(std::move(replayed))};
+      segments.insert(segments.begin(),
+                      write_segment(vector<cursor_t> {cursor_t {memtable, memtable->begin(), nullptr, 0}},
+                                    false, next_file++));
+    }
+    flushed_log = logs.back();
+    write_manifest(segments, flushed_log);
+    for (auto n : logs)
+      ::unlink(path("wal-", n, ".log").c_str());
+  }
+
+  open_log();
+  background = std::thread {&DiskTableStore::run_background, this};
+}
+
+DiskTableStore::~DiskTableStore () {
+  {
+    std::lock_guard<std::mutex> guard {store_lock};
+    stopping = true;
+  }
+  changed.notify_all();
+  background.join();
+  // Anything not yet in a segment is in the logs, replayed on the next open
+  if (log_fd >= 0)
+    ::close(log_fd);
+}
+
+string DiskTableStore::path (const string& prefix, uint64_t number, const string& suffix) const {
+  return dir + "/" + prefix + std::to_string(number) + suffix;
+}
+
+// Start a new log for the active memtable. Called with store_lock held, or before it is shared.
+void DiskTableStore::open_log () {
+  if (log_fd >= 0)
+    ::close(log_fd);
+  log_number = next_file++;
+  log_size = 0;
+  const string log_path {path("wal-", log_number, ".log")};
+  log_fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+  if (log_fd < 0)
+    throw std::runtime_error("Cannot create " + log_path + ": " + std::strerror(errno));
+  sync_dir(dir);
+}
+
+/*
+  Apply the records of the log at log_path to memtable. A record is
+  its payload's length (u32) and CRC-32 (u32), then the payload: the
+  number of entries (u32) and each entry as in a segment.
+ */
+void DiskTableStore::replay (const string& log_path, memtable_t& memtable, size_t& bytes) {
+  std::ifstream in {log_path, std::ios::binary};
+  const string log {std::istreambuf_iterator<char> {in}, std::istreambuf_iterator<char> {}};
+  reader_t records {log};
+  size_t records_read {0};
+  try {
+    while ( ! records.done()) {
+      uint32_t length {records.u32()};
+      uint32_t crc {records.u32()};
+      string_ref payload {records.str(length)};
+      if (crc32(payload) != crc)
+        throw std::runtime_error("Bad checksum");
+      reader_t entries {payload};
+      for (uint32_t n {entries.u32()}; n > 0; --n) {
+        uint32_t key_length {entries.u32()};
+        uint32_t value_length {entries.u32()};
+        string key {entries.str(key_length).to_string()};
+        bool tombstone {value_length == tombstone_length};
+        string value {tombstone ? string {} : entries.str(value_length).to_string()};
+        bytes += key.size() + value.size();
+        memtable[key] = record_t {tombstone, std::move(value)};
+      }
+      ++records_read;
+    }
+  }
+  catch (const std::runtime_error& e) {
+    // A write torn by a crash; nothing after it was acknowledged
+    cerr << "DiskTableStore: " << log_path << " ends after record " << records_read << ": " << e.what() << endl;
+  }
+}
+
+void DiskTableStore::write_manifest (const vector<shared_ptr<const Segment>>& live, uint64_t flushed) const {
+  string contents {"flushed " + std::to_string(flushed) + "\n"};
+  for (const auto& s : live)
+    contents += "segment " + s->name() + "\n";
+  replace_file(dir, dir + "/MANIFEST", contents);
+}
+
+/*
+  Merge sources, newest first, into the new segment number. Tombstones
+  may be dropped only when sources include the oldest segment.
+ */
+shared_ptr<const Segment> DiskTableStore::write_segment (vector<cursor_t> sources, bool drop_tombstones,
+                                                         uint64_t number) {
+  const string file {"seg-" + std::to_string(number) + ".sst"};
+  const string final_path {dir + "/" + file};
+  const string tmp {final_path + ".tmp"};
+  int fd {::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+  if (fd < 0)
+    throw std::runtime_error("Cannot create " + tmp + ": " + std::strerror(errno));
+  try {
+    string buffer {};
+    vector<uint64_t> offsets {};
+    uint64_t written {0};
+    for (size_t s {smallest(sources)}; s < sources.size(); s = smallest(sources)) {
+      const string key {sources[s].key().to_string()};
+      if ( ! (drop_tombstones && sources[s].tombstone())) {
+        offsets.push_back(written + buffer.size());
+        put_u32(buffer, static_cast<uint32_t>(key.size()));
+        put_u32(buffer, sources[s].tombstone() ? tombstone_length : static_cast<uint32_t>(sources[s].value().size()));
+        buffer += key;
+        if ( ! sources[s].tombstone())
+          buffer.append(sources[s].value().data(), sources[s].value().size());
+        if (buffer.size() >= write_chunk) {
+          write_all(fd, buffer.data(), buffer.size());
+          written += buffer.size();
+          buffer.clear();
+        }
+      }
+      advance_past(sources, key);
+    }
+    uint64_t index {written + buffer.size()};
+    for (auto o : offsets)
+      put_u64(buffer, o);
+    put_u64(buffer, index);
+    put_u64(buffer, offsets.size());
+    put_u64(buffer, segment_magic);
+    write_all(fd, buffer.data(), buffer.size());
+    sync_fd(fd);
+  }
+  catch (...) {
+    ::close(fd);
+    ::unlink(tmp.c_str());
+    throw;
+  }
+  ::close(fd);
+  if (::rename(tmp.c_str(), final_path.c_str()) != 0)
+    throw std::runtime_error("Cannot rename " + tmp + ": " + std::strerror(errno));
+  sync_dir(dir);
+  return std::make_shared<const Segment>(dir, file);
+}
+
+/*
+  Write frozen memtables out as segments, and merge the segments once
+  there are too many, until the store is destroyed
+ */
+void DiskTableStore::run_background () {
+  unique_lock<std::mutex> guard {store_lock};
+  while (true) {
+    changed.wait(guard, [this] { return stopping || frozen || segments.size() > max_segments; });
+    if (stopping)
+      return;
+    vector<shared_ptr<const Segment>> live {segments};
+    uint64_t number {next_file++};
+    try {
+      if (frozen) {
+        shared_ptr<const memtable_t> memtable {frozen};
+        uint64_t log {frozen_log};
+        guard.unlock();
+        live.insert(live.begin(),
+                    write_segment(vector<cursor_t> {cursor_t {memtable, memtable->begin(), nullptr, 0}},
+                                  false, number));
+        write_manifest(live, log);
+        ::unlink(path("wal-", log, ".log").c_str());
+        guard.lock();
+        segments = live;
+        frozen.reset();
+        flushed_log = log;
+      }
+      else {
+        uint64_t flushed {flushed_log};
+        guard.unlock();
+        vector<cursor_t> sources {};
+        for (const auto& s : live)
+          sources.push_back(cursor_t {nullptr, memtable_t::const_iterator {}, s, 0});
+        shared_ptr<const Segment> merged {write_segment(sources, true, number)};
+        write_manifest(vector<shared_ptr<const Segment>> {merged}, flushed);
+        for (const auto& s : live)
+          ::unlink((dir + "/" + s->name()).c_str());
+        guard.lock();
+        segments = vector<shared_ptr<const Segment>> {merged};
+      }
+      changed.notify_all();
+    }
+    catch (const std::exception& e) {
+      // Most likely out of space; writers wait on the frozen memtable meanwhile
+      cerr << "DiskTableStore: " << e.what() << endl;
+      if ( ! guard.owns_lock())
+        guard.lock();
+      changed.wait_for(guard, std::chrono::seconds {1});
+    }
+  }
+}
+
+/*
+  Every source, newest first, positioned at the first entry not less than key
+ */
+vector<DiskTableStore::cursor_t> DiskTableStore::sources_from (const string& key) const {
+  vector<cursor_t> sources {};
+  sources.push_back(cursor_t {active, active->lower_bound(key), nullptr, 0});
+  if (frozen)
+    sources.push_back(cursor_t {frozen, frozen->lower_bound(key), nullptr, 0});
+  for (const auto& s : segments)
+    sources.push_back(cursor_t {nullptr, memtable_t::const_iterator {}, s, s->lower_bound(key)});
+  return sources;
+}
+
+// The newest value of key, if it has one that is not a tombstone
+bool DiskTableStore::lookup (const string& key, string& value) const {
+  const memtable_t* memtables[] {active.get(), frozen.get()};
+  for (const memtable_t* memtable : memtables) {
+    if (memtable == nullptr)
+      continue;
+    auto found (memtable->find(key));
+    if (found != memtable->end()) {
+      if (found->second.tombstone)
+        return false;
+      value = found->second.value;
+      return true;
+    }
+  }
+  for (const auto& s : segments) {
+    size_t i {s->lower_bound(key)};
+    if (i < s->size() && s->key(i) == key) {
+      if (s->tombstone(i))
+        return false;
+      value = s->value(i).to_string();
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+  Append entries to the log as one record and apply them to the
+  memtable, freezing it if it is full
+ */
+status_code DiskTableStore::commit (vector<pair<string,record_t>>& entries, unique_lock<std::mutex>& guard) {
+  string payload {};
+  put_u32(payload, static_cast<uint32_t>(entries.size()));
+  for (const auto& e : entries) {
+    put_u32(payload, static_cast<uint32_t>(e.first.size()));
+    put_u32(payload, e.second.tombstone ? tombstone_length : static_cast<uint32_t>(e.second.value.size()));
+    payload += e.first;
+    payload += e.second.value;
+  }
+  string record {};
+  put_u32(record, static_cast<uint32_t>(payload.size()));
+  put_u32(record, crc32(payload));
+  record += payload;
+  try {
+    write_all(log_fd, record.data(), record.size());
+    if (sync_writes)
+      sync_fd(log_fd);
+    log_size += record.size();
+  }
+  catch (const std::exception& e) {
+    cerr << "DiskTableStore: " << e.what() << endl;
+    // Cut off any part written, so later records are not lost behind it
+    if (::ftruncate(log_fd, static_cast<off_t>(log_size)) != 0)
+      cerr << "DiskTableStore: cannot truncate log " << log_number << endl;
+    return status_codes::InternalError;
+  }
+
+  for (auto& e : entries) {
+    active_bytes += e.first.size() + e.second.value.size();
+    (*active)[e.first] = std::move(e.second);
+  }
+
+  if (active_bytes >= memtable_bytes) {
+    // Wait for the last frozen memtable to be written out first
+    changed.wait(guard, [this] { return ! frozen || stopping; });
+    if ( ! frozen && active_bytes >= memtable_bytes) {
+      frozen = active;
+      frozen_log = log_number;
+      active = std::make_shared<memtable_t>();
+      active_bytes = 0;
+      try {
+        open_log();
+      }
+      catch (const std::exception& e) {
+        cerr << "DiskTableStore: " << e.what() << endl;
+        log_fd = -1;
+      }
+      changed.notify_all();
+    }
+  }
+  return status_codes::OK;
+}
+
+string DiskTableStore::next_etag () {
+  auto now (std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count());
+  return "W/\"" + std::to_string(now) + "." + std::to_string(++etag_count) + "\"";
+}
+
+/*
+  Check ops against table and, if all would succeed, commit them together
+ */
+status_code DiskTableStore::apply_ops (const string& table, const vector<store_op_t>& ops,
+                                       unique_lock<std::mutex>& guard) {
+  if (log_fd < 0)
+    return status_codes::InternalError;
+  string value {};
+  if ( ! lookup(table_key(table), value))
+    return status_codes::NotFound;
+
+  vector<pair<string,record_t>> entries {};
+  for (const auto& op : ops) {
+    string key {entity_key(table, op.entity.partition_key(), op.entity.row_key())};
+    bool found {lookup(key, value)};
+    string etag {found ? decode_etag(value) : string {}};
+    status_code status {write_status(op, found ? &etag : nullptr)};
+    if (status != status_codes::OK)
+      return status;
+
+    if (op.kind == store_op_t::remove) {
+      entries.push_back(make_pair(key, record_t {true, string {}}));
+      continue;
+    }
+    table_entity::properties_type properties {};
+    if (found && (op.kind == store_op_t::merge || op.kind == store_op_t::insert_or_merge))
+      properties = decode_entity(op.entity.partition_key(), op.entity.row_key(), value).properties();
+    for (const auto& v : op.entity.properties())
+      properties[v.first] = v.second;
+    entries.push_back(make_pair(key, record_t {false, encode_entity(next_etag(), properties)}));
+  }
+  return commit(entries, guard);
+}
+
+bool DiskTableStore::exists (const string& table) {
+  std::lock_guard<std::mutex> guard {store_lock};
+  string value {};
+  return lookup(table_key(table), value);
+}
+
+bool DiskTableStore::create_table (const string& table) {
+  unique_lock<std::mutex> guard {store_lock};
+  string value {};
+  if (lookup(table_key(table), value))
+    return false;
+  vector<pair<string,record_t>> entries {make_pair(table_key(table), record_t {false, string {}})};
+  if (log_fd < 0 || commit(entries, guard) != status_codes::OK)
+    throw std::runtime_error("Cannot create table " + table);
+  return true;
+}
+
+bool DiskTableStore::delete_table (const string& table) {
+  unique_lock<std::mutex> guard {store_lock};
+  const string prefix {table_key(table)};
+  string value {};
+  if ( ! lookup(prefix, value))
+    return false;
+  // A tombstone for the table and each of its entities
+  vector<pair<string,record_t>> entries {};
+  vector<cursor_t> sources {sources_from(prefix)};
+  for (size_t s {smallest(sources)}; s < sources.size(); s = smallest(sources)) {
+    const string key {sources[s].key().to_string()};
+    if (key.compare(0, prefix.size(), prefix) != 0)
+      break;
+    if ( ! sources[s].tombstone())
+      entries.push_back(make_pair(key, record_t {true, string {}}));
+    advance_past(sources, key);
+  }
+  if (log_fd < 0 || commit(entries, guard) != status_codes::OK)
+    throw std::runtime_error("Cannot delete table " + table);
+  return true;
+}
+
+status_code DiskTableStore::retrieve (const string& table, const string& partition, const string& row,
+                                      table_entity& entity) {
+  string value {};
+  {
+    std::lock_guard<std::mutex> guard {store_lock};
+    if ( ! lookup(entity_key(table, partition, row), value))
+      return status_codes::NotFound;
+  }
+  entity = decode_entity(partition, row, value);
+  return status_codes::OK;
+}
+
+status_code DiskTableStore::write (const string& table, const store_op_t& op) {
+  unique_lock<std::mutex> guard {store_lock};
+  return apply_ops(table, vector<store_op_t> {op}, guard);
+}
+
+status_code DiskTableStore::write_batch (const string& table, const vector<store_op_t>& ops) {
+  if ( ! valid_batch(ops))
+    return status_codes::BadRequest;
+  if (ops.empty())
+    return status_codes::OK;
+  unique_lock<std::mutex> guard {store_lock};
+  return apply_ops(table, ops, guard);
+}
+
+status_code DiskTableStore::scan (const string& table, const scan_t& spec, const entity_fn& on_entity) {
+  const string prefix {table_key(table)};
+  // Every key scanned starts with bound
+  const string bound {spec.partition.empty() ? prefix : prefix + spec.partition + '\0'};
+  string start {spec.partition.empty() ? prefix : bound + spec.low};
+  if ( ! spec.start_partition.empty())
+    start = std::max(start, prefix + spec.start_partition + '\0' + spec.start_row);
+  size_t visited {0};
+  bool resuming {false};
+  vector<table_entity> page {};
+  string partition {};
+  string row {};
+  while (true) {
+    page.clear();
+    {
+      std::lock_guard<std::mutex> guard {store_lock};
+      string value {};
+      if ( ! lookup(prefix, value))
+        return resuming ? status_codes::OK : status_codes::NotFound;
+      vector<cursor_t> sources {sources_from(start)};
+      // start becomes where the next page begins, or empty at the end
+      for (size_t s {smallest(sources)}; s < sources.size() && page.size() < scan_page_size; s = smallest(sources)) {
+        const string key {sources[s].key().to_string()};
+        if (key.compare(0, bound.size(), bound) != 0) {
+          start.clear();
+          break;
+        }
+        start = key + '\0';
+        if (key.size() > prefix.size() && ! sources[s].tombstone()) {
+          split_entity_key(key, prefix.size(), partition, row);
+          bool in_range {(spec.low.empty() || (spec.low_inclusive ? row >= spec.low : row > spec.low)) &&
+                         (spec.high.empty() || (spec.high_inclusive ? row <= spec.high : row < spec.high))};
+          if (in_range) {
+            table_entity entity {decode_entity(partition, row, sources[s].value())};
+            bool wanted {true};
+            if ( ! spec.below_prop.empty()) {
+              auto prop (entity.properties().find(spec.below_prop));
+              wanted = prop != entity.properties().end() && prop->second.property_type() == edm_type::string &&
+                prop->second.string_value() < spec.below_value;
+            }
+            if (wanted)
+              page.push_back(std::move(entity));
+          }
+          else if ( ! spec.partition.empty() && ! spec.high.empty() && row >= spec.high) {
+            start.clear();
+            break;
+          }
+        }
+        advance_past(sources, key);
+      }
+      if (smallest(sources) == sources.size())
+        start.clear();
+    }
+    for (const auto& entity : page) {
+      if ( ! on_entity(entity) || (spec.limit > 0 && ++visited == spec.limit))
+        return status_codes::OK;
+    }
+    if (start.empty())
+      return status_codes::OK;
+    resuming = true;
+  }
+}
+
+pair<status_code,string> DiskTableStore::get_token (const string& table, const string& partition, const string& row,
+                                                    uint8_t permissions, const utility::datetime& expiry) {
+  return make_pair(status_codes::OK, make_store_token(secret, table, partition, row, permissions, expiry));
+}
+
+status_code DiskTableStore::retrieve_with_token (const string& table, const string& token,
+                                                 const string& partition, const string& row,
+                                                 table_entity& entity) {
+  if ( ! store_token_permits(secret, token, table, partition, row, table_shared_access_policy::permissions::read))
+    return status_codes::Forbidden;
+  return retrieve(table, partition, row, entity);
+}
+
+status_code DiskTableStore::write_with_token (const string& table, const string& token, const store_op_t& op) {
+  if ( ! store_token_permits(secret, token, table, op.entity.partition_key(), op.entity.row_key(),
+                             permissions_for(op.kind)))
+    return status_codes::Forbidden;
+  return write(table, op);
+}
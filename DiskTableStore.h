@@ -0,0 +1,136 @@
+#ifndef DiskTableStore_h
+#define DiskTableStore_h
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+class Segment;
+
+/*
+  TableStore kept in files in one directory, for running the servers
+  without a storage account and with their tables surviving restarts
+
+  The store is a log-structured merge tree of byte-string keys, one
+  per table and one per entity (table, partition, row), in the order
+  Azure Table Storage scans them:
+
+    wal-N.log   Every write, and every batch as a single record, is
+                appended to the write-ahead log, and synced if
+                sync_writes, before it is applied to the memtable, a
+                sorted map in memory.
+    seg-N.sst   A full memtable is frozen and written out by a
+                background thread as an immutable, sorted segment,
+                which is read through mmap and binary searched in place.
+    MANIFEST    The segments in use, newest first, and the last log
+                that has been written out; replaced atomically, so a
+                crash at any point leaves a consistent set of files.
+
+  Reads look in the memtable, then the frozen one, then each segment
+  from newest to oldest, and the first entry found for a key wins;
+  a deletion is a tombstone entry. Once there are more than
+  max_segments segments, the background thread merges them all into
+  one, dropping tombstones and overwritten entries.
+
+  On opening, logs not yet written out are replayed, stopping at the
+  first torn or corrupt record, and written out at once.
+
+  Tokens are signed with secret (see StoreUtils.h). Errors opening
+  the directory throw std::runtime_error; errors writing it make the
+  write return InternalError.
+ */
+class DiskTableStore : public TableStore {
+private:
+  struct record_t {
+    bool tombstone;
+    std::string value;
+  };
+  using memtable_t = std::map<std::string,record_t>;
+  struct cursor_t;
+
+  const std::string dir;
+  const std::string secret;
+  const bool sync_writes;
+  const std::size_t memtable_bytes;
+  const std::size_t max_segments;
+
+  std::mutex store_lock;
+  std::condition_variable changed;  // frozen written out, or stopping
+  std::shared_ptr<memtable_t> active;
+  std::size_t active_bytes;
+  std::shared_ptr<const memtable_t> frozen;  // Being written out, or null
+  uint64_t frozen_log;
+  std::vector<std::shared_ptr<const Segment>> segments;  // Newest first
+  int log_fd;  // Of the active memtable's log, or -1 if it could not be opened
+  uint64_t log_number;
+  std::size_t log_size;  // Bytes of whole records in it
+  uint64_t flushed_log;  // Last log whose entries are all in segments
+  uint64_t next_file;
+  uint64_t etag_count;
+  bool stopping;
+  std::thread background;
+
+  std::string path (const std::string& prefix, uint64_t number, const std::string& suffix) const;
+  void open_log ();
+  void replay (const std::string& log_path, memtable_t& memtable, std::size_t& bytes);
+  void write_manifest (const std::vector<std::shared_ptr<const Segment>>& live, uint64_t flushed) const;
+  std::shared_ptr<const Segment> write_segment (std::vector<cursor_t> sources, bool drop_tombstones,
+                                                uint64_t number);
+  void run_background ();
+
+  // Called with store_lock held
+  std::vector<cursor_t> sources_from (const std::string& key) const;
+  bool lookup (const std::string& key, std::string& value) const;
+  web::http::status_code commit (std::vector<std::pair<std::string,record_t>>& entries,
+                                 std::unique_lock<std::mutex>& guard);
+  web::http::status_code apply_ops (const std::string& table, const std::vector<store_op_t>& ops,
+                                    std::unique_lock<std::mutex>& guard);
+  std::string next_etag ();
+public:
+  /*
+    dir: the directory, created if it does not exist
+    memtable_bytes: roughly how large the memtable grows before it is
+      written out as a segment
+    Throws std::runtime_error if dir cannot be opened or recovered.
+   */
+  DiskTableStore (const std::string& dir, const std::string& secret, bool sync_writes = true,
+                  std::size_t memtable_bytes = 4 << 20, std::size_t max_segments = 4);
+  ~DiskTableStore ();
+
+  DiskTableStore (const DiskTableStore&) = delete;
+  DiskTableStore& operator= (const DiskTableStore&) = delete;
+
+  bool exists (const std::string& table) override;
+  bool create_table (const std::string& table) override;
+  bool delete_table (const std::string& table) override;
+
+  web::http::status_code retrieve (const std::string& table, const std::string& partition,
+                                   const std::string& row, azure::storage::table_entity& entity) override;
+  web::http::status_code write (const std::string& table, const store_op_t& op) override;
+  web::http::status_code write_batch (const std::string& table, const std::vector<store_op_t>& ops) override;
+  web::http::status_code scan (const std::string& table, const scan_t& spec, const entity_fn& on_entity) override;
+
+  std::pair<web::http::status_code,std::string>
+  get_token (const std::string& table, const std::string& partition, const std::string& row,
+             uint8_t permissions, const utility::datetime& expiry) override;
+  web::http::status_code retrieve_with_token (const std::string& table, const std::string& token,
+                                              const std::string& partition, const std::string& row,
+                                              azure::storage::table_entity& entity) override;
+  web::http::status_code write_with_token (const std::string& table, const std::string& token,
+                                           const store_op_t& op) override;
+};
+
+#endif
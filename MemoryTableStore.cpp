@@ -0,0 +1,272 @@
+#include "MemoryTableStore.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include <was/table.h>
+
+#include "StoreUtils.h"
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+using azure::storage::table_shared_access_policy;
+
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::json::value;
+
+namespace {
+  // Most entities a scan copies out under the lock at once
+  constexpr size_t scan_page_size {256};
+
+  entity_property property_of (const value& v) {
+    if (v.is_string())
+      return entity_property {v.as_string()};
+    if (v.is_boolean())
+      return entity_property {v.as_bool()};
+    if (v.is_integer()) {
+      int64_t n {v.as_number().to_int64()};
+      if (n >= std::numeric_limits<int32_t>::min() && n <= std::numeric_limits<int32_t>::max())
+        return entity_property {static_cast<int32_t>(n)};
+      return entity_property {n};
+    }
+    if (v.is_number())
+      return entity_property {v.as_double()};
+    return entity_property {v.serialize()};
+  }
+}
+
+void MemoryTableStore::load (const string& path) {
+  std::ifstream in {path};
+  if ( ! in)
+    throw std::runtime_error("Cannot read " + path);
+  std::ostringstream text {};
+  text << in.rdbuf();
+  value tables_json {};
+  try {
+    tables_json = value::parse(text.str());
+  }
+  catch (const web::json::json_exception& e) {
+    throw std::runtime_error(path + ": " + e.what());
+  }
+  if ( ! tables_json.is_object())
+    throw std::runtime_error(path + ": not an object of tables");
+
+  std::lock_guard<std::mutex> guard {store_lock};
+  for (const auto& t : tables_json.as_object()) {
+    if ( ! t.second.is_array())
+      throw std::runtime_error(path + ": " + t.first + " is not an array of entities");
+    table_t& table = tables[t.first];
+    for (const auto& e : t.second.as_array()) {
+      if ( ! e.is_object() || ! e.has_field("Partition") || ! e.at("Partition").is_string() ||
+           ! e.has_field("Row") || ! e.at("Row").is_string())
+        throw std::runtime_error(path + ": " + t.first + " has an entity without a Partition and Row");
+      stored_t& stored = table[e.at("Partition").as_string()][e.at("Row").as_string()];
+      for (const auto& p : e.as_object()) {
+        if (p.first != "Partition" && p.first != "Row")
+          stored.properties[p.first] = property_of(p.second);
+      }
+      stored.etag = "W/\"" + std::to_string(++version) + "\"";
+    }
+  }
+}
+
+bool MemoryTableStore::exists (const string& table) {
+  std::lock_guard<std::mutex> guard {store_lock};
+  return tables.find(table) != tables.end();
+}
+
+bool MemoryTableStore::create_table (const string& table) {
+  std::lock_guard<std::mutex> guard {store_lock};
+  return tables.insert(make_pair(table, table_t {})).second;
+}
+
+bool MemoryTableStore::delete_table (const string& table) {
+  std::lock_guard<std::mutex> guard {store_lock};
+  return tables.erase(table) == 1;
+}
+
+status_code MemoryTableStore::retrieve (const string& table, const string& partition, const string& row,
+                                        table_entity& entity) {
+  std::lock_guard<std::mutex> guard {store_lock};
+  auto t (tables.find(table));
+  if (t == tables.end())
+    return status_codes::NotFound;
+  auto p (t->second.find(partition));
+  if (p == t->second.end())
+    return status_codes::NotFound;
+  auto r (p->second.find(row));
+  if (r == p->second.end())
+    return status_codes::NotFound;
+  entity = table_entity {partition, row, r->second.etag, r->second.properties};
+  return status_codes::OK;
+}
+
+/*
+  The status op would have if applied to table now
+ */
+status_code MemoryTableStore::check (const table_t& table, const store_op_t& op) const {
+  const string* etag {nullptr};
+  auto p (table.find(op.entity.partition_key()));
+  if (p != table.end()) {
+    auto r (p->second.find(op.entity.row_key()));
+    if (r != p->second.end())
+      etag = &r->second.etag;
+  }
+  return write_status(op, etag);
+}
+
+/*
+  Apply op, which check() has passed, to table
+ */
+void MemoryTableStore::apply (table_t& table, const store_op_t& op) {
+  const string& partition = op.entity.partition_key();
+  if (op.kind == store_op_t::remove) {
+    auto p (table.find(partition));
+    p->second.erase(op.entity.row_key());
+    if (p->second.empty())
+      table.erase(p);
+    return;
+  }
+  stored_t& stored = table[partition][op.entity.row_key()];
+  if (op.kind == store_op_t::insert || op.kind == store_op_t::insert_or_replace || op.kind == store_op_t::replace)
+    stored.properties = op.entity.properties();
+  else {
+    for (const auto& v : op.entity.properties())
+      stored.properties[v.first] = v.second;
+  }
+  stored.etag = "W/\"" + std::to_string(++version) + "\"";
+}
+
+status_code MemoryTableStore::write (const string& table, const store_op_t& op) {
+  std::lock_guard<std::mutex> guard {store_lock};
+  auto t (tables.find(table));
+  if (t == tables.end())
+    return status_codes::NotFound;
+  status_code status {check(t->second, op)};
+  if (status == status_codes::OK)
+    apply(t->second, op);
+  return status;
+}
+
+status_code MemoryTableStore::write_batch (const string& table, const vector<store_op_t>& ops) {
+  if ( ! valid_batch(ops))
+    return status_codes::BadRequest;
+  std::lock_guard<std::mutex> guard {store_lock};
+  auto t (tables.find(table));
+  if (t == tables.end())
+    return status_codes::NotFound;
+  // The ops are to different rows, so none changes whether another passes
+  for (const auto& op : ops) {
+    status_code status {check(t->second, op)};
+    if (status != status_codes::OK)
+      return status;
+  }
+  for (const auto& op : ops)
+    apply(t->second, op);
+  return status_codes::OK;
+}
+
+/*
+  Append to page the entities of table that spec selects, in order,
+  starting after the entity (partition, row) after if it is not
+  nullptr, until page holds scan_page_size
+ */
+void MemoryTableStore::collect (const table_t& table, const scan_t& spec, const pair<string,string>* after,
+                                vector<table_entity>& page) const {
+  auto p (spec.partition.empty() ? (after != nullptr ? table.lower_bound(after->first)
+                                                      : table.lower_bound(spec.start_partition))
+                                 : table.find(spec.partition));
+  for (; p != table.end(); ++p) {
+    if ( ! spec.partition.empty() && p->first != spec.partition)
+      break;
+    if (p->first < spec.start_partition)
+      continue;
+    const partition_t& rows = p->second;
+    auto r (rows.begin());
+    if (after != nullptr && p->first == after->first)
+      r = rows.upper_bound(after->second);
+    else if ( ! spec.low.empty())
+      r = spec.low_inclusive ? rows.lower_bound(spec.low) : rows.upper_bound(spec.low);
+    if (after == nullptr && p->first == spec.start_partition && (r == rows.end() || r->first < spec.start_row))
+      r = rows.lower_bound(spec.start_row);
+    for (; r != rows.end(); ++r) {
+      if ( ! spec.high.empty() && (spec.high_inclusive ? r->first > spec.high : r->first >= spec.high))
+        break;
+      if ( ! spec.below_prop.empty()) {
+        auto prop (r->second.properties.find(spec.below_prop));
+        if (prop == r->second.properties.end() || prop->second.property_type() != edm_type::string ||
+            ! (prop->second.string_value() < spec.below_value))
+          continue;
+      }
+      page.push_back(table_entity {p->first, r->first, r->second.etag, r->second.properties});
+      if (page.size() == scan_page_size)
+        return;
+    }
+  }
+}
+
+status_code MemoryTableStore::scan (const string& table, const scan_t& spec, const entity_fn& on_entity) {
+  size_t visited {0};
+  pair<string,string> last {};
+  bool resuming {false};
+  vector<table_entity> page {};
+  while (true) {
+    page.clear();
+    {
+      std::lock_guard<std::mutex> guard {store_lock};
+      auto t (tables.find(table));
+      if (t == tables.end())
+        return resuming ? status_codes::OK : status_codes::NotFound;
+      collect(t->second, spec, resuming ? &last : nullptr, page);
+    }
+    for (const auto& entity : page) {
+      if ( ! on_entity(entity) || (spec.limit > 0 && ++visited == spec.limit))
+        return status_codes::OK;
+    }
+    if (page.size() < scan_page_size)
+      return status_codes::OK;
+    last = make_pair(page.back().partition_key(), page.back().row_key());
+    resuming = true;
+  }
+}
+
+pair<status_code,string> MemoryTableStore::get_token (const string& table, const string& partition, const string& row,
+                                                      uint8_t permissions, const utility::datetime& expiry) {
+  return make_pair(status_codes::OK, make_store_token(secret, table, partition, row, permissions, expiry));
+}
+
+status_code MemoryTableStore::retrieve_with_token (const string& table, const string& token,
+                                                   const string& partition, const string& row,
+                                                   table_entity& entity) {
+  if ( ! store_token_permits(secret, token, table, partition, row, table_shared_access_policy::permissions::read))
+    return status_codes::Forbidden;
+  return retrieve(table, partition, row, entity);
+}
+
+status_code MemoryTableStore::write_with_token (const string& table, const string& token, const store_op_t& op) {
+  if ( ! store_token_permits(secret, token, table, op.entity.partition_key(), op.entity.row_key(),
+                             permissions_for(op.kind)))
+    return status_codes::Forbidden;
+  return write(table, op);
+}
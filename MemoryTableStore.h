@@ -0,0 +1,87 @@
+#ifndef MemoryTableStore_h
+#define MemoryTableStore_h
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+/*
+  TableStore kept in this process's memory, for running the servers
+  without a storage account and measuring them without its latency
+
+  Each table is a sorted map of partitions, each a sorted map of rows,
+  so point reads and range scans are logarithmic and scans come back
+  in the order Azure Table Storage returns them. A single lock guards
+  all tables; scans copy out a page of entities at a time and call
+  on_entity without it, so a callback may use the store.
+
+  Tokens are signed with secret (see StoreUtils.h). Nothing is kept
+  on disk; each process starts with the tables load()ed into it.
+ */
+class MemoryTableStore : public TableStore {
+private:
+  struct stored_t {
+    azure::storage::table_entity::properties_type properties;
+    std::string etag;
+  };
+  using partition_t = std::map<std::string,stored_t>;  // By row key
+  using table_t = std::map<std::string,partition_t>;   // By partition key
+
+  std::unordered_map<std::string,table_t> tables;
+  std::mutex store_lock;
+  std::string secret;
+  std::uint64_t version;  // Of the last write, for ETags
+
+  // Called with store_lock held
+  web::http::status_code check (const table_t& table, const store_op_t& op) const;
+  void apply (table_t& table, const store_op_t& op);
+  void collect (const table_t& table, const scan_t& spec, const std::pair<std::string,std::string>* after,
+                std::vector<azure::storage::table_entity>& page) const;
+public:
+  explicit MemoryTableStore (const std::string& secret) :
+    tables {},
+    store_lock {},
+    secret {secret},
+    version {0}
+    {};
+
+  /*
+    Add the tables in the JSON file at path. It maps each table name
+    to an array of entities as ReadEntityAdmin returns them: objects
+    with "Partition" and "Row" members and one member per property.
+    Throws std::runtime_error if the file cannot be read or parsed.
+   */
+  void load (const std::string& path);
+
+  bool exists (const std::string& table) override;
+  bool create_table (const std::string& table) override;
+  bool delete_table (const std::string& table) override;
+
+  web::http::status_code retrieve (const std::string& table, const std::string& partition,
+                                   const std::string& row, azure::storage::table_entity& entity) override;
+  web::http::status_code write (const std::string& table, const store_op_t& op) override;
+  web::http::status_code write_batch (const std::string& table, const std::vector<store_op_t>& ops) override;
+  web::http::status_code scan (const std::string& table, const scan_t& spec, const entity_fn& on_entity) override;
+
+  std::pair<web::http::status_code,std::string>
+  get_token (const std::string& table, const std::string& partition, const std::string& row,
+             uint8_t permissions, const utility::datetime& expiry) override;
+  web::http::status_code retrieve_with_token (const std::string& table, const std::string& token,
+                                              const std::string& partition, const std::string& row,
+                                              azure::storage::table_entity& entity) override;
+  web::http::status_code write_with_token (const std::string& table, const std::string& token,
+                                           const store_op_t& op) override;
+};
+
+#endif
@@ -0,0 +1,483 @@
+#include "PushQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::size_t;
+using std::string;
+using std::uint32_t;
+using std::uint64_t;
+using std::int64_t;
+using std::vector;
+
+namespace {
+  const char segment_magic[4] {'P', 'S', 'Q', '2'};
+  constexpr size_t header_size {16};           // magic, unused, start
+  constexpr size_t start_at {8};               // generation << 32 | read offset
+  constexpr size_t record_header_size {24};    // generation, length, enqueued_ms, id
+
+  // Delay before a group whose delivery failed is tried again,
+  // doubled with each further failure up to max_retry_delay_ms
+  constexpr int64_t first_retry_delay_ms {1000};
+  constexpr int64_t max_retry_delay_ms {60000};
+
+  std::system_error os_error (const string& what) {
+    return std::system_error {errno, std::system_category(), what};
+  }
+
+  void put_string (string& out, const string& s) {
+    uint32_t len {static_cast<uint32_t>(s.size())};
+    out.append(reinterpret_cast<const char*>(&len), sizeof len);
+    out.append(s);
+  }
+
+  bool get_string (const char*& p, const char* end, string& s) {
+    uint32_t len;
+    if (end - p < static_cast<std::ptrdiff_t>(sizeof len))
+      return false;
+    std::memcpy(&len, p, sizeof len);
+    p += sizeof len;
+    if (static_cast<size_t>(end - p) < len)
+      return false;
+    s.assign(p, len);
+    p += len;
+    return true;
+  }
+
+  // Log generation and offset identify a record for as long as it is undelivered
+  uint64_t job_id (uint32_t generation, size_t offset) {
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint64_t>(offset);
+  }
+
+  int64_t now_ms () {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+}
+
+PushQueue::PushQueue (const string& path, size_t capacity) :
+  capacity {capacity},
+  fd {-1},
+  base {nullptr},
+  write_offset {header_size},
+  shift {0},
+  queue {},
+  running {},
+  retries {},
+  enqueued {0},
+  delivered {0},
+  replayed {0},
+  window {0},
+  lock {},
+  ready {},
+  stopping {false},
+  threads {}
+{
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    throw os_error("open " + path);
+
+  struct stat st;
+  if (::fstat(fd, &st) < 0)
+    throw os_error("stat " + path);
+  bool fresh {st.st_size == 0};
+  if (fresh) {
+    if (::ftruncate(fd, static_cast<off_t>(capacity)) < 0)
+      throw os_error("truncate " + path);
+  }
+  else {
+    // An existing segment keeps the size it was created with
+    this->capacity = static_cast<size_t>(st.st_size);
+  }
+  if (this->capacity < header_size + record_header_size)
+    throw std::invalid_argument {"push log segment is too small"};
+  // Offsets share the start word with the generation
+  if (this->capacity > std::numeric_limits<uint32_t>::max())
+    throw std::invalid_argument {"push log segment is too large"};
+
+  void* addr {::mmap(nullptr, this->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)};
+  if (addr == MAP_FAILED)
+    throw os_error("mmap " + path);
+  base = static_cast<char*>(addr);
+
+  if (fresh) {
+    std::memcpy(base, segment_magic, sizeof segment_magic);
+    set_start(1, header_size);
+  }
+  else if (std::memcmp(base, segment_magic, sizeof segment_magic) != 0) {
+    throw std::runtime_error {path + " is not a push log segment"};
+  }
+  if (read_offset() < header_size || read_offset() > this->capacity)
+    set_start(generation(), header_size);
+
+  // Find the end of the log: the first record from the read offset on
+  // that is not of the current generation
+  size_t pos {read_offset()};
+  while (pos + record_header_size <= this->capacity) {
+    uint32_t gen, len;
+    std::memcpy(&gen, base + pos, sizeof gen);
+    std::memcpy(&len, base + pos + 4, sizeof len);
+    if (gen != generation() || len > this->capacity - pos - record_header_size)
+      break;
+    pos += record_header_size + len;
+  }
+  write_offset = pos;
+  // Everything before the read offset is delivered. Clear it, in case a
+  // crash cut short move_to_front(), whose copies there are of the next
+  // generation and would otherwise be taken for its records.
+  std::memset(base + header_size, 0, read_offset() - header_size);
+}
+
+PushQueue::~PushQueue () {
+  stop();
+  if (base != nullptr) {
+    ::msync(base, capacity, MS_SYNC);
+    ::munmap(base, capacity);
+  }
+  if (fd >= 0)
+    ::close(fd);
+}
+
+uint32_t PushQueue::generation () {
+  return static_cast<uint32_t>(*reinterpret_cast<uint64_t*>(base + start_at) >> 32);
+}
+
+size_t PushQueue::read_offset () {
+  return static_cast<size_t>(*reinterpret_cast<uint64_t*>(base + start_at) & 0xffffffff);
+}
+
+/*
+  Set the generation and read offset together, with one aligned store,
+  so a crash leaves either both old values or both new ones
+ */
+void PushQueue::set_start (uint32_t generation, size_t read_offset) {
+  std::atomic_thread_fence(std::memory_order_release);
+  *reinterpret_cast<uint64_t*>(base + start_at) = (static_cast<uint64_t>(generation) << 32) | read_offset;
+}
+
+/*
+  Decode the records between the read offset and the end of the log
+ */
+vector<PushQueue::pending_t> PushQueue::undelivered () {
+  vector<pending_t> jobs {};
+  size_t pos {read_offset()};
+  while (pos < write_offset) {
+    uint32_t len;
+    push_job_t job {};
+    std::memcpy(&len, base + pos + 4, sizeof len);
+    std::memcpy(&job.enqueued_ms, base + pos + 8, sizeof job.enqueued_ms);
+    std::memcpy(&job.id, base + pos + 16, sizeof job.id);
+    const char* p {base + pos + record_header_size};
+    const char* end {p + len};
+    size_t next {pos + record_header_size + len};
+    if (get_string(p, end, job.country) && get_string(p, end, job.name) &&
+        get_string(p, end, job.status) && get_string(p, end, job.friends))
+      jobs.push_back(pending_t {pos + shift, next + shift, std::move(job)});
+    else
+      std::cerr << "PushQueue: skipping corrupt record at " << pos << std::endl;
+    pos = next;
+  }
+  return jobs;
+}
+
+size_t PushQueue::replay () {
+  std::lock_guard<std::mutex> guard {lock};
+  vector<pending_t> jobs {undelivered()};
+  // A corrupt record is skipped and never finishes, so it must not hold
+  // back the read offset: count from the first job actually queued
+  set_start(generation(), jobs.empty() ? write_offset : jobs.front().offset - shift);
+  for (auto& j : jobs)
+    queue.push_back(std::move(j));
+  replayed += jobs.size();
+  rewind_if_drained();
+  ready.notify_all();
+  return jobs.size();
+}
+
+size_t PushQueue::discard () {
+  std::lock_guard<std::mutex> guard {lock};
+  size_t dropped {undelivered().size()};
+  set_start(generation(), write_offset);
+  rewind_if_drained();
+  return dropped;
+}
+
+/*
+  Move the undelivered records to the front of the segment, making
+  room after them, and return whether they were moved.
+
+  They are copied under the next generation, which only counts once
+  set_start() names it along with the new read offset; a crash before
+  then leaves the log as it was. The copies must not overwrite the
+  records being copied, so this is only done once more of the segment
+  has been delivered than is waiting. Each record's id is copied with
+  it, and offsets held in memory are rebased by shift, so a job keeps
+  its id and offset however often it is moved.
+ */
+bool PushQueue::move_to_front () {
+  size_t from {read_offset()};
+  size_t live {write_offset - from};
+  // Room for the copies, and for end_log() after them, before from
+  if (from == header_size || live + sizeof(uint32_t) > from - header_size)
+    return false;
+  uint32_t next_generation {generation() + 1};
+  for (size_t pos {from}; pos < write_offset; ) {
+    uint32_t len;
+    std::memcpy(&len, base + pos + 4, sizeof len);
+    size_t size {record_header_size + len};
+    char* to {base + header_size + (pos - from)};
+    std::memcpy(to + 4, base + pos + 4, size - 4);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(to, &next_generation, sizeof next_generation);
+    pos += size;
+  }
+  end_log(header_size + live);
+  set_start(next_generation, header_size);
+  shift += from - header_size;
+  write_offset = header_size + live;
+  return true;
+}
+
+/*
+  Mark the log as ending at pos, by clearing the generation of
+  whatever old bytes follow, which need not be at a record boundary
+ */
+void PushQueue::end_log (size_t pos) {
+  if (pos + sizeof(uint32_t) <= capacity)
+    std::memset(base + pos, 0, sizeof(uint32_t));
+}
+
+// Once every job is delivered, start the log again from the front
+void PushQueue::rewind_if_drained () {
+  if ( ! queue.empty() || ! running.empty() || ! retries.empty() || read_offset() != write_offset)
+    return;
+  move_to_front();
+}
+
+bool PushQueue::enqueue (push_job_t& job) {
+  string payload {};
+  put_string(payload, job.country);
+  put_string(payload, job.name);
+  put_string(payload, job.status);
+  put_string(payload, job.friends);
+
+  std::lock_guard<std::mutex> guard {lock};
+  // Taken under the lock, so no job is accepted earlier than a
+  // watermark_ms() already returned
+  if (job.enqueued_ms == 0)
+    job.enqueued_ms = now_ms();
+  size_t size {record_header_size + payload.size()};
+  // Full: make room by moving the undelivered records to the front
+  if (write_offset + size > capacity && ( ! move_to_front() || write_offset + size > capacity))
+    return false;
+
+  size_t offset {write_offset};
+  char* rec {base + offset};
+  uint32_t gen {generation()};
+  job.id = job_id(gen, offset);
+  uint32_t len {static_cast<uint32_t>(payload.size())};
+  end_log(offset + size);
+  std::memcpy(rec + record_header_size, payload.data(), payload.size());
+  std::memcpy(rec + 4, &len, sizeof len);
+  std::memcpy(rec + 8, &job.enqueued_ms, sizeof job.enqueued_ms);
+  std::memcpy(rec + 16, &job.id, sizeof job.id);
+  // The generation marks the record complete, so it is written last
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(rec, &gen, sizeof gen);
+
+  write_offset = offset + size;
+  queue.push_back(pending_t {offset + shift, write_offset + shift, job});
+  ++enqueued;
+  ready.notify_one();
+  return true;
+}
+
+/*
+  Mark the jobs at offsets delivered and advance the read offset to the
+  first job not yet delivered. Every such job is running, waiting to be
+  retried, or queued; running and queued jobs are kept in log order.
+ */
+void PushQueue::finish (const vector<size_t>& offsets) {
+  std::lock_guard<std::mutex> guard {lock};
+  for (auto offset : offsets)
+    running.erase(offset);
+  delivered += offsets.size();
+  size_t first {write_offset + shift};
+  if ( ! running.empty())
+    first = std::min(first, running.begin()->first);
+  if ( ! queue.empty())
+    first = std::min(first, queue.front().offset);
+  for (const auto& r : retries)
+    first = std::min(first, r.second.jobs.front().offset);
+  set_start(generation(), first - shift);
+  rewind_if_drained();
+}
+
+/*
+  Put back a group whose delivery failed, to be delivered again, as
+  the same group, once its delay has passed. Its jobs stay in the log
+  meanwhile.
+ */
+void PushQueue::retry (group_t group) {
+  std::lock_guard<std::mutex> guard {lock};
+  for (const auto& p : group.jobs)
+    running.erase(p.offset);
+  ++group.failures;
+  int64_t delay {first_retry_delay_ms};
+  for (int i {1}; i < group.failures && delay < max_retry_delay_ms; ++i)
+    delay *= 2;
+  delay = std::min(delay, max_retry_delay_ms);
+  retries.emplace(now_ms() + delay, std::move(group));
+  ready.notify_one();
+}
+
+/*
+  Take the next group due for delivery: a failed group whose delay has
+  passed, or else the oldest queued job, once it has been queued for
+  the coalescing window, with every other queued job from the same
+  author. Returns an empty group once stopping.
+ */
+PushQueue::group_t PushQueue::next_group () {
+  std::unique_lock<std::mutex> guard {lock};
+  for (;;) {
+    if (stopping)
+      return group_t {vector<pending_t> {}, 0};
+    if (queue.empty() && retries.empty()) {
+      ready.wait(guard);
+      continue;
+    }
+    int64_t now {now_ms()};
+    if ( ! retries.empty() && retries.begin()->first <= now) {
+      group_t group {std::move(retries.begin()->second)};
+      retries.erase(retries.begin());
+      for (const auto& p : group.jobs)
+        running[p.offset] = running_t {p.end, p.job.enqueued_ms};
+      return group;
+    }
+    int64_t due {retries.empty() ? std::numeric_limits<int64_t>::max() : retries.begin()->first};
+    if ( ! queue.empty()) {
+      int64_t queued_due {queue.front().job.enqueued_ms + window.count()};
+      if (queued_due <= now)
+        break;
+      due = std::min(due, queued_due);
+    }
+    ready.wait_until(guard, std::chrono::system_clock::time_point {std::chrono::milliseconds {due}});
+  }
+
+  group_t group {vector<pending_t> {}, 0};
+  group.jobs.push_back(std::move(queue.front()));
+  queue.pop_front();
+  const string country {group.jobs.front().job.country};
+  const string name {group.jobs.front().job.name};
+  for (auto it = queue.begin(); it != queue.end(); ) {
+    if (it->job.country == country && it->job.name == name) {
+      group.jobs.push_back(std::move(*it));
+      it = queue.erase(it);
+    }
+    else
+      ++it;
+  }
+  for (const auto& p : group.jobs)
+    running[p.offset] = running_t {p.end, p.job.enqueued_ms};
+  return group;
+}
+
+void PushQueue::work (deliver_t deliver) {
+  for (;;) {
+    group_t group {next_group()};
+    if (group.jobs.empty())
+      return;
+    vector<push_job_t> jobs {};
+    vector<size_t> offsets {};
+    for (const auto& p : group.jobs) {
+      offsets.push_back(p.offset);
+      jobs.push_back(p.job);
+    }
+    bool delivered {false};
+    try {
+      delivered = deliver(jobs);
+    }
+    catch (const std::exception& e) {
+      std::cerr << "PushQueue: delivery from " << jobs.front().country << "/" << jobs.front().name
+                << " failed: " << e.what() << std::endl;
+    }
+    if (delivered)
+      finish(offsets);
+    else
+      retry(std::move(group));
+  }
+}
+
+void PushQueue::start (size_t workers, deliver_t deliver, std::chrono::milliseconds coalesce_window) {
+  std::lock_guard<std::mutex> guard {lock};
+  stopping = false;
+  window = coalesce_window;
+  for (size_t i {0}; i < workers; ++i)
+    threads.push_back(std::thread {[this, deliver] { work(deliver); }});
+}
+
+void PushQueue::stop () {
+  {
+    std::lock_guard<std::mutex> guard {lock};
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto& t : threads)
+    t.join();
+  threads.clear();
+}
+
+// When the oldest undelivered job was accepted, or 0 if there is none; lock is held
+int64_t PushQueue::oldest_undelivered_ms () {
+  int64_t oldest {0};
+  for (const auto& r : running) {
+    if (oldest == 0 || r.second.enqueued_ms < oldest)
+      oldest = r.second.enqueued_ms;
+  }
+  if ( ! queue.empty() && (oldest == 0 || queue.front().job.enqueued_ms < oldest))
+    oldest = queue.front().job.enqueued_ms;
+  for (const auto& r : retries) {
+    if (oldest == 0 || r.second.jobs.front().job.enqueued_ms < oldest)
+      oldest = r.second.jobs.front().job.enqueued_ms;
+  }
+  return oldest;
+}
+
+int64_t PushQueue::watermark_ms () {
+  std::lock_guard<std::mutex> guard {lock};
+  int64_t oldest {oldest_undelivered_ms()};
+  return oldest == 0 ? now_ms() : oldest;
+}
+
+push_queue_stats_t PushQueue::stats () {
+  std::lock_guard<std::mutex> guard {lock};
+  int64_t oldest {oldest_undelivered_ms()};
+  size_t retrying {0};
+  for (const auto& r : retries)
+    retrying += r.second.jobs.size();
+  return push_queue_stats_t {
+    queue.size() + running.size() + retrying,
+    running.size(),
+    retrying,
+    oldest == 0 ? 0 : now_ms() - oldest,
+    enqueued,
+    delivered,
+    replayed,
+    write_offset,
+    capacity
+  };
+}
@@ -0,0 +1,180 @@
+#ifndef PushQueue_h
+#define PushQueue_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+  One accepted PushStatus, waiting to be delivered to the friends
+ */
+struct push_job_t {
+  std::string country;
+  std::string name;
+  std::string status;
+  std::string friends;
+  std::int64_t enqueued_ms; // Milliseconds since the epoch when accepted
+  std::uint64_t id;         // Set by the queue; the same if the job is replayed
+  std::string traceparent;  // Of the PushStatus request (see Trace.h); not logged, so empty if replayed
+};
+
+/*
+  Queue depth and delivery lag, as reported by the metrics endpoint
+ */
+struct push_queue_stats_t {
+  std::size_t depth;        // Jobs accepted but not yet delivered
+  std::size_t in_flight;    // Jobs being delivered now
+  std::size_t retrying;     // Jobs waiting to be delivered again after a failure
+  std::int64_t lag_ms;      // Age of the oldest undelivered job
+  std::uint64_t enqueued;   // Jobs accepted since startup
+  std::uint64_t delivered;  // Jobs delivered since startup
+  std::uint64_t replayed;   // Jobs recovered from the log at startup
+  std::size_t log_bytes;    // Bytes of the log segment in use
+  std::size_t log_capacity;
+};
+
+/*
+  Durable queue of PushStatus jobs backed by a write-ahead log
+
+  Each job is appended to a fixed-size segment file that is mapped
+  into memory, so a job survives a crash of the server as soon as
+  enqueue() returns. Worker threads take jobs off the queue and hand
+  them to the delivery function. The log's read offset only advances
+  past a job once it, and every job before it, has been delivered.
+  Jobs whose delivery failed are delivered again, as the same group,
+  after a delay that doubles with each failure.
+
+  Segment layout: a header holding the generation and read offset,
+  followed by records of
+    { uint32 generation, uint32 length, int64 enqueued_ms, uint64 id, payload }
+  The generation is stored last, and a record only counts if its
+  generation matches the header's. Once every job is delivered the
+  segment is rewound by bumping the generation, which invalidates all
+  old records without rewriting them. When the segment fills before
+  that, the undelivered records are moved to the front under the next
+  generation, provided more of the segment has been delivered than
+  still waits.
+ */
+class PushQueue {
+public:
+  /*
+    Delivers one or more jobs, all from the same author, oldest first.
+    Returns false, or throws, if any of the jobs may not have reached
+    every recipient; the jobs are then delivered again later, so
+    delivering them must be idempotent.
+   */
+  using deliver_t = std::function<bool(const std::vector<push_job_t>&)>;
+
+  /*
+    path: segment file, created if it does not exist
+    capacity: size of the segment file in bytes
+   */
+  PushQueue (const std::string& path, std::size_t capacity);
+  ~PushQueue ();
+
+  PushQueue (const PushQueue&) = delete;
+  PushQueue& operator= (const PushQueue&) = delete;
+
+  /*
+    Queue the jobs that the log holds but that were never delivered,
+    so they are sent once the workers start. Returns the number of jobs.
+   */
+  std::size_t replay ();
+
+  // Drop the undelivered jobs in the log instead of replaying them
+  std::size_t discard ();
+
+  /*
+    Start worker threads that call deliver for the queued jobs.
+    A job waits coalesce_window after it was accepted, and is then
+    delivered together with every later job queued by the same author.
+   */
+  void start (std::size_t workers, deliver_t deliver,
+              std::chrono::milliseconds coalesce_window = std::chrono::milliseconds {0});
+
+  // Stop the workers; undelivered jobs stay in the log
+  void stop ();
+
+  /*
+    Append a job to the log and queue it for delivery, setting its
+    enqueued_ms (unless already set) and id.
+    Returns false if the segment is full even once the delivered
+    records are dropped from it.
+   */
+  bool enqueue (push_job_t& job);
+
+  push_queue_stats_t stats ();
+
+  /*
+    A time (ms since the epoch) such that every job accepted before it
+    has been delivered: when the oldest undelivered job was accepted,
+    or now if every job has been. Jobs accepted later are stamped no
+    earlier, as long as the system clock does not step back.
+   */
+  std::int64_t watermark_ms ();
+
+private:
+  struct pending_t {
+    std::size_t offset;
+    std::size_t end;
+    push_job_t job;
+  };
+
+  struct running_t {
+    std::size_t end;
+    std::int64_t enqueued_ms;
+  };
+
+  // Jobs delivered together, and how many times that has failed
+  struct group_t {
+    std::vector<pending_t> jobs;
+    int failures;
+  };
+
+  std::size_t capacity;
+  int fd;
+  char* base;
+
+  std::size_t write_offset;
+  // How far the log has been moved towards the front since it was
+  // opened. Offsets held in memory are segment offsets plus shift, so
+  // they do not change when the log moves.
+  std::size_t shift;
+  std::deque<pending_t> queue;
+  // Jobs handed to a worker, by log offset
+  std::map<std::size_t,running_t> running;
+  // Groups whose delivery failed, by when they are due again (ms since the epoch)
+  std::multimap<std::int64_t,group_t> retries;
+  std::uint64_t enqueued;
+  std::uint64_t delivered;
+  std::uint64_t replayed;
+  std::chrono::milliseconds window;
+
+  std::mutex lock;
+  std::condition_variable ready;
+  bool stopping;
+  std::vector<std::thread> threads;
+
+  std::uint32_t generation ();
+  std::size_t read_offset ();
+  void set_start (std::uint32_t generation, std::size_t read_offset);
+  std::vector<pending_t> undelivered ();
+  std::int64_t oldest_undelivered_ms ();
+  bool move_to_front ();
+  void end_log (std::size_t pos);
+  void rewind_if_drained ();
+  void finish (const std::vector<std::size_t>& offsets);
+  void retry (group_t group);
+  group_t next_group ();
+  void work (deliver_t deliver);
+};
+
+#endif
@@ -1,7 +1,17 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <exception>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -22,7 +32,11 @@
 #include "make_unique.h"
 
 
+#include "ChannelHub.h"
 #include "ClientUtils.h"
+#include "DedupTable.h"
+#include "PushQueue.h"
+#include "Trace.h"
 
 using azure::storage::storage_exception;
 using azure::storage::cloud_table;
@@ -42,10 +56,18 @@ using std::cout;
 using std::endl;
 using std::getline;
 using std::make_pair;
+using std::map;
 using std::pair;
 using std::string;
 using std::unordered_map;
+using std::size_t;
 using std::vector;
+using std::int64_t;
+using std::uint64_t;
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 
 using web::http::http_headers;
 using web::http::http_request;
@@ -78,6 +100,49 @@ const string data_table_name {"DataTable"};
 const string push_status {"PushStatus"};
 const string read_entity_admin {"ReadEntityAdmin"};
 const string update_entity_admin {"UpdateEntityAdmin"};
+const string insert_entity_batch_admin {"InsertEntityBatchAdmin"};
+const string create_table_admin {"CreateTableAdmin"};
+const string delete_entities_before_admin {"DeleteEntitiesBeforeAdmin"};
+
+const string push_metrics {"PushMetrics"};
+const string subscribe {"Subscribe"};
+const string watermark {"Watermark"};
+
+// Most BasicServer requests one PushStatus keeps in flight at once.
+// Set by the first command-line argument.
+size_t push_max_in_flight {16};
+
+// Most friends updated by one batch request; Azure's batch limit
+constexpr size_t push_batch_size {100};
+
+// Authors with more friends than this have their statuses read from
+// their outbox instead of pushed to every friend.
+// Set by the fifth command-line argument.
+size_t push_degree_threshold {1000};
+
+// Defaults for the push queue; see main()
+constexpr size_t push_workers {4};
+constexpr milliseconds push_coalesce_window {1000};
+const string push_log_file {"pushqueue.log"};
+constexpr size_t push_log_capacity {64 * 1024 * 1024};
+
+std::unique_ptr<PushQueue> push_queue {};
+
+// PushStatus requests enqueued recently, by idempotency key, so a
+// retried request does not deliver the status twice
+DedupTable push_dedup {100000, std::chrono::seconds {600}};
+
+// Channels of the users holding a Subscribe long poll, and how long a poll may wait
+ChannelHub channel_hub {};
+constexpr milliseconds default_poll_timeout {25000};
+constexpr milliseconds max_poll_timeout {60000};
+
+// Timeline entries older than this are deleted, once an hour
+const std::chrono::hours timeline_retention {24 * 30};
+const std::chrono::hours timeline_compaction_interval {1};
+std::mutex compaction_lock {};
+std::condition_variable compaction_stop {};
+bool stop_compaction {false};
 
 /*
   Cache of opened tables
@@ -110,44 +175,6 @@ value build_json_object (const vector<pair<string,string>>& properties) {
     return result;
 }
 
-/*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
- */
-unordered_map<string,string> get_json_body(http_request message) {
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
-      }
-      else {
-        results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
-}
-
 /*
   Return a token for 24 hours of access to the specified table,
   for the single entity defind by the partition and row.
@@ -192,7 +219,231 @@ unordered_map<string,string> get_json_body(http_request message) {
 //   }
 // }
 
+/*
+  Return a timeline entry holding the statuses of the given jobs,
+  oldest first, one per line. The entry's time key is that of the
+  oldest job; it depends only on the jobs, so a replayed delivery
+  rewrites the same entries.
+ */
+value coalesced_entry (const vector<push_job_t>& jobs, const vector<size_t>& which) {
+  const push_job_t& first {jobs[which.front()]};
+  string statuses {};
+  for (auto i : which) {
+    if ( ! statuses.empty())
+      statuses += "\n";
+    statuses += jobs[i].status;
+  }
+  return build_json_object (vector<pair<string,string>> {
+      make_pair("Status", statuses),
+      make_pair("Author", first.country + pair_delimiter + first.name),
+      make_pair("Time", timeline_key(first.enqueued_ms, first.id)),
+      make_pair("Count", std::to_string(which.size()))});
+}
+
+/*
+  Send the PushStatus one author made within the coalescing window
+  to every friend, push_max_in_flight BasicServer requests at a time.
+  Each friend gets one entry holding every status that was sent to
+  them. Runs on a PushQueue worker, in the trace of the newest job.
+
+  Returns false if any write failed, for the queue to deliver the jobs
+  again later. The entries' keys depend only on the jobs, so writing
+  them again replaces the ones already written. Subscribers were sent
+  each status when it was accepted (see handle_post), so nothing is
+  published here.
+ */
+bool deliver_push (const vector<push_job_t>& jobs) {
+  steady_clock::time_point start {steady_clock::now()};
+  const push_job_t& author {jobs.back()};
+  TraceSpan trace_span {"deliver_push", "push", parse_traceparent(author.traceparent)};
+
+  //for each friend, by country, the jobs sent to them
+  map<string,map<string,vector<size_t>>> by_country {};
+  size_t degree {0};
+  for(size_t i {0}; i < jobs.size(); ++i){
+    friends_list_t parsed_friends_list {};
+    try {
+      parsed_friends_list = parse_friends_list(jobs[i].friends);
+    }
+    catch (const std::invalid_argument& e) {
+      cout << "PushStatus from " << jobs[i].country << "/" << jobs[i].name << ": " << e.what() << endl;
+    }
+    degree = parsed_friends_list.size();
+    for(const auto v : parsed_friends_list){//v.first == country v.second == name
+      vector<size_t>& sent = by_country[v.first][v.second];
+      if(sent.empty() || sent.back() != i)
+        sent.push_back(i);
+    }
+  }
+
+  //too many friends to write to: store the statuses once, in the author's
+  //outbox, and list the author as one whose outbox readers merge in
+  if(degree > push_degree_threshold){
+    vector<size_t> all (jobs.size());
+    for(size_t i {0}; i < jobs.size(); ++i)
+      all[i] = i;
+    vector<request_spec_t> writes {
+      request_spec_t {methods::PUT,
+          basic_url + update_entity_admin + "/" + outbox_table_name + "/" + jobs.front().country + "/" +
+          timeline_row(jobs.front().name, timeline_key(jobs.front().enqueued_ms, jobs.front().id)),
+          coalesced_entry(jobs, all),
+          header_vals_t {{idempotency_key_header, new_idempotency_key()}}},
+      request_spec_t {methods::PUT,
+          basic_url + update_entity_admin + "/" + high_degree_table_name + "/" + high_degree_partition + "/" +
+          author.country + pair_delimiter + author.name,
+          build_json_object (vector<pair<string,string>> {
+              make_pair("Degree", std::to_string(degree))}),
+          header_vals_t {{idempotency_key_header, new_idempotency_key()}}}};
+    vector<req_res_t> write_results {do_requests (writes, push_max_in_flight)};
+    bool written {write_results[0].first == status_codes::OK && write_results[1].first == status_codes::OK};
+    auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start);
+    cout << jobs.size() << " PushStatus from " << author.country << "/" << author.name << " with "
+         << degree << " friends to outbox (" << write_results[0].first << ") in "
+         << elapsed.count() << " ms" << endl;
+    return written;
+  }
+
+  //add an entry to every friend's timeline, one batch per partition (the
+  //friend's country) of up to push_batch_size friends
+  size_t recipients {0};
+  vector<request_spec_t> writes {};
+  vector<size_t> write_sizes {};
+  for(const auto& c : by_country){
+    recipients += c.second.size();
+    auto f = c.second.begin();
+    while(f != c.second.end()){
+      value rows {value::object ()};
+      size_t n {0};
+      for(; f != c.second.end() && n < push_batch_size; ++f, ++n){
+        const push_job_t& first {jobs[f->second.front()]};
+        rows[timeline_row(f->first, timeline_key(first.enqueued_ms, first.id))] = coalesced_entry(jobs, f->second);
+      }
+      //the key lets BasicServer answer a retried write without doing it again
+      writes.push_back(request_spec_t {methods::PUT,
+            basic_url + insert_entity_batch_admin + "/" + timeline_table_name + "/" + c.first,
+            rows, header_vals_t {{idempotency_key_header, new_idempotency_key()}}});
+      write_sizes.push_back(n);
+    }
+  }
+  vector<req_res_t> write_results {do_requests (writes, push_max_in_flight)};
+
+  size_t failed {0};
+  for(size_t i {0}; i < write_results.size(); ++i){
+    if(write_results[i].first != status_codes::OK)
+      failed += write_sizes[i];
+  }
+  auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start);
+  cout << jobs.size() << " PushStatus from " << author.country << "/" << author.name << " to "
+       << recipients << " friends in " << writes.size() << " batches ("
+       << failed << " failed) in "
+       << elapsed.count() << " ms" << endl;
+  return failed == 0;
+}
+
+/*
+  Every timeline_compaction_interval, delete the timeline and outbox
+  entries older than timeline_retention, until stop_compaction is set.
+ */
+void compact_timelines () {
+  std::unique_lock<std::mutex> guard {compaction_lock};
+  while ( ! compaction_stop.wait_for(guard, timeline_compaction_interval, [] { return stop_compaction; })) {
+    guard.unlock();
+    std::int64_t cutoff_ms {duration_cast<milliseconds>(std::chrono::system_clock::now().time_since_epoch()
+                                                        - timeline_retention).count()};
+    for (const string& table : {timeline_table_name, outbox_table_name}) {
+      pair<status_code,value> result {
+        do_request(methods::DEL, basic_url + delete_entities_before_admin + "/" + table +
+                   "/Time/" + timeline_key(cutoff_ms, 0))};
+      cout << "PushServer: compacted " << table << " before " << cutoff_ms << ": " << result.first << endl;
+    }
+    guard.lock();
+  }
+}
+
+/*
+  Top-level routine for processing all HTTP GET requests.
+
+  GET PushMetrics returns the depth and lag of the push queue
+
+  GET Watermark returns {"Watermark": <key>}: every timeline and outbox
+  entry with a key below it has been written, and none will be later.
+  Read it before reading the entries, and a cursor up to it misses none.
+
+  GET Subscribe/<country>/<name>[?after=<seq>&timeout=<ms>] is a long
+  poll of that user's channel. It returns {"Events": [...], "Next": <seq>}
+  as soon as there are entries after seq, or with no events once the
+  timeout passes. Pass Next as after in the following poll.
+ */
+void handle_get(http_request message) {
+  TraceSpan trace_span {message};
+  string path {uri::decode(message.relative_uri().path())};
+  cout << endl << "**** GET " << path << endl;
+  auto paths = uri::split_path(path);
+
+  if (paths.size() == 3 && paths[0] == subscribe) {
+    auto query_params = uri::split_query(message.relative_uri().query());
+    uint64_t after {0};
+    auto after_param (query_params.find("after"));
+    if (after_param != query_params.end())
+      after = std::strtoull(uri::decode(after_param->second).c_str(), nullptr, 10);
+    milliseconds timeout {default_poll_timeout};
+    auto timeout_param (query_params.find("timeout"));
+    if (timeout_param != query_params.end())
+      timeout = milliseconds {std::strtol(uri::decode(timeout_param->second).c_str(), nullptr, 10)};
+    timeout = std::min(std::max(timeout, milliseconds {0}), max_poll_timeout);
+
+    // Replied to when the poll completes, without holding this thread
+    channel_hub.poll(paths[1] + pair_delimiter + paths[2], after, timeout)
+      .then([message] (poll_result_t result)
+            {
+              value reply {value::object ()};
+              reply["Events"] = value::array(result.events);
+              reply["Next"] = value::number(result.next);
+              message.reply(status_codes::OK, reply);
+            });
+    return;
+  }
+
+  if (paths.size() == 1 && paths[0] == watermark) {
+    message.reply(status_codes::OK, build_json_object (vector<pair<string,string>> {
+          make_pair("Watermark", timeline_key(push_queue->watermark_ms(), 0))}));
+    return;
+  }
+
+  if (paths.size() != 1 || paths[0] != push_metrics) {
+    message.reply(status_codes::BadRequest);
+    return;
+  }
+
+  push_queue_stats_t stats {push_queue->stats()};
+  value result {value::object ()};
+  result["QueueDepth"] = value::number(static_cast<uint64_t>(stats.depth));
+  result["InFlight"] = value::number(static_cast<uint64_t>(stats.in_flight));
+  result["Retrying"] = value::number(static_cast<uint64_t>(stats.retrying));
+  result["LagMs"] = value::number(static_cast<int64_t>(stats.lag_ms));
+  result["Enqueued"] = value::number(static_cast<uint64_t>(stats.enqueued));
+  result["Delivered"] = value::number(static_cast<uint64_t>(stats.delivered));
+  result["Replayed"] = value::number(static_cast<uint64_t>(stats.replayed));
+  result["LogBytes"] = value::number(static_cast<uint64_t>(stats.log_bytes));
+  result["LogCapacity"] = value::number(static_cast<uint64_t>(stats.log_capacity));
+  result["Subscribers"] = value::number(static_cast<uint64_t>(channel_hub.waiting()));
+  message.reply(status_codes::OK, result);
+}
+
+/*
+  Top-level routine for processing all HTTP POST requests.
+
+  PushStatus is logged to the push queue, acknowledged, and published
+  to the channels of the friends subscribed at once; the queue's
+  workers store it in the friends' timelines afterwards.
+ */
 void handle_post(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
+  if (reply_if_repeated(message, push_dedup))
+    return;
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** POST " << path << endl;
   auto paths = uri::split_path(path);
@@ -203,9 +454,6 @@ void handle_post(http_request message) {
   }
 
   if(paths[0] == push_status){
-    string user_country {paths[1]};
-    string user_name {paths[2]};
-    string status {paths[3]};
     string friends_list {""};
 
     unordered_map<string,string> json_body {get_json_body (message)};
@@ -213,24 +461,26 @@ void handle_post(http_request message) {
       friends_list = v.second;
     }
 
-
-    friends_list_t parsed_friends_list = parse_friends_list(friends_list);
-    for(const auto v : parsed_friends_list){//v.first == country v.second == name
-      //get old updates
-      pair<status_code,value> result { do_request (methods::GET,
-                    basic_url + read_entity_admin + "/" + data_table_name + "/" + v.second + "/" + v.first)};
-      //get property value of Updates
-      string old_updates = get_json_object_prop( result.second, "Updates");
-      string new_updates {old_updates + status + "\n"};//Concatenate new updates to old updates
-      //build json object to pass to do_request
-      value new_updates_object {build_json_object (vector<pair<string,string>> {make_pair("Updates", new_updates)})};
-      //do_request to update entity to DataTable
-      pair<status_code,value> result2 { do_request (methods::PUT,
-                  basic_url + update_entity_admin + "/" + data_table_name + "/" + v.second + "/" + v.first,
-                  value::object (vector<pair<string,value>>
-                                 {make_pair("Updates", value::string(status))}))};
+    push_job_t job {paths[1], paths[2], paths[3], friends_list, 0, 0, traceparent(current_trace())};
+    if ( ! push_queue->enqueue(job)) {
+      cout << "PushStatus from " << paths[1] << "/" << paths[2] << " refused: push log full" << endl;
+      message.reply(status_codes::ServiceUnavailable);
+      return;
     }
     message.reply(status_codes::OK);
+
+    //friends waiting on a channel get the status now, rather than once
+    //the coalescing window has passed and it is stored
+    friends_list_t friends {};
+    try {
+      friends = parse_friends_list(friends_list);
+    }
+    catch (const std::invalid_argument&) {
+      return;
+    }
+    value entry {coalesced_entry(vector<push_job_t> {job}, vector<size_t> {0})};
+    for(const auto& f : friends)
+      channel_hub.publish(f.first + pair_delimiter + f.second, entry);
     return;
   }else{
     message.reply(status_codes::BadRequest);
@@ -240,12 +490,61 @@ void handle_post(http_request message) {
 
 }
 
+/*
+  Main push server routine
+
+  Usage: pushserver [max_in_flight [workers [log_file [replay|discard [degree_threshold [coalesce_ms]]]]]]
+
+  max_in_flight bounds the BasicServer batch requests each PushStatus
+  has outstanding at once (default 16).
+  workers is the number of PushStatus delivered at once (default 4).
+  log_file is the push queue's segment (default pushqueue.log).
+  On startup, PushStatus left undelivered in the log are replayed,
+  or dropped if "discard" is given.
+  degree_threshold is the most friends an author may have and still
+  have statuses pushed to each friend (default 1000).
+  coalesce_ms is how long a PushStatus waits for more from the same
+  author, so they are written to each friend together (default 1000).
+  If TRACE_FILE is set, spans are written to it (see Trace.h).
+ */
 int main (int argc, char const * argv[]) {
+  start_tracing("PushServer");
+  if (argc > 1)
+    push_max_in_flight = std::strtoul(argv[1], nullptr, 10);
+  size_t workers {push_workers};
+  if (argc > 2)
+    workers = std::strtoul(argv[2], nullptr, 10);
+  string log_file {push_log_file};
+  if (argc > 3)
+    log_file = argv[3];
+  bool replay {argc <= 4 || string {argv[4]} != "discard"};
+  if (argc > 5)
+    push_degree_threshold = std::strtoul(argv[5], nullptr, 10);
+  milliseconds coalesce_window {push_coalesce_window};
+  if (argc > 6)
+    coalesce_window = milliseconds {std::strtol(argv[6], nullptr, 10)};
+  cout << "PushServer: fan-out limited to " << push_max_in_flight << " requests in flight" << endl;
+  cout << "PushServer: authors with over " << push_degree_threshold << " friends use their outbox" << endl;
+
+  cout << "PushServer: Opening push log " << log_file << endl;
+  push_queue = std::make_unique<PushQueue>(log_file, push_log_capacity);
+  if (replay)
+    cout << "PushServer: Replaying " << push_queue->replay() << " undelivered PushStatus" << endl;
+  else
+    cout << "PushServer: Discarded " << push_queue->discard() << " undelivered PushStatus" << endl;
+  for (const string& table : {timeline_table_name, outbox_table_name, high_degree_table_name}) {
+    pair<status_code,value> created {do_request(methods::POST, basic_url + create_table_admin + "/" + table)};
+    if (created.first != status_codes::Created && created.first != status_codes::Accepted)
+      cout << "PushServer: could not create " << table << ": " << created.first << endl;
+  }
+  push_queue->start(workers, &deliver_push, coalesce_window);
+  std::thread compactor {compact_timelines};
+
   cout << "PushServer: Parsing connection string" << endl;
 
   cout << "PushServer: Opening listener" << endl;
   http_listener listener {def_url};
-  //listener.support(methods::GET, &handle_get);
+  listener.support(methods::GET, &handle_get);
   listener.support(methods::POST, &handle_post);
   //listener.support(methods::PUT, &handle_put);
   //listener.support(methods::DEL, &handle_delete);
@@ -257,5 +556,13 @@ int main (int argc, char const * argv[]) {
 
   // Shut it down
   listener.close().wait();
+  // Anything not yet delivered stays in the log for the next start
+  push_queue->stop();
+  {
+    std::lock_guard<std::mutex> guard {compaction_lock};
+    stop_compaction = true;
+  }
+  compaction_stop.notify_all();
+  compactor.join();
   cout << "PushServer closed" << endl;
 }
@@ -12,14 +12,9 @@
 
 #include <was/table.h>
 
-using azure::storage::cloud_table;
-using azure::storage::cloud_table_client;
+using azure::storage::edm_type;
 using azure::storage::entity_property;
-using azure::storage::storage_credentials;
-using azure::storage::storage_exception;
 using azure::storage::table_entity;
-using azure::storage::table_operation;
-using azure::storage::table_result;
 
 using std::cout;
 using std::endl;
@@ -34,6 +29,39 @@ using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
+using web::json::value;
+
+/*
+  Convert properties represented in Azure Storage type
+  to prop_vals_t type, appended to values.
+ */
+prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values) {
+  for (const auto& v : properties) {
+    if (v.second.property_type() == edm_type::string) {
+      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
+    }
+    else if (v.second.property_type() == edm_type::datetime) {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+    else if(v.second.property_type() == edm_type::int32) {
+      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));
+    }
+    else if(v.second.property_type() == edm_type::int64) {
+      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));
+    }
+    else if(v.second.property_type() == edm_type::double_floating_point) {
+      values.push_back(make_pair(v.first, value::number(v.second.double_value())));
+    }
+    else if(v.second.property_type() == edm_type::boolean) {
+      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));
+    }
+    else {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+  }
+  return values;
+}
+
 /*
   Read from a table using a security token
 
@@ -41,19 +69,19 @@ using web::http::uri;
     URI, as the token may have '/' characters encoded via %2F. After the
     undecoded path is split, the resulting parameters are decoded
     individually.
-  endpoint is the URI endpoint for Azure tables. It takes the form
-    "http://STORAGE.table.core.windows.net/", where STORAGE is
-    replaced by the user's Azure Storage account name.
+  store is where the table is kept; it checks the token.
 
   Returns a pair:
     first: HTTP status code from the read
-    second: if the status code is OK, the entity read from the table
+    second: if the status code is OK, the entity read from the table.
+      Its etag() is the entity's current ETag, which the caller can
+      hand back to update_with_token() to make a conditional write.
  */
 pair<status_code,table_entity> read_with_token (const http_request& message,
-                                                 const string& endpoint) {
+                                                 TableStore& store) {
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
-    *before* decoding and pass the undecoded values to Azure Storage
+    *before* decoding and pass the undecoded values to the store
    */
   const string undecoded_path {message.relative_uri().path()};
   const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
@@ -66,34 +94,15 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
   const string partition {undecoded_paths[3]};
   const string row {undecoded_paths[4]};
 
-  try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
-
-    table_operation op {table_operation::retrieve_entity(partition, row)};
-    cloud_table table_cred {client.get_table_reference(tname)};
-    table_result retrieve_result {table_cred.execute(op)};
-    if (retrieve_result.http_status_code() == status_codes::NotFound) {
+  table_entity entity {};
+  status_code status {store.retrieve_with_token(tname, token, partition, row, entity)};
+  if (status != status_codes::OK) {
+    if (status == status_codes::NotFound)
       cout << "Not found" << endl;
-      return make_pair (status_codes::NotFound,
-                         table_entity{});
-    }
-
-    table_entity entity {retrieve_result.entity()};
-    return make_pair (status_codes::OK,
-                       entity);
-  }
-  catch (const storage_exception& e) {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return make_pair (status_codes::Forbidden,
-                         table_entity{});
-    else
-      return make_pair (status_codes::InternalError,
-                         table_entity{});
+    return make_pair (status, table_entity{});
   }
+  return make_pair (status_codes::OK,
+                     entity);
 }
 
 /*
@@ -103,21 +112,25 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
     URI, as the token may have '/' characters encoded via %2F. After the
     undecoded path is split, the resulting parameters are decoded
     individually.
-  endpoint is the URI endpoint for Azure tables. It takes the form
-    "http://STORAGE.table.core.windows.net/", where STORAGE is
-    replaced by the user's Azure Storage account name.
+  store is where the table is kept; it checks the token.
   props is an unordered_map of properties to be merged into
     the entity. This will typically be the result of get_json_body().
+  if_match is the ETag the caller last read for the entity. If it is
+    empty the merge is unconditional; otherwise the merge only succeeds
+    if the entity has not been modified since that read.
 
-  Returns:  HTTP status code from the write.
+  Returns:  HTTP status code from the write. PreconditionFailed (412)
+    means if_match no longer matches the stored entity; the caller
+    should read the entity again and retry.
  */
 status_code update_with_token (const http_request& message,
-                               const string& endpoint,
-                               const unordered_map<string,string>& props) {
+                               TableStore& store,
+                               const unordered_map<string,string>& props,
+                               const string& if_match) {
   
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
-    *before* decoding and pass the undecoded values to Azure Storage
+    *before* decoding and pass the undecoded values to the store
    */
   const string undecoded_path {message.relative_uri().path()};
   const vector<string> undecoded_paths {uri::split_path(undecoded_path)};
@@ -130,32 +143,13 @@ status_code update_with_token (const http_request& message,
   const string partition {undecoded_paths[3]};
   const string row {undecoded_paths[4]};
   table_entity entity {partition, row};
-  try {
-    uri endpoint_uri {endpoint};
-    storage_credentials creds {token};
-    cloud_table_client client {endpoint_uri, creds};
-
-    table_entity::properties_type& properties = entity.properties();
-    for (const auto v : props) {
-      properties[v.first] = entity_property {v.second};
-    }
+  if ( ! if_match.empty())
+    entity.set_etag(if_match);
 
-    table_operation op {table_operation::merge_entity(entity)};
-    cloud_table table_cred {client.get_table_reference(tname)};
-    table_result update_result {table_cred.execute(op)};
-    status_code status {static_cast<status_code> (update_result.http_status_code())};
-    if (status == status_codes::NoContent || status == status_codes::OK)
-      return status_codes::OK;
-    else
-      return status;
-  }
-  catch (const storage_exception& e)
-  {
-    cout << "Azure Table Storage error: " << e.what() << endl;
-    cout << e.result().extended_error().message() << endl;
-    if (e.result().http_status_code() == status_codes::Forbidden)
-      return status_codes::Forbidden;
-    else
-      return status_codes::InternalError;
+  table_entity::properties_type& properties = entity.properties();
+  for (const auto v : props) {
+    properties[v.first] = entity_property {v.second};
   }
+
+  return store.write_with_token(tname, token, store_op_t {store_op_t::merge, entity});
 }
@@ -2,19 +2,32 @@
 #define ServerUtils_h
 
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <cpprest/http_listener.h>
+#include <cpprest/json.h>
 
 #include <was/table.h>
 
+#include "TableStore.h"
+
+// Alias for a vector of JSON property name/value pairs
+using prop_vals_t = std::vector<std::pair<std::string,web::json::value>>;
+
+prop_vals_t
+get_properties (const azure::storage::table_entity::properties_type& properties,
+                prop_vals_t values = prop_vals_t {});
+
 std::pair<web::http::status_code,azure::storage::table_entity>
 read_with_token(const web::http::http_request& message,
-                const std::string& endpoint);
+                TableStore& store);
 
 
 web::http::status_code
 update_with_token (const web::http::http_request& message,
-                   const std::string& endpoint,
-                   const std::unordered_map<std::string,std::string>& props);
+                   TableStore& store,
+                   const std::unordered_map<std::string,std::string>& props,
+                   const std::string& if_match = std::string {});
 #endif
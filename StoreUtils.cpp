@@ -0,0 +1,152 @@
+#include "StoreUtils.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include <was/table.h>
+
+using azure::storage::table_shared_access_policy;
+
+using std::size_t;
+using std::string;
+using std::unordered_set;
+using std::vector;
+
+using web::http::status_code;
+using web::http::status_codes;
+
+namespace {
+  const char hex_digits[] {"0123456789abcdef"};
+
+  int hex_value (char c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    return -1;
+  }
+
+  string sign (const string& secret, const string& payload) {
+    return to_hex(hmac_sha256(secret, payload));
+  }
+
+  // What a token grants, before its permissions and expiry
+  string token_prefix (const string& table, const string& partition, const string& row) {
+    return table + '\n' + partition + '\n' + row + '\n';
+  }
+}
+
+string to_hex (const string& bytes) {
+  string hex {};
+  hex.reserve(bytes.size() * 2);
+  for (unsigned char c : bytes) {
+    hex += hex_digits[c >> 4];
+    hex += hex_digits[c & 0xf];
+  }
+  return hex;
+}
+
+bool from_hex (const string& hex, string& bytes) {
+  if (hex.size() % 2 != 0)
+    return false;
+  bytes.clear();
+  bytes.reserve(hex.size() / 2);
+  for (size_t i {0}; i < hex.size(); i += 2) {
+    int high {hex_value(hex[i])};
+    int low {hex_value(hex[i + 1])};
+    if (high < 0 || low < 0)
+      return false;
+    bytes += static_cast<char>(high << 4 | low);
+  }
+  return true;
+}
+
+string hmac_sha256 (const string& key, const string& message) {
+  unsigned char mac[EVP_MAX_MD_SIZE];
+  unsigned int mac_size {0};
+  HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+       reinterpret_cast<const unsigned char*>(message.data()), message.size(), mac, &mac_size);
+  return string(reinterpret_cast<const char*>(mac), mac_size);
+}
+
+status_code write_status (const store_op_t& op, const string* current_etag) {
+  switch (op.kind) {
+  case store_op_t::insert:
+    return current_etag == nullptr ? status_codes::OK : status_codes::Conflict;
+  case store_op_t::merge:
+  case store_op_t::replace:
+  case store_op_t::remove:
+    if (current_etag == nullptr)
+      return status_codes::NotFound;
+    if ( ! op.entity.etag().empty() && op.entity.etag() != "*" && op.entity.etag() != *current_etag)
+      return status_codes::PreconditionFailed;
+    return status_codes::OK;
+  default:
+    return status_codes::OK;
+  }
+}
+
+bool valid_batch (const vector<store_op_t>& ops) {
+  unordered_set<string> rows {};
+  for (const auto& op : ops) {
+    if (op.entity.partition_key() != ops.front().entity.partition_key() ||
+        ! rows.insert(op.entity.row_key()).second)
+      return false;
+  }
+  return true;
+}
+
+string make_store_token (const string& secret, const string& table, const string& partition, const string& row,
+                         uint8_t permissions, const utility::datetime& expiry) {
+  const string payload {token_prefix(table, partition, row) + std::to_string(permissions) + '\n' +
+                        std::to_string(expiry.to_interval())};
+  return to_hex(payload) + "." + sign(secret, payload);
+}
+
+bool store_token_permits (const string& secret, const string& token, const string& table,
+                          const string& partition, const string& row, uint8_t permissions) {
+  auto dot (token.find('.'));
+  string payload {};
+  if (dot == string::npos || ! from_hex(token.substr(0, dot), payload))
+    return false;
+  const string signature {sign(secret, payload)};
+  if (token.size() - dot - 1 != signature.size() ||
+      CRYPTO_memcmp(token.data() + dot + 1, signature.data(), signature.size()) != 0)
+    return false;
+
+  const string prefix {token_prefix(table, partition, row)};
+  if (payload.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  std::istringstream grant {payload.substr(prefix.size())};
+  unsigned granted {0};
+  uint64_t expiry {0};
+  if ( ! (grant >> granted >> expiry))
+    return false;
+  return (granted & permissions) == permissions && utility::datetime::utc_now().to_interval() < expiry;
+}
+
+uint8_t permissions_for (store_op_t::kind_t kind) {
+  switch (kind) {
+  case store_op_t::insert:
+    return table_shared_access_policy::permissions::add;
+  case store_op_t::merge:
+  case store_op_t::replace:
+    return table_shared_access_policy::permissions::update;
+  case store_op_t::insert_or_merge:
+  case store_op_t::insert_or_replace:
+    return table_shared_access_policy::permissions::add | table_shared_access_policy::permissions::update;
+  default:
+    return table_shared_access_policy::permissions::del;
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef StoreUtils_h
+#define StoreUtils_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include "TableStore.h"
+
+/*
+  Utilities for the TableStores that keep tables themselves rather
+  than in Azure
+ */
+
+// Lower-case hex of bytes, and back; from_hex() returns false for anything else
+std::string to_hex (const std::string& bytes);
+bool from_hex (const std::string& hex, std::string& bytes);
+
+// The raw HMAC-SHA256 of message under key
+std::string hmac_sha256 (const std::string& key, const std::string& message);
+
+/*
+  The status op would have if applied to an entity whose ETag is
+  *current_etag, or to one that does not exist if current_etag is nullptr
+ */
+web::http::status_code write_status (const store_op_t& op, const std::string* current_etag);
+
+// Whether ops are all to one partition and to different rows, as write_batch requires
+bool valid_batch (const std::vector<store_op_t>& ops);
+
+/*
+  Tokens: a token carries the table, entity, permissions and expiry
+  it grants, signed with HMAC-SHA256 under secret, so any store with
+  the same secret honours it: AuthServer hands tokens out and
+  BasicServer checks them, as with Azure.
+ */
+std::string make_store_token (const std::string& secret, const std::string& table,
+                              const std::string& partition, const std::string& row,
+                              uint8_t permissions, const utility::datetime& expiry);
+
+// Whether token is signed under secret, unexpired, and grants permissions on (partition, row) of table
+bool store_token_permits (const std::string& secret, const std::string& token, const std::string& table,
+                          const std::string& partition, const std::string& row, uint8_t permissions);
+
+// The table_shared_access_policy permissions a write of kind needs
+uint8_t permissions_for (store_op_t::kind_t kind);
+
+#endif
@@ -0,0 +1,359 @@
+#include "TableFilter.h"
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <cpprest/json.h>
+
+#include <was/table.h>
+
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using std::make_shared;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::vector;
+
+struct TableFilter::node_t {
+  enum kind_t {and_node, or_node, not_node, compare_node};
+  enum op_t {eq, ne, gt, ge, lt, le};
+
+  kind_t kind;
+  shared_ptr<const node_t> left;   // Operands of and, or and not
+  shared_ptr<const node_t> right;
+  string property;                 // Of a comparison
+  op_t op;
+  entity_property literal;
+};
+
+using node_t = TableFilter::node_t;
+
+namespace {
+  struct token_t {
+    enum kind_t {word, literal, open, close, end};
+    kind_t kind;
+    string text;               // Of a word
+    entity_property value;     // Of a literal
+  };
+
+  [[noreturn]] void bad_filter (const string& why) {
+    throw std::invalid_argument("Bad $filter: " + why);
+  }
+
+  // The quoted text starting at text[i], with '' for each quote, leaving i after it
+  string quoted (const string& text, size_t& i) {
+    string s {};
+    for (++i; i < text.size(); ++i) {
+      if (text[i] == '\'') {
+        if (i + 1 < text.size() && text[i + 1] == '\'')
+          ++i;
+        else {
+          ++i;
+          return s;
+        }
+      }
+      s += text[i];
+    }
+    bad_filter("unterminated string");
+  }
+
+  entity_property number (const string& digits) {
+    try {
+      if (digits.back() == 'L' || digits.back() == 'l')
+        return entity_property {static_cast<int64_t>(std::stoll(digits.substr(0, digits.size() - 1)))};
+      if (digits.find_first_of(".eE") != string::npos)
+        return entity_property {std::stod(digits)};
+      int64_t n {std::stoll(digits)};
+      if (n >= std::numeric_limits<int32_t>::min() && n <= std::numeric_limits<int32_t>::max())
+        return entity_property {static_cast<int32_t>(n)};
+      return entity_property {n};
+    }
+    catch (const std::logic_error&) {
+      bad_filter("bad number " + digits);
+    }
+  }
+
+  vector<token_t> tokenize (const string& text) {
+    vector<token_t> tokens {};
+    size_t i {0};
+    while (i < text.size()) {
+      char c {text[i]};
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        ++i;
+      }
+      else if (c == '(' || c == ')') {
+        tokens.push_back(token_t {c == '(' ? token_t::open : token_t::close, string {}, entity_property {}});
+        ++i;
+      }
+      else if (c == '\'') {
+        tokens.push_back(token_t {token_t::literal, string {}, entity_property {quoted(text, i)}});
+      }
+      else if (std::isdigit(static_cast<unsigned char>(c)) || c == '-' || c == '.') {
+        size_t start {i};
+        while (i < text.size() && (std::isalnum(static_cast<unsigned char>(text[i])) || text[i] == '.' ||
+                                   text[i] == '-' || text[i] == '+'))
+          ++i;
+        tokens.push_back(token_t {token_t::literal, string {}, number(text.substr(start, i - start))});
+      }
+      else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+        size_t start {i};
+        while (i < text.size() && (std::isalnum(static_cast<unsigned char>(text[i])) || text[i] == '_'))
+          ++i;
+        const string word {text.substr(start, i - start)};
+        if (i < text.size() && text[i] == '\'') {
+          const string body {quoted(text, i)};
+          if (word == "datetime")
+            tokens.push_back(token_t {token_t::literal, string {},
+                                      entity_property {utility::datetime::from_string(body, utility::datetime::ISO_8601)}});
+          else if (word == "guid")
+            tokens.push_back(token_t {token_t::literal, string {}, entity_property {utility::string_to_uuid(body)}});
+          else
+            bad_filter("unsupported literal " + word + "'...'");
+        }
+        else if (word == "true" || word == "false")
+          tokens.push_back(token_t {token_t::literal, string {}, entity_property {word == "true"}});
+        else
+          tokens.push_back(token_t {token_t::word, word, entity_property {}});
+      }
+      else {
+        bad_filter(string {"unexpected '"} + c + "'");
+      }
+    }
+    tokens.push_back(token_t {token_t::end, string {}, entity_property {}});
+    return tokens;
+  }
+
+  /*
+    Recursive descent over the tokens:
+
+      or_expr   := and_expr {"or" and_expr}
+      and_expr  := unary {"and" unary}
+      unary     := "not" unary | "(" or_expr ")" | operand op operand
+   */
+  class parser_t {
+  private:
+    const vector<token_t>& tokens;
+    size_t next;
+
+    bool word (const char* w) const {
+      return tokens[next].kind == token_t::word && tokens[next].text == w;
+    }
+
+    shared_ptr<const node_t> join (node_t::kind_t kind, shared_ptr<const node_t> left, shared_ptr<const node_t> right) {
+      shared_ptr<node_t> n {make_shared<node_t>()};
+      n->kind = kind;
+      n->left = left;
+      n->right = right;
+      return n;
+    }
+
+    // The operator of a comparison, flipped if the literal came first
+    node_t::op_t comparison (const string& text, bool flipped) {
+      static const vector<string> names {"eq", "ne", "gt", "ge", "lt", "le"};
+      static const vector<node_t::op_t> flips {node_t::eq, node_t::ne, node_t::lt, node_t::le, node_t::gt, node_t::ge};
+      for (size_t i {0}; i < names.size(); ++i) {
+        if (text == names[i])
+          return flipped ? flips[i] : static_cast<node_t::op_t>(i);
+      }
+      bad_filter("expected a comparison, not " + text);
+    }
+
+    shared_ptr<const node_t> unary () {
+      if (word("not")) {
+        ++next;
+        return join(node_t::not_node, unary(), nullptr);
+      }
+      if (tokens[next].kind == token_t::open) {
+        ++next;
+        shared_ptr<const node_t> inner {or_expr()};
+        if (tokens[next].kind != token_t::close)
+          bad_filter("expected )");
+        ++next;
+        return inner;
+      }
+      if (tokens[next].kind == token_t::end)
+        bad_filter("unexpected end");
+      const token_t& first {tokens[next++]};
+      if (tokens[next].kind != token_t::word)
+        bad_filter("expected a comparison");
+      const string op {tokens[next++].text};
+      if (tokens[next].kind == token_t::end)
+        bad_filter("unexpected end");
+      const token_t& second {tokens[next++]};
+      bool flipped {first.kind == token_t::literal};
+      const token_t& property {flipped ? second : first};
+      const token_t& literal {flipped ? first : second};
+      if (property.kind != token_t::word || literal.kind != token_t::literal)
+        bad_filter("expected a property compared with a literal");
+      shared_ptr<node_t> n {make_shared<node_t>()};
+      n->kind = node_t::compare_node;
+      n->property = property.text;
+      n->op = comparison(op, flipped);
+      n->literal = literal.value;
+      return n;
+    }
+
+    shared_ptr<const node_t> and_expr () {
+      shared_ptr<const node_t> left {unary()};
+      while (word("and")) {
+        ++next;
+        left = join(node_t::and_node, left, unary());
+      }
+      return left;
+    }
+  public:
+    explicit parser_t (const vector<token_t>& tokens) : tokens {tokens}, next {0} {};
+
+    shared_ptr<const node_t> or_expr () {
+      shared_ptr<const node_t> left {and_expr()};
+      while (word("or")) {
+        ++next;
+        left = join(node_t::or_node, left, and_expr());
+      }
+      return left;
+    }
+
+    bool done () const { return tokens[next].kind == token_t::end; }
+  };
+
+  bool is_number (edm_type t) {
+    return t == edm_type::int32 || t == edm_type::int64 || t == edm_type::double_floating_point;
+  }
+
+  template<typename T>
+  int order (const T& a, const T& b) {
+    return a < b ? -1 : b < a ? 1 : 0;
+  }
+
+  /*
+    Order of a against b in cmp, if they are comparable; int64s are
+    compared exactly, other numbers as doubles
+   */
+  bool compare (const entity_property& a, const entity_property& b, int& cmp) {
+    edm_type ta {a.property_type()};
+    edm_type tb {b.property_type()};
+    if (is_number(ta) && is_number(tb)) {
+      if (ta == edm_type::double_floating_point || tb == edm_type::double_floating_point) {
+        auto as_double = [] (const entity_property& p) {
+          return p.property_type() == edm_type::double_floating_point ? p.double_value()
+            : p.property_type() == edm_type::int64 ? static_cast<double>(p.int64_value()) : p.int32_value();
+        };
+        cmp = order(as_double(a), as_double(b));
+      }
+      else {
+        auto as_int64 = [] (const entity_property& p) {
+          return p.property_type() == edm_type::int64 ? p.int64_value() : static_cast<int64_t>(p.int32_value());
+        };
+        cmp = order(as_int64(a), as_int64(b));
+      }
+      return true;
+    }
+    if (ta != tb)
+      return false;
+    switch (ta) {
+    case edm_type::string:   cmp = order(a.string_value(), b.string_value()); return true;
+    case edm_type::boolean:  cmp = order(a.boolean_value(), b.boolean_value()); return true;
+    case edm_type::datetime: cmp = order(a.datetime_value().to_interval(), b.datetime_value().to_interval()); return true;
+    case edm_type::guid:     cmp = order(utility::uuid_to_string(a.guid_value()), utility::uuid_to_string(b.guid_value())); return true;
+    default:                 return false;
+    }
+  }
+
+  bool evaluate (const node_t& n, const table_entity& entity) {
+    switch (n.kind) {
+    case node_t::and_node: return evaluate(*n.left, entity) && evaluate(*n.right, entity);
+    case node_t::or_node:  return evaluate(*n.left, entity) || evaluate(*n.right, entity);
+    case node_t::not_node: return ! evaluate(*n.left, entity);
+    default: break;
+    }
+    entity_property value {};
+    if (n.property == "PartitionKey")
+      value = entity_property {entity.partition_key()};
+    else if (n.property == "RowKey")
+      value = entity_property {entity.row_key()};
+    else if (n.property == "Timestamp")
+      value = entity_property {entity.timestamp()};
+    else {
+      auto found (entity.properties().find(n.property));
+      if (found == entity.properties().end())
+        return false;
+      value = found->second;
+    }
+    int cmp {0};
+    if ( ! compare(value, n.literal, cmp))
+      return false;
+    switch (n.op) {
+    case node_t::eq: return cmp == 0;
+    case node_t::ne: return cmp != 0;
+    case node_t::gt: return cmp > 0;
+    case node_t::ge: return cmp >= 0;
+    case node_t::lt: return cmp < 0;
+    default:         return cmp <= 0;
+    }
+  }
+
+  // The comparisons joined by the ands at the top of n
+  void conjuncts (const shared_ptr<const node_t>& n, vector<const node_t*>& found) {
+    if (n->kind == node_t::and_node) {
+      conjuncts(n->left, found);
+      conjuncts(n->right, found);
+    }
+    else if (n->kind == node_t::compare_node)
+      found.push_back(n.get());
+  }
+}
+
+TableFilter::TableFilter (const string& text) : root {} {
+  const vector<token_t> tokens {tokenize(text)};
+  parser_t parser {tokens};
+  root = parser.or_expr();
+  if ( ! parser.done())
+    bad_filter("unexpected text after the expression");
+}
+
+bool TableFilter::matches (const table_entity& entity) const {
+  return evaluate(*root, entity);
+}
+
+void TableFilter::narrow (scan_t& spec) const {
+  vector<const node_t*> required {};
+  conjuncts(root, required);
+  for (const node_t* c : required) {
+    if (c->literal.property_type() != edm_type::string)
+      continue;
+    const string& s {c->literal.string_value()};
+    if (c->property == "PartitionKey" && c->op == node_t::eq && spec.partition.empty())
+      spec.partition = s;
+    else if (c->property == "RowKey") {
+      if ((c->op == node_t::eq || c->op == node_t::ge || c->op == node_t::gt) && spec.low.empty()) {
+        spec.low = s;
+        spec.low_inclusive = c->op != node_t::gt;
+      }
+      if ((c->op == node_t::eq || c->op == node_t::le || c->op == node_t::lt) && spec.high.empty()) {
+        spec.high = s;
+        spec.high_inclusive = c->op != node_t::lt;
+      }
+    }
+  }
+}
+
+bool TableFilter::required_value (const string& property, string& value) const {
+  vector<const node_t*> required {};
+  conjuncts(root, required);
+  for (const node_t* c : required) {
+    if (c->property == property && c->op == node_t::eq && c->literal.property_type() == edm_type::string) {
+      value = c->literal.string_value();
+      return true;
+    }
+  }
+  return false;
+}
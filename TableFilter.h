@@ -0,0 +1,47 @@
+#ifndef TableFilter_h
+#define TableFilter_h
+
+#include <memory>
+#include <string>
+
+#include <was/table.h>
+
+#include "TableStore.h"
+
+/*
+  A $filter expression of the Table service's query protocol, as
+  table_query::generate_filter_condition() and
+  combine_filter_conditions() write them:
+
+    PartitionKey eq 'USA' and (RowKey ge 'A' or not (Count lt 5L))
+
+  Comparisons are eq, ne, gt, ge, lt and le between a property and a
+  string, integer (with an L suffix for Int64), floating-point,
+  true/false, datetime'...' or guid'...' literal, in either order,
+  combined with and, or, not and parentheses. As in the Table service,
+  a comparison with a missing property, or between values of different
+  types (other than two numbers), is false.
+ */
+class TableFilter {
+public:
+  // Throws std::invalid_argument if text is not such an expression
+  explicit TableFilter (const std::string& text);
+
+  bool matches (const azure::storage::table_entity& entity) const;
+
+  /*
+    Narrow spec to the partition and row range that the comparisons
+    joined by the top-level ands require of every match, so a scan
+    need not visit entities that cannot match
+   */
+  void narrow (scan_t& spec) const;
+
+  // Whether those comparisons require string property to equal a literal, and which
+  bool required_value (const std::string& property, std::string& value) const;
+
+  struct node_t;
+private:
+  std::shared_ptr<const node_t> root;
+};
+
+#endif
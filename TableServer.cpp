@@ -0,0 +1,925 @@
+/*
+  Stand-in for Azure Table Storage, so the servers, tester and the
+  load tests can run on a machine without network access
+
+  Serves the part of the Table service REST protocol (version
+  2015-04-05, JSON payloads) that the Azure storage library speaks
+  for this project:
+
+    POST   Tables                              create a table
+    GET    Tables('t')                         whether it exists, also as
+           Tables()?$filter=TableName eq 't'
+    DELETE Tables('t')                         delete it
+    GET    t(PartitionKey='p',RowKey='r')      retrieve an entity
+    GET    t()?$filter=..&$top=..&$select=..   query, at most 1000 entities
+           &NextPartitionKey=..&NextRowKey=..    per page, with continuation
+    POST   t                                   insert
+    PUT    t(PartitionKey='p',RowKey='r')      replace, or insert or replace
+                                                 without If-Match
+    MERGE  t(PartitionKey='p',RowKey='r')      merge, or insert or merge
+                                                 without If-Match
+    DELETE t(PartitionKey='p',RowKey='r')      delete
+    POST   $batch                              one change set of writes to a
+                                                 partition, applied atomically
+
+  The tables are kept in a MemoryTableStore or DiskTableStore. The
+  server listens at tables_endpoint and takes the account name and
+  key from storage_connection_string, both in azure_keys.h, so the
+  servers built with the same keys use it. With
+
+    storage_connection_string {"UseDevelopmentStorage=true"}
+    tables_endpoint {"http://127.0.0.1:10002/devstoreaccount1"}
+
+  both are the storage emulator's well-known account.
+
+  Shared Key signatures on requests are not checked. Shared access
+  signatures, such as the tokens AuthServer hands out, are checked as
+  the service checks them: signature, validity period, table, key
+  range and permissions.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <openssl/crypto.h>
+
+#include <cpprest/base_uri.h>
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+#include <pplx/threadpool.h>
+
+#include <was/common.h>
+#include <was/storage_account.h>
+#include <was/table.h>
+
+#include "StoreUtils.h"
+#include "TableFilter.h"
+#include "TableStore.h"
+
+#include "azure_keys.h"
+
+using azure::storage::cloud_storage_account;
+using azure::storage::edm_type;
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+using azure::storage::table_shared_access_policy;
+
+using boost::asio::steady_timer;
+
+using std::cerr;
+using std::cin;
+using std::cout;
+using std::endl;
+using std::getline;
+using std::make_pair;
+using std::make_shared;
+using std::map;
+using std::pair;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using std::chrono::milliseconds;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::methods;
+using web::http::status_code;
+using web::http::status_codes;
+using web::http::uri;
+
+using web::json::value;
+
+using web::http::experimental::listener::http_listener;
+
+// Most entities in one page of a query, and writes in one batch, as in the service
+constexpr size_t max_page_size {1000};
+constexpr size_t max_batch_size {100};
+
+const string json_content_type {"application/json;odata=minimalmetadata;streaming=true;charset=utf-8"};
+const string service_version {"2015-04-05"};
+
+std::unique_ptr<TableStore> store {};
+
+// From storage_connection_string; the key is raw bytes, for signatures
+string account_name {};
+string account_key {};
+
+// Path of tables_endpoint, before every resource, such as "/devstoreaccount1"
+string path_prefix {};
+
+// Fault injection; see main()
+milliseconds reply_latency {0};
+double error_rate {0.0};
+constexpr uint64_t default_fault_seed {276};
+std::mutex fault_lock {};
+std::mt19937_64 fault_rng {default_fault_seed};
+
+std::atomic<uint64_t> request_count {0};
+
+/*
+  The outcome of one operation, as a reply or as one response of a batch
+ */
+struct result_t {
+  status_code status;
+  vector<pair<string,string>> headers;
+  value body;  // Null if none
+};
+
+result_t failure (status_code status, const string& code, const string& message) {
+  value error {value::object()};
+  error["code"] = value::string(code);
+  error["message"] = value::object();
+  error["message"]["lang"] = value::string("en-US");
+  error["message"]["value"] = value::string(message);
+  value body {value::object()};
+  body["odata.error"] = error;
+  return result_t {status, vector<pair<string,string>> {}, body};
+}
+
+// The service's error for an entity operation that the store failed with status
+result_t store_failure (const string& table, status_code status) {
+  if (status == status_codes::NotFound) {
+    if ( ! store->exists(table))
+      return failure(status, "TableNotFound", "The table specified does not exist.");
+    return failure(status, "ResourceNotFound", "The specified resource does not exist.");
+  }
+  if (status == status_codes::Conflict)
+    return failure(status, "EntityAlreadyExists", "The specified entity already exists.");
+  if (status == status_codes::PreconditionFailed)
+    return failure(status, "UpdateConditionNotSatisfied", "The update condition specified in the request was not satisfied.");
+  if (status == status_codes::BadRequest)
+    return failure(status, "InvalidInput", "One of the request inputs is not valid.");
+  return failure(status, "InternalError", "The server encountered an internal error.");
+}
+
+http_response response_of (const result_t& result) {
+  http_response response {result.status};
+  for (const auto& h : result.headers)
+    response.headers().add(h.first, h.second);
+  if ( ! result.body.is_null())
+    response.set_body(result.body.serialize(), json_content_type);
+  return response;
+}
+
+/*
+  Entities as JSON with minimal metadata: types that JSON does not
+  carry are given by a "name@odata.type" member
+ */
+value entity_json (const table_entity& entity, const std::set<string>* select) {
+  value v {value::object()};
+  v["odata.etag"] = value::string(entity.etag());
+  v["PartitionKey"] = value::string(entity.partition_key());
+  v["RowKey"] = value::string(entity.row_key());
+  utility::datetime timestamp {entity.timestamp().is_initialized() ? entity.timestamp() : utility::datetime::utc_now()};
+  v["Timestamp"] = value::string(timestamp.to_string(utility::datetime::ISO_8601));
+  for (const auto& p : entity.properties()) {
+    if (select != nullptr && select->count(p.first) == 0)
+      continue;
+    const entity_property& prop = p.second;
+    const string type_name {p.first + "@odata.type"};
+    switch (prop.property_type()) {
+    case edm_type::string:
+      v[p.first] = value::string(prop.string_value());
+      break;
+    case edm_type::boolean:
+      v[p.first] = value::boolean(prop.boolean_value());
+      break;
+    case edm_type::int32:
+      v[p.first] = value::number(prop.int32_value());
+      break;
+    case edm_type::int64:
+      v[type_name] = value::string("Edm.Int64");
+      v[p.first] = value::string(std::to_string(prop.int64_value()));
+      break;
+    case edm_type::double_floating_point:
+      v[type_name] = value::string("Edm.Double");
+      v[p.first] = value::number(prop.double_value());
+      break;
+    case edm_type::datetime:
+      v[type_name] = value::string("Edm.DateTime");
+      v[p.first] = value::string(prop.datetime_value().to_string(utility::datetime::ISO_8601));
+      break;
+    case edm_type::guid:
+      v[type_name] = value::string("Edm.Guid");
+      v[p.first] = value::string(utility::uuid_to_string(prop.guid_value()));
+      break;
+    default:
+      v[type_name] = value::string("Edm.Binary");
+      v[p.first] = value::string(utility::conversions::to_base64(prop.binary_value()));
+      break;
+    }
+  }
+  return v;
+}
+
+entity_property property_of (const value& v, const string& type) {
+  if (type == "Edm.Int64")
+    return entity_property {static_cast<int64_t>(std::stoll(v.as_string()))};
+  if (type == "Edm.Int32")
+    return entity_property {static_cast<int32_t>(v.as_integer())};
+  if (type == "Edm.Double")
+    return entity_property {v.is_string() ? std::stod(v.as_string()) : v.as_double()};
+  if (type == "Edm.Boolean")
+    return entity_property {v.as_bool()};
+  if (type == "Edm.DateTime")
+    return entity_property {utility::datetime::from_string(v.as_string(), utility::datetime::ISO_8601)};
+  if (type == "Edm.Guid")
+    return entity_property {utility::string_to_uuid(v.as_string())};
+  if (type == "Edm.Binary")
+    return entity_property {utility::conversions::from_base64(v.as_string())};
+  if ( ! type.empty() && type != "Edm.String")
+    throw std::invalid_argument("Unknown property type " + type);
+  if (v.is_string())
+    return entity_property {v.as_string()};
+  if (v.is_boolean())
+    return entity_property {v.as_bool()};
+  if (v.is_integer()) {
+    int64_t n {v.as_number().to_int64()};
+    if (n >= std::numeric_limits<int32_t>::min() && n <= std::numeric_limits<int32_t>::max())
+      return entity_property {static_cast<int32_t>(n)};
+    return entity_property {n};
+  }
+  if (v.is_number())
+    return entity_property {v.as_double()};
+  throw std::invalid_argument("Property values must be strings, numbers or booleans");
+}
+
+/*
+  The entity in a request body. Its keys are those in the resource
+  path if given there, else its PartitionKey and RowKey members.
+  Throws std::invalid_argument if body is not an entity.
+ */
+table_entity entity_of (const string& body, const string* partition, const string* row) {
+  value json {value::parse(body)};
+  if ( ! json.is_object())
+    throw std::invalid_argument("The body is not an entity");
+  table_entity entity {};
+  if (partition != nullptr) {
+    entity.set_partition_key(*partition);
+    entity.set_row_key(*row);
+  }
+  else {
+    if ( ! json.has_field("PartitionKey") || ! json.at("PartitionKey").is_string() ||
+         ! json.has_field("RowKey") || ! json.at("RowKey").is_string())
+      throw std::invalid_argument("The entity has no PartitionKey and RowKey");
+    entity.set_partition_key(json.at("PartitionKey").as_string());
+    entity.set_row_key(json.at("RowKey").as_string());
+  }
+  for (const auto& field : json.as_object()) {
+    const string& name = field.first;
+    if (name == "PartitionKey" || name == "RowKey" || name == "Timestamp" || name.compare(0, 6, "odata.") == 0 ||
+        name.find("@odata.") != string::npos || field.second.is_null())
+      continue;
+    const string type_name {name + "@odata.type"};
+    const string type {json.has_field(type_name) ? json.at(type_name).as_string() : string {}};
+    entity.properties()[name] = property_of(field.second, type);
+  }
+  return entity;
+}
+
+// The quoted text at text[i], with '' for each quote, leaving i after it
+bool quoted (const string& text, size_t& i, string& s) {
+  if (i >= text.size() || text[i] != '\'')
+    return false;
+  s.clear();
+  for (++i; i < text.size(); ++i) {
+    if (text[i] == '\'') {
+      if (i + 1 < text.size() && text[i + 1] == '\'')
+        ++i;
+      else {
+        ++i;
+        return true;
+      }
+    }
+    s += text[i];
+  }
+  return false;
+}
+
+bool literal_at (const string& text, size_t& i, const string& literal) {
+  if (text.compare(i, literal.size(), literal) != 0)
+    return false;
+  i += literal.size();
+  return true;
+}
+
+/*
+  A table or entity named by a resource path such as
+  t(PartitionKey='p',RowKey='r')
+ */
+struct resource_t {
+  string table;
+  bool entity;
+  string partition;
+  string row;
+};
+
+bool parse_resource (const string& path, resource_t& r) {
+  size_t paren {path.find('(')};
+  r.table = path.substr(0, paren);
+  r.entity = false;
+  if (r.table.empty())
+    return false;
+  if (paren == string::npos || path.compare(paren, string::npos, "()") == 0)
+    return true;
+  size_t i {paren + 1};
+  r.entity = true;
+  return literal_at(path, i, "PartitionKey=") && quoted(path, i, r.partition) &&
+    literal_at(path, i, ",RowKey=") && quoted(path, i, r.row) && literal_at(path, i, ")") && i == path.size();
+}
+
+// Path of a request URI relative to the account, without the leading /
+string resource_path (const uri& u) {
+  string path {uri::decode(u.path())};
+  if ( ! path_prefix.empty() && path.compare(0, path_prefix.size(), path_prefix) == 0)
+    path.erase(0, path_prefix.size());
+  if ( ! path.empty() && path[0] == '/')
+    path.erase(0, 1);
+  return path;
+}
+
+map<string,string> query_of (const uri& u) {
+  map<string,string> query {};
+  for (const auto& q : uri::split_query(u.query()))
+    query[uri::decode(q.first)] = uri::decode(q.second);
+  return query;
+}
+
+string query_value (const map<string,string>& query, const string& name) {
+  auto found (query.find(name));
+  return found == query.end() ? string {} : found->second;
+}
+
+string lower_case (string s) {
+  std::transform(s.begin(), s.end(), s.begin(), [] (unsigned char c) { return static_cast<char>(std::tolower(c)); });
+  return s;
+}
+
+// The permission letters of a shared access signature for table_shared_access_policy permissions
+string permission_letters (uint8_t permissions) {
+  string letters {};
+  if (permissions & table_shared_access_policy::permissions::read)
+    letters += 'r';
+  if (permissions & table_shared_access_policy::permissions::add)
+    letters += 'a';
+  if (permissions & table_shared_access_policy::permissions::update)
+    letters += 'u';
+  if (permissions & table_shared_access_policy::permissions::del)
+    letters += 'd';
+  return letters;
+}
+
+/*
+  Whether the shared access signature in query is signed with the
+  account key, valid now, for table, and grants every permission
+  letter in needed. A signature in a query without one is not checked.
+ */
+bool sas_permits (const map<string,string>& query, const string& table, const string& needed) {
+  const string signature {query_value(query, "sig")};
+  const string version {query_value(query, "sv")};
+  const string granted {query_value(query, "sp")};
+  const string start {query_value(query, "st")};
+  const string expiry {query_value(query, "se")};
+  if ( ! query_value(query, "si").empty() || expiry.empty())
+    return false;  // Stored access policies are not kept
+
+  string to_sign {granted + "\n" + start + "\n" + expiry + "\n" +
+                  "/table/" + account_name + "/" + lower_case(query_value(query, "tn")) + "\n\n"};
+  if (version >= "2015-04-05")
+    to_sign += query_value(query, "sip") + "\n" + query_value(query, "spr") + "\n";
+  to_sign += version + "\n" + query_value(query, "spk") + "\n" + query_value(query, "srk") + "\n" +
+    query_value(query, "epk") + "\n" + query_value(query, "erk");
+  const string mac {hmac_sha256(account_key, to_sign)};
+  const string expected {utility::conversions::to_base64(vector<unsigned char> (mac.begin(), mac.end()))};
+  if (signature.size() != expected.size() || CRYPTO_memcmp(signature.data(), expected.data(), expected.size()) != 0)
+    return false;
+
+  const uint64_t now {utility::datetime::utc_now().to_interval()};
+  if (utility::datetime::from_string(expiry, utility::datetime::ISO_8601).to_interval() <= now ||
+      ( ! start.empty() && utility::datetime::from_string(start, utility::datetime::ISO_8601).to_interval() > now))
+    return false;
+  if (lower_case(query_value(query, "tn")) != lower_case(table))
+    return false;
+  for (char c : needed) {
+    if (granted.find(c) == string::npos)
+      return false;
+  }
+  return true;
+}
+
+// Whether the key range of the shared access signature in query includes (partition, row)
+bool sas_covers (const map<string,string>& query, const string& partition, const string& row) {
+  const string spk {query_value(query, "spk")};
+  const string srk {query_value(query, "srk")};
+  const string epk {query_value(query, "epk")};
+  const string erk {query_value(query, "erk")};
+  bool after_start {spk.empty() || partition > spk || (partition == spk && (srk.empty() || row >= srk))};
+  bool before_end {epk.empty() || partition < epk || (partition == epk && (erk.empty() || row <= erk))};
+  return after_start && before_end;
+}
+
+/*
+  The write a request makes to resource r, from its method, If-Match
+  header and body. Throws std::invalid_argument if it is not one.
+ */
+store_op_t op_of (const string& method, const resource_t& r, const string& if_match, const string& body) {
+  if ( ! r.entity) {
+    if (method != methods::POST)
+      throw std::invalid_argument("Unsupported method " + method + " on a table");
+    return store_op_t {store_op_t::insert, entity_of(body, nullptr, nullptr)};
+  }
+  store_op_t op {store_op_t::remove, table_entity {r.partition, r.row}};
+  if (method == methods::PUT) {
+    op = store_op_t {if_match.empty() ? store_op_t::insert_or_replace : store_op_t::replace,
+                     entity_of(body, &r.partition, &r.row)};
+  }
+  else if (method == methods::MERGE) {
+    op = store_op_t {if_match.empty() ? store_op_t::insert_or_merge : store_op_t::merge,
+                     entity_of(body, &r.partition, &r.row)};
+  }
+  else if (method != methods::DEL)
+    throw std::invalid_argument("Unsupported method " + method + " on an entity");
+  op.entity.set_etag(if_match);
+  return op;
+}
+
+/*
+  The result of op once the store has applied it: the new ETag and,
+  for an insert unless echo is false, the entity
+ */
+result_t written (const string& table, const store_op_t& op, bool echo) {
+  result_t result {status_codes::NoContent, vector<pair<string,string>> {}, value::null()};
+  table_entity stored {};
+  if (op.kind == store_op_t::remove ||
+      store->retrieve(table, op.entity.partition_key(), op.entity.row_key(), stored) != status_codes::OK)
+    return result;
+  result.headers.push_back(make_pair("ETag", stored.etag()));
+  if (op.kind == store_op_t::insert && echo) {
+    result.status = status_codes::Created;
+    result.body = entity_json(stored, nullptr);
+  }
+  return result;
+}
+
+result_t write_entity (const string& table, const store_op_t& op, const map<string,string>& query, bool echo) {
+  if (query.count("sig") != 0 &&
+      ! (sas_permits(query, table, permission_letters(permissions_for(op.kind))) &&
+         sas_covers(query, op.entity.partition_key(), op.entity.row_key())))
+    return failure(status_codes::Forbidden, "AuthorizationPermissionMismatch",
+                   "This request is not authorized to perform this operation using this permission.");
+  status_code status {store->write(table, op)};
+  if (status != status_codes::OK)
+    return store_failure(table, status);
+  return written(table, op, echo);
+}
+
+result_t retrieve_entity (const resource_t& r, const map<string,string>& query) {
+  if (query.count("sig") != 0 && ! (sas_permits(query, r.table, "r") && sas_covers(query, r.partition, r.row)))
+    return failure(status_codes::Forbidden, "AuthorizationPermissionMismatch",
+                   "This request is not authorized to perform this operation using this permission.");
+  table_entity entity {};
+  status_code status {store->retrieve(r.table, r.partition, r.row, entity)};
+  if (status != status_codes::OK)
+    return store_failure(r.table, status);
+  return result_t {status_codes::OK, vector<pair<string,string>> {make_pair("ETag", entity.etag())},
+                   entity_json(entity, nullptr)};
+}
+
+/*
+  One page of the entities of table that match the query's $filter,
+  resuming from its continuation. Keys in continuations are hex, so
+  any key survives a header.
+ */
+result_t query_entities (const string& table, const map<string,string>& query) {
+  bool signed_query {query.count("sig") != 0};
+  if (signed_query && ! sas_permits(query, table, "r"))
+    return failure(status_codes::Forbidden, "AuthorizationPermissionMismatch",
+                   "This request is not authorized to perform this operation using this permission.");
+
+  scan_t spec {};
+  std::unique_ptr<TableFilter> filter {};
+  if ( ! query_value(query, "$filter").empty()) {
+    filter.reset(new TableFilter {query_value(query, "$filter")});
+    filter->narrow(spec);
+  }
+  if ( ! query_value(query, "NextPartitionKey").empty() &&
+       ! (from_hex(query_value(query, "NextPartitionKey"), spec.start_partition) &&
+          from_hex(query_value(query, "NextRowKey"), spec.start_row)))
+    throw std::invalid_argument("Bad continuation");
+  size_t page_size {max_page_size};
+  if ( ! query_value(query, "$top").empty())
+    page_size = std::min(max_page_size, static_cast<size_t>(std::stoul(query_value(query, "$top"))));
+  std::set<string> select {};
+  const string select_list {query_value(query, "$select")};
+  for (size_t start {0}; start < select_list.size(); ) {
+    size_t comma {std::min(select_list.find(',', start), select_list.size())};
+    select.insert(select_list.substr(start, comma - start));
+    start = comma + 1;
+  }
+
+  value entities {value::array()};
+  size_t count {0};
+  pair<string,string> next {};
+  bool more {false};
+  status_code status {store->scan(table, spec, [&] (const table_entity& e)
+    {
+      if ((filter && ! filter->matches(e)) || (signed_query && ! sas_covers(query, e.partition_key(), e.row_key())))
+        return true;
+      if (count == page_size) {
+        more = true;
+        next = make_pair(e.partition_key(), e.row_key());
+        return false;
+      }
+      entities[count++] = entity_json(e, select.empty() ? nullptr : &select);
+      return true;
+    })};
+  if (status != status_codes::OK)
+    return store_failure(table, status);
+
+  result_t result {status_codes::OK, vector<pair<string,string>> {}, value::object()};
+  result.body["odata.metadata"] = value::string(tables_endpoint + "/$metadata#" + table);
+  result.body["value"] = entities;
+  if (more) {
+    result.headers.push_back(make_pair("x-ms-continuation-NextPartitionKey", to_hex(next.first)));
+    result.headers.push_back(make_pair("x-ms-continuation-NextRowKey", to_hex(next.second)));
+  }
+  return result;
+}
+
+value table_json (const string& table) {
+  value v {value::object()};
+  v["odata.metadata"] = value::string(tables_endpoint + "/$metadata#Tables/@Element");
+  v["TableName"] = value::string(table);
+  return v;
+}
+
+/*
+  Requests to Tables. The store cannot list its tables, so a query
+  must name the one table it wants.
+ */
+result_t serve_tables (const string& method, const string& path, const map<string,string>& query,
+                       const string& body, bool echo) {
+  if (query.count("sig") != 0)
+    return failure(status_codes::Forbidden, "AuthorizationFailure",
+                   "A shared access signature cannot be used on tables.");
+  if (path == "Tables" || path == "Tables()") {
+    if (method == methods::POST) {
+      value json {value::parse(body)};
+      if ( ! json.is_object() || ! json.has_field("TableName") || ! json.at("TableName").is_string())
+        throw std::invalid_argument("No TableName");
+      const string table {json.at("TableName").as_string()};
+      if ( ! store->create_table(table))
+        return failure(status_codes::Conflict, "TableAlreadyExists", "The table specified already exists.");
+      if ( ! echo)
+        return result_t {status_codes::NoContent, vector<pair<string,string>> {}, value::null()};
+      return result_t {status_codes::Created, vector<pair<string,string>> {}, table_json(table)};
+    }
+    if (method == methods::GET) {
+      const string filter {query_value(query, "$filter")};
+      string table {};
+      if (filter.empty() || ! TableFilter {filter}.required_value("TableName", table))
+        return failure(status_codes::NotImplemented, "NotImplemented", "Only one table can be queried at a time.");
+      value tables {value::array()};
+      if (store->exists(table))
+        tables[0] = table_json(table);
+      value list {value::object()};
+      list["value"] = tables;
+      return result_t {status_codes::OK, vector<pair<string,string>> {}, list};
+    }
+    throw std::invalid_argument("Unsupported method " + method + " on Tables");
+  }
+
+  size_t i {string {"Tables("}.size()};
+  string table {};
+  if ( ! quoted(path, i, table) || ! literal_at(path, i, ")") || i != path.size())
+    throw std::invalid_argument("Bad table name");
+  if (method == methods::GET) {
+    if ( ! store->exists(table))
+      return failure(status_codes::NotFound, "ResourceNotFound", "The specified resource does not exist.");
+    return result_t {status_codes::OK, vector<pair<string,string>> {}, table_json(table)};
+  }
+  if (method == methods::DEL) {
+    if ( ! store->delete_table(table))
+      return failure(status_codes::NotFound, "ResourceNotFound", "The specified resource does not exist.");
+    return result_t {status_codes::NoContent, vector<pair<string,string>> {}, value::null()};
+  }
+  throw std::invalid_argument("Unsupported method " + method + " on a table");
+}
+
+/*
+  Multipart bodies, as lines without their line ends
+ */
+vector<string> lines_of (const string& text) {
+  vector<string> lines {};
+  size_t start {0};
+  while (start <= text.size()) {
+    size_t end {std::min(text.find('\n', start), text.size())};
+    string line {text.substr(start, end - start)};
+    if ( ! line.empty() && line.back() == '\r')
+      line.pop_back();
+    lines.push_back(line);
+    start = end + 1;
+  }
+  return lines;
+}
+
+// The header lines from lines[i] to the next empty line, leaving i after it
+map<string,string> headers_of (const vector<string>& lines, size_t& i) {
+  map<string,string> headers {};
+  for (; i < lines.size() && ! lines[i].empty(); ++i) {
+    size_t colon {lines[i].find(':')};
+    if (colon == string::npos)
+      continue;
+    size_t value_start {lines[i].find_first_not_of(' ', colon + 1)};
+    headers[lower_case(lines[i].substr(0, colon))] =
+      value_start == string::npos ? string {} : lines[i].substr(value_start);
+  }
+  if (i < lines.size())
+    ++i;
+  return headers;
+}
+
+string boundary_of (const string& content_type) {
+  size_t at {content_type.find("boundary=")};
+  if (at == string::npos)
+    throw std::invalid_argument("No multipart boundary");
+  string boundary {content_type.substr(at + 9, content_type.find(';', at) - at - 9)};
+  boundary.erase(std::remove(boundary.begin(), boundary.end(), '"'), boundary.end());
+  return boundary;
+}
+
+// The lines of each part of a multipart body with boundary
+vector<vector<string>> parts_of (const vector<string>& lines, const string& boundary) {
+  vector<vector<string>> parts {};
+  bool in_part {false};
+  for (const auto& line : lines) {
+    if (line == "--" + boundary + "--")
+      break;
+    if (line == "--" + boundary) {
+      parts.push_back(vector<string> {});
+      in_part = true;
+    }
+    else if (in_part)
+      parts.back().push_back(line);
+  }
+  return parts;
+}
+
+string reason_phrase (status_code status) {
+  static const map<status_code,string> phrases {
+    {status_codes::OK, "OK"}, {status_codes::Created, "Created"}, {status_codes::Accepted, "Accepted"},
+    {status_codes::NoContent, "No Content"}, {status_codes::BadRequest, "Bad Request"},
+    {status_codes::Forbidden, "Forbidden"}, {status_codes::NotFound, "Not Found"},
+    {status_codes::Conflict, "Conflict"}, {status_codes::PreconditionFailed, "Precondition Failed"}};
+  auto found (phrases.find(status));
+  return found == phrases.end() ? string {"Internal Server Error"} : found->second;
+}
+
+/*
+  A batch: a multipart body holding one change set, itself a multipart
+  body of HTTP requests, each a write to one table and partition. The
+  writes are applied together or not at all. The reply is a multipart
+  body holding a change set of the responses, or, if a write fails,
+  just its error.
+ */
+http_response serve_batch (const http_request& message, const map<string,string>& query, const string& body) {
+  const vector<string> batch {lines_of(body)};
+  const vector<vector<string>> sets {parts_of(batch, boundary_of(message.headers().content_type()))};
+  if (sets.size() != 1)
+    throw std::invalid_argument("A batch must hold exactly one change set");
+  size_t i {0};
+  map<string,string> set_headers {headers_of(sets[0], i)};
+  const vector<string> set_lines (sets[0].begin() + i, sets[0].end());
+  const vector<vector<string>> requests {parts_of(set_lines, boundary_of(set_headers["content-type"]))};
+  if (requests.empty() || requests.size() > max_batch_size)
+    throw std::invalid_argument("A change set must hold 1 to 100 requests");
+
+  string table {};
+  vector<store_op_t> ops {};
+  vector<bool> echoes {};
+  vector<string> content_ids {};
+  for (const auto& part : requests) {
+    size_t j {0};
+    map<string,string> part_headers {headers_of(part, j)};
+    if (j >= part.size())
+      throw std::invalid_argument("Empty request in change set");
+    const string request_line {part[j++]};
+    size_t space {request_line.find(' ')};
+    const string method {request_line.substr(0, space)};
+    const string target {request_line.substr(space + 1, request_line.rfind(' ') - space - 1)};
+    map<string,string> headers {headers_of(part, j)};
+    string request_body {};
+    for (; j < part.size(); ++j)
+      request_body += part[j] + "\n";
+
+    resource_t r {};
+    if ( ! parse_resource(resource_path(uri {target}), r))
+      throw std::invalid_argument("Bad resource " + target);
+    if ( ! table.empty() && r.table != table)
+      throw std::invalid_argument("A change set must write to one table");
+    table = r.table;
+    ops.push_back(op_of(method, r, headers["if-match"], request_body));
+    echoes.push_back(headers["prefer"] != "return-no-content");
+    content_ids.push_back(part_headers.count("content-id") ? part_headers["content-id"] : headers["content-id"]);
+    if (query.count("sig") != 0 &&
+        ! (sas_permits(query, table, permission_letters(permissions_for(ops.back().kind))) &&
+           sas_covers(query, ops.back().entity.partition_key(), ops.back().entity.row_key())))
+      return response_of(failure(status_codes::Forbidden, "AuthorizationPermissionMismatch",
+                                 "This request is not authorized to perform this operation using this permission."));
+  }
+
+  vector<result_t> results {};
+  status_code status {store->write_batch(table, ops)};
+  if (status == status_codes::OK) {
+    for (size_t k {0}; k < ops.size(); ++k)
+      results.push_back(written(table, ops[k], echoes[k]));
+  }
+  else {
+    results.push_back(store_failure(table, status));
+    content_ids.assign(1, string {});
+  }
+
+  const string id {std::to_string(request_count.load())};
+  const string batch_boundary {"batchresponse_" + id};
+  const string set_boundary {"changesetresponse_" + id};
+  string reply {"--" + batch_boundary + "\r\n" +
+                "Content-Type: multipart/mixed; boundary=" + set_boundary + "\r\n\r\n"};
+  for (size_t k {0}; k < results.size(); ++k) {
+    const result_t& result = results[k];
+    reply += "--" + set_boundary + "\r\n" +
+      "Content-Type: application/http\r\n" +
+      "Content-Transfer-Encoding: binary\r\n\r\n" +
+      "HTTP/1.1 " + std::to_string(result.status) + " " + reason_phrase(result.status) + "\r\n";
+    if ( ! content_ids[k].empty())
+      reply += "Content-ID: " + content_ids[k] + "\r\n";
+    reply += "X-Content-Type-Options: nosniff\r\nCache-Control: no-cache\r\nDataServiceVersion: 3.0;\r\n";
+    for (const auto& h : result.headers)
+      reply += h.first + ": " + h.second + "\r\n";
+    if (result.body.is_null())
+      reply += "\r\n";
+    else
+      reply += "Content-Type: " + json_content_type + "\r\n\r\n" + result.body.serialize() + "\r\n";
+  }
+  reply += "--" + set_boundary + "--\r\n--" + batch_boundary + "--\r\n";
+
+  http_response response {status_codes::Accepted};
+  response.set_body(reply, "multipart/mixed; boundary=" + batch_boundary);
+  return response;
+}
+
+http_response serve (const http_request& message) {
+  const uri request_uri {message.relative_uri()};
+  const string path {resource_path(request_uri)};
+  const map<string,string> query {query_of(request_uri)};
+  const string body {message.extract_string(true).get()};
+  string method {message.method()};
+  string if_match {};
+  string prefer {};
+  for (const auto& h : message.headers()) {
+    const string name {lower_case(h.first)};
+    if (name == "x-http-method" && method == methods::POST)
+      method = h.second;  // Tunnelled MERGE
+    else if (name == "if-match")
+      if_match = h.second;
+    else if (name == "prefer")
+      prefer = h.second;
+  }
+  bool echo {prefer != "return-no-content"};
+
+  if (path == "$batch" && method == methods::POST)
+    return serve_batch(message, query, body);
+  if (path == "Tables" || path.compare(0, 7, "Tables(") == 0)
+    return response_of(serve_tables(method, path, query, body, echo));
+
+  resource_t r {};
+  if ( ! parse_resource(path, r))
+    return response_of(failure(status_codes::BadRequest, "InvalidResourceName", "Bad resource " + path));
+  if (method == methods::GET)
+    return response_of(r.entity ? retrieve_entity(r, query) : query_entities(r.table, query));
+  return response_of(write_entity(r.table, op_of(method, r, if_match, body), query, echo));
+}
+
+// Whether to fail this request, as error_rate of them are
+bool inject_fault () {
+  if (error_rate <= 0.0)
+    return false;
+  std::lock_guard<std::mutex> guard {fault_lock};
+  return std::uniform_real_distribution<double> {0.0, 1.0}(fault_rng) < error_rate;
+}
+
+/*
+  Every request, whatever its method, as the protocol uses MERGE
+ */
+void handle_request (http_request message) {
+  const uint64_t id {++request_count};
+  http_response response {};
+  if (inject_fault())
+    response = response_of(failure(status_codes::ServiceUnavailable, "ServerBusy",
+                                   "The server is busy (injected fault)."));
+  else {
+    try {
+      response = serve(message);
+    }
+    catch (const std::invalid_argument& e) {
+      response = response_of(failure(status_codes::BadRequest, "InvalidInput", e.what()));
+    }
+    catch (const std::out_of_range& e) {
+      response = response_of(failure(status_codes::BadRequest, "InvalidInput", e.what()));
+    }
+    catch (const web::json::json_exception& e) {
+      response = response_of(failure(status_codes::BadRequest, "InvalidInput", e.what()));
+    }
+    catch (const std::exception& e) {
+      response = response_of(failure(status_codes::InternalError, "InternalError", e.what()));
+    }
+  }
+  response.headers().add("x-ms-request-id", std::to_string(id));
+  response.headers().add("x-ms-version", service_version);
+
+  if (reply_latency.count() <= 0) {
+    message.reply(response);
+    return;
+  }
+  shared_ptr<steady_timer> timer {make_shared<steady_timer>(crossplat::threadpool::shared_instance().service())};
+  timer->expires_from_now(reply_latency);
+  timer->async_wait([timer, message, response] (const boost::system::error_code&) { message.reply(response); });
+}
+
+/*
+  Main table server routine
+
+  Usage: tableserver [latency_ms [error_rate [seed [memory [seed_file] | disk directory]]]]
+
+  latency_ms delays every reply, after the request has been applied
+  (default 0).
+  error_rate is the fraction of requests that fail with 503
+  ServerBusy, before they are applied (default 0); seed seeds the
+  choice (default 276), so a run fails the same requests.
+  The tables are kept in memory, loaded from seed_file, or in files
+  in directory (see open_table_store()).
+
+  Wait for a carriage return, then shut the server down.
+ */
+int main (int argc, char const * argv[]) {
+  if (argc > 1)
+    reply_latency = milliseconds {std::strtol(argv[1], nullptr, 10)};
+  if (argc > 2)
+    error_rate = std::strtod(argv[2], nullptr);
+  if (argc > 3)
+    fault_rng.seed(std::strtoull(argv[3], nullptr, 10));
+  const string backend {argc > 4 ? argv[4] : "memory"};
+  if (backend != "memory" && backend != "disk") {
+    cerr << "TableServer: tables are kept in memory or on disk, not " << backend << endl;
+    return 1;
+  }
+  store = open_table_store(backend, argc > 5 ? argv[5] : "");
+
+  cout << "TableServer: Parsing connection string" << endl;
+  cloud_storage_account account {cloud_storage_account::parse(storage_connection_string)};
+  account_name = account.credentials().account_name();
+  const vector<uint8_t> key {account.credentials().account_key()};
+  account_key.assign(key.begin(), key.end());
+
+  const uri endpoint {tables_endpoint};
+  path_prefix = endpoint.path();
+  if ( ! path_prefix.empty() && path_prefix.back() == '/')
+    path_prefix.pop_back();
+  const string listen_url {endpoint.scheme() + "://" + endpoint.host() +
+                           (endpoint.port() > 0 ? ":" + std::to_string(endpoint.port()) : string {})};
+  cout << "TableServer: " << reply_latency.count() << " ms latency, " << error_rate << " of requests fail" << endl;
+
+  cout << "TableServer: Opening listener at " << listen_url << endl;
+  http_listener listener {listen_url};
+  listener.support(&handle_request);
+  listener.open().wait(); // Wait for listener to complete starting
+
+  cout << "Enter carriage return to stop TableServer." << endl;
+  string line;
+  getline(cin, line);
+
+  // Shut it down
+  listener.close().wait();
+  cout << "TableServer closed" << endl;
+}
@@ -0,0 +1,141 @@
+#include "TableStore.h"
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "AzureTableStore.h"
+#include "DiskTableStore.h"
+#include "MemoryTableStore.h"
+#include "Trace.h"
+#include "make_unique.h"
+
+#include "azure_keys.h"
+
+using std::cout;
+using std::endl;
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+using web::http::status_code;
+
+using azure::storage::table_entity;
+
+namespace {
+  /*
+    Records each call to the store it wraps as a span of the trace
+    open on the calling thread (see Trace.h), named for the call and
+    table, with the resulting status
+   */
+  class TracedTableStore : public TableStore {
+  private:
+    unique_ptr<TableStore> store;
+
+    static void record (TraceSpan& span, status_code status) {
+      span.set_status(std::to_string(status));
+    }
+  public:
+    explicit TracedTableStore (unique_ptr<TableStore> store) : store {std::move(store)} {};
+
+    bool exists (const string& table) override {
+      TraceSpan span {"exists " + table, "storage"};
+      return store->exists(table);
+    }
+
+    bool create_table (const string& table) override {
+      TraceSpan span {"create_table " + table, "storage"};
+      return store->create_table(table);
+    }
+
+    bool delete_table (const string& table) override {
+      TraceSpan span {"delete_table " + table, "storage"};
+      return store->delete_table(table);
+    }
+
+    status_code retrieve (const string& table, const string& partition, const string& row,
+                          table_entity& entity) override {
+      TraceSpan span {"retrieve " + table, "storage"};
+      status_code status {store->retrieve(table, partition, row, entity)};
+      record(span, status);
+      return status;
+    }
+
+    status_code write (const string& table, const store_op_t& op) override {
+      TraceSpan span {"write " + table, "storage"};
+      status_code status {store->write(table, op)};
+      record(span, status);
+      return status;
+    }
+
+    status_code write_batch (const string& table, const vector<store_op_t>& ops) override {
+      TraceSpan span {"write_batch " + table, "storage"};
+      status_code status {store->write_batch(table, ops)};
+      record(span, status);
+      return status;
+    }
+
+    status_code scan (const string& table, const scan_t& spec, const entity_fn& on_entity) override {
+      TraceSpan span {"scan " + table, "storage"};
+      status_code status {store->scan(table, spec, on_entity)};
+      record(span, status);
+      return status;
+    }
+
+    pair<status_code,string> get_token (const string& table, const string& partition, const string& row,
+                                        uint8_t permissions, const utility::datetime& expiry) override {
+      TraceSpan span {"get_token " + table, "storage"};
+      pair<status_code,string> result {store->get_token(table, partition, row, permissions, expiry)};
+      record(span, result.first);
+      return result;
+    }
+
+    status_code retrieve_with_token (const string& table, const string& token, const string& partition,
+                                     const string& row, table_entity& entity) override {
+      TraceSpan span {"retrieve_with_token " + table, "storage"};
+      status_code status {store->retrieve_with_token(table, token, partition, row, entity)};
+      record(span, status);
+      return status;
+    }
+
+    status_code write_with_token (const string& table, const string& token, const store_op_t& op) override {
+      TraceSpan span {"write_with_token " + table, "storage"};
+      status_code status {store->write_with_token(table, token, op)};
+      record(span, status);
+      return status;
+    }
+  };
+
+  /*
+    The memory and disk stores sign their tokens with the account's
+    connection string, which every server already shares and keeps secret
+   */
+  unique_ptr<TableStore> open_backend (const string& backend, const string& location) {
+    if (backend == "memory") {
+      unique_ptr<MemoryTableStore> store {std::make_unique<MemoryTableStore>(storage_connection_string)};
+      if ( ! location.empty()) {
+        store->load(location);
+        cout << "Loaded tables from " << location << endl;
+      }
+      cout << "Keeping tables in memory" << endl;
+      return std::move(store);
+    }
+    if (backend == "disk") {
+      if (location.empty())
+        throw std::runtime_error("The disk store needs a directory");
+      cout << "Keeping tables in " << location << endl;
+      return std::make_unique<DiskTableStore>(location, storage_connection_string);
+    }
+    return std::make_unique<AzureTableStore>(storage_connection_string, tables_endpoint);
+  }
+}
+
+unique_ptr<TableStore> open_table_store (const string& backend, const string& location) {
+  unique_ptr<TableStore> store {open_backend(backend, location)};
+  if (tracing())
+    return std::make_unique<TracedTableStore>(std::move(store));
+  return store;
+}
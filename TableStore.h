@@ -0,0 +1,124 @@
+#ifndef TableStore_h
+#define TableStore_h
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+#include <was/table.h>
+
+/*
+  One write to an entity
+
+  For merge, replace and remove, a non-empty ETag on entity makes the
+  write conditional on the entity not having changed since that ETag
+  was read; an empty ETag writes whatever the entity's current state.
+  For remove, only the keys and ETag of entity are used.
+ */
+struct store_op_t {
+  enum kind_t {insert, merge, insert_or_merge, insert_or_replace, replace, remove};
+  kind_t kind;
+  azure::storage::table_entity entity;
+};
+
+/*
+  The entities a scan visits, in partition then row order
+
+  partition: only this partition, or every partition if empty
+  low, high: only rows from low and up to high, each bound excluded
+    unless its _inclusive flag is set; an empty bound is open
+  below_prop, below_value: if below_prop is not empty, only entities
+    whose string property below_prop sorts before below_value
+  limit: stop after this many entities, or never if 0
+  start_partition, start_row: if start_partition is not empty, begin
+    at the entity (start_partition, start_row), as a query continuation does
+
+  Value-initialize (scan_t spec {}) and set the fields wanted.
+ */
+struct scan_t {
+  std::string partition;
+  std::string low;
+  bool low_inclusive;
+  std::string high;
+  bool high_inclusive;
+  std::string below_prop;
+  std::string below_value;
+  std::size_t limit;
+  std::string start_partition;
+  std::string start_row;
+};
+
+// Called for each entity of a scan; return false to end the scan early
+using entity_fn = std::function<bool(const azure::storage::table_entity&)>;
+
+/*
+  Storage for the tables that BasicServer and AuthServer serve
+
+  The servers program against this interface, not against Azure
+  Table Storage, so they can run on AzureTableStore or, without a
+  storage account, on MemoryTableStore or DiskTableStore.
+
+  Entity operations return the HTTP status that Azure Table Storage
+  would: OK on success, NotFound for a missing table or entity,
+  Conflict for inserting an entity that exists, PreconditionFailed
+  for a conditional write whose ETag no longer matches, Forbidden for
+  a token that does not permit the operation, and InternalError for
+  anything else. Every implementation is safe to call from many threads.
+ */
+class TableStore {
+public:
+  virtual ~TableStore () {};
+
+  virtual bool exists (const std::string& table) = 0;
+  // True if the table was created, false if it already existed
+  virtual bool create_table (const std::string& table) = 0;
+  // True if the table existed
+  virtual bool delete_table (const std::string& table) = 0;
+
+  // On OK, entity is the stored entity, with its current ETag
+  virtual web::http::status_code retrieve (const std::string& table, const std::string& partition,
+                                           const std::string& row, azure::storage::table_entity& entity) = 0;
+  virtual web::http::status_code write (const std::string& table, const store_op_t& op) = 0;
+  /*
+    Apply ops, which must all be to one partition and to different rows
+    (else BadRequest), as one transaction: if any op fails, none is
+    applied, and its status is returned
+   */
+  virtual web::http::status_code write_batch (const std::string& table, const std::vector<store_op_t>& ops) = 0;
+  virtual web::http::status_code scan (const std::string& table, const scan_t& spec, const entity_fn& on_entity) = 0;
+
+  /*
+    A token granting permissions, a bitwise OR of
+    table_shared_access_policy::permissions constants, to the single
+    entity (partition, row) of table until expiry
+   */
+  virtual std::pair<web::http::status_code,std::string>
+  get_token (const std::string& table, const std::string& partition, const std::string& row,
+             uint8_t permissions, const utility::datetime& expiry) = 0;
+  // retrieve() and write() as permitted by a token from get_token()
+  virtual web::http::status_code retrieve_with_token (const std::string& table, const std::string& token,
+                                                      const std::string& partition, const std::string& row,
+                                                      azure::storage::table_entity& entity) = 0;
+  virtual web::http::status_code write_with_token (const std::string& table, const std::string& token,
+                                                   const store_op_t& op) = 0;
+};
+
+/*
+  The store a server keeps its tables in, chosen on its command line
+
+  backend: "memory" for a MemoryTableStore, loaded from the seed file
+    location if that is not empty; "disk" for a DiskTableStore in the
+    directory location; anything else for the Azure account in azure_keys.h
+  If this process is tracing (see Trace.h), every call to the store
+  is recorded as a span; call start_tracing() first.
+  Throws std::runtime_error if the store cannot be opened.
+ */
+std::unique_ptr<TableStore> open_table_store (const std::string& backend, const std::string& location);
+
+#endif
@@ -0,0 +1,271 @@
+#include "Trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cpprest/base_uri.h>
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+using web::http::http_request;
+using web::http::uri;
+
+using web::json::value;
+
+const string traceparent_header {"traceparent"};
+
+namespace {
+  // Spans are buffered and appended to the file once this many bytes,
+  // or this much time, have built up
+  constexpr size_t flush_bytes {64 * 1024};
+  constexpr seconds flush_interval {1};
+
+  std::mutex trace_lock {};
+  int trace_fd {-1};
+  std::atomic<bool> enabled {false};
+  string pending {};
+  steady_clock::time_point last_flush {};
+
+  // Context of the span open on this thread
+  thread_local trace_context_t scope_context {};
+
+  string random_hex (size_t digits) {
+    static thread_local std::mt19937_64 gen {std::random_device {} ()};
+    static const char hex[] {"0123456789abcdef"};
+    string id (digits, '0');
+    uint64_t bits {0};
+    for (size_t i {0}; i < digits; ++i) {
+      if (i % 16 == 0)
+        bits = gen();
+      id[i] = hex[bits & 0xf];
+      bits >>= 4;
+    }
+    return id;
+  }
+
+  bool is_hex (const string& s) {
+    return s.find_first_not_of("0123456789abcdef") == string::npos &&
+      s.find_first_not_of('0') != string::npos;  // All zeros is invalid
+  }
+
+  // Small, stable number for the calling thread, for the tid of its events
+  uint64_t thread_number () {
+    static std::atomic<uint64_t> next {1};
+    static thread_local uint64_t number {next++};
+    return number;
+  }
+
+  // Called with trace_lock held
+  void write_pending () {
+    const char* p {pending.data()};
+    size_t left {pending.size()};
+    while (left > 0) {
+      ssize_t n {::write(trace_fd, p, left)};
+      if (n < 0)
+        break;
+      p += n;
+      left -= static_cast<size_t>(n);
+    }
+    pending.clear();
+    last_flush = steady_clock::now();
+  }
+
+  void append_event (const string& event) {
+    std::lock_guard<std::mutex> guard {trace_lock};
+    if (trace_fd < 0)
+      return;
+    pending += event;
+    if (pending.size() >= flush_bytes || steady_clock::now() - last_flush >= flush_interval)
+      write_pending();
+  }
+
+  // Writes the last spans when the process exits normally
+  struct exit_flush_t {
+    ~exit_flush_t () { flush_trace(); }
+  } exit_flush {};
+}
+
+string traceparent (const trace_context_t& context) {
+  if (context.trace_id.empty())
+    return string {};
+  return "00-" + context.trace_id + "-" + context.span_id + "-01";
+}
+
+/*
+  Only version 00 is understood: "00-<32 hex trace id>-<16 hex parent
+  id>-<2 hex flags>"
+ */
+trace_context_t parse_traceparent (const string& header) {
+  if (header.size() != 55 || header.compare(0, 3, "00-") != 0 || header[35] != '-' || header[52] != '-')
+    return trace_context_t {};
+  trace_context_t context {header.substr(3, 32), header.substr(36, 16)};
+  if ( ! is_hex(context.trace_id) || ! is_hex(context.span_id))
+    return trace_context_t {};
+  return context;
+}
+
+/*
+  The file is opened for appending, so several processes can share it.
+  Whichever finds it empty, under an exclusive lock, writes the opening
+  bracket; the array is never closed, which the format allows.
+ */
+bool start_tracing (const string& process_name) {
+  const char* path {std::getenv("TRACE_FILE")};
+  if (path == nullptr || *path == '\0')
+    return false;
+  int fd {::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)};
+  if (fd < 0) {
+    std::cerr << "Trace: cannot open " << path << std::endl;
+    return false;
+  }
+  struct stat st {};
+  ::flock(fd, LOCK_EX);
+  if (::fstat(fd, &st) == 0 && st.st_size == 0 && ::write(fd, "[\n", 2) < 0)
+    std::cerr << "Trace: cannot write " << path << std::endl;
+  ::flock(fd, LOCK_UN);
+
+  value args {value::object()};
+  args["name"] = value::string(process_name);
+  value meta {value::object()};
+  meta["name"] = value::string("process_name");
+  meta["ph"] = value::string("M");
+  meta["pid"] = value::number(static_cast<int64_t>(::getpid()));
+  meta["args"] = args;
+  {
+    std::lock_guard<std::mutex> guard {trace_lock};
+    if (trace_fd >= 0)
+      ::close(trace_fd);
+    trace_fd = fd;
+    pending = meta.serialize() + ",\n";
+    write_pending();
+  }
+  enabled = true;
+  std::cout << process_name << ": writing trace to " << path << std::endl;
+  return true;
+}
+
+bool tracing () {
+  return enabled;
+}
+
+void flush_trace () {
+  std::lock_guard<std::mutex> guard {trace_lock};
+  if (trace_fd >= 0 && ! pending.empty())
+    write_pending();
+}
+
+trace_context_t current_trace () {
+  return scope_context;
+}
+
+span_t begin_span (const string& name, const string& category, const trace_context_t& parent) {
+  span_t span {name, category, parent, string {}, string {}, system_clock::time_point {}, steady_clock::time_point {}};
+  if ( ! enabled)
+    return span;
+  span.parent_id = parent.span_id;
+  span.context.trace_id = parent.trace_id.empty() ? random_hex(32) : parent.trace_id;
+  span.context.span_id = random_hex(16);
+  span.start = system_clock::now();
+  span.started = steady_clock::now();
+  return span;
+}
+
+/*
+  A complete ("X") event. Timestamps are from the system clock, so
+  spans from different processes line up; durations are from the
+  steady clock.
+ */
+void end_span (const span_t& span) {
+  if ( ! enabled || span.started == steady_clock::time_point {})
+    return;
+  const int64_t duration {duration_cast<microseconds>(steady_clock::now() - span.started).count()};
+  value args {value::object()};
+  args["trace_id"] = value::string(span.context.trace_id);
+  args["span_id"] = value::string(span.context.span_id);
+  if ( ! span.parent_id.empty())
+    args["parent_id"] = value::string(span.parent_id);
+  if ( ! span.status.empty())
+    args["status"] = value::string(span.status);
+  value event {value::object()};
+  event["name"] = value::string(span.name);
+  event["cat"] = value::string(span.category);
+  event["ph"] = value::string("X");
+  event["ts"] = value::number(static_cast<int64_t>(
+    duration_cast<microseconds>(span.start.time_since_epoch()).count()));
+  event["dur"] = value::number(duration);
+  event["pid"] = value::number(static_cast<int64_t>(::getpid()));
+  event["tid"] = value::number(thread_number());
+  event["args"] = args;
+  append_event(event.serialize() + ",\n");
+}
+
+TraceScope::TraceScope (const trace_context_t& context) :
+  saved {scope_context}
+{
+  scope_context = context;
+}
+
+TraceScope::~TraceScope () {
+  scope_context = saved;
+}
+
+TraceSpan::TraceSpan (const string& name, const string& category) :
+  TraceSpan {name, category, scope_context}
+{}
+
+TraceSpan::TraceSpan (const string& name, const string& category, const trace_context_t& parent) :
+  span {begin_span(name, category, parent)},
+  scope {span.context}
+{}
+
+namespace {
+  // "PUT UpdateStatus": the method and first path segment, leaving out user ids and keys
+  string handler_name (const http_request& message) {
+    if ( ! enabled)
+      return string {};
+    const vector<string> paths {uri::split_path(uri::decode(message.relative_uri().path()))};
+    return message.method() + " " + (paths.empty() ? string {"/"} : paths[0]);
+  }
+
+  trace_context_t caller_context (const http_request& message) {
+    const web::http::http_headers& headers {message.headers()};
+    auto found (headers.find(traceparent_header));
+    return found == headers.end() ? trace_context_t {} : parse_traceparent(found->second);
+  }
+}
+
+TraceSpan::TraceSpan (const http_request& message) :
+  TraceSpan {handler_name(message), "server", caller_context(message)}
+{}
+
+TraceSpan::~TraceSpan () {
+  end_span(span);
+}
+
+void TraceSpan::set_status (const string& status) {
+  span.status = status;
+}
@@ -0,0 +1,127 @@
+#ifndef Trace_h
+#define Trace_h
+
+#include <chrono>
+#include <string>
+
+#include <cpprest/http_msg.h>
+
+/*
+  Distributed tracing
+
+  A trace follows one client request through every server it reaches.
+  Each piece of work along the way is a span: a handler serving a
+  request, a call to another server, or a call to table storage. Spans
+  know their trace and the span that caused them, so a slow UpdateStatus
+  can be broken down hop by hop.
+
+  A handler opens a TraceSpan for its incoming message. The trace and
+  parent come from the message's traceparent header (W3C Trace
+  Context); a message without one, such as a request from a client to
+  UserServer, starts a new trace. do_request() and its relatives send
+  the traceparent of the span open on the calling thread, each call
+  recorded as a span of its own.
+
+  Spans are written only in a process that has called start_tracing()
+  with TRACE_FILE set in its environment. They are appended to that
+  file in the Chrome trace event format (JSON array form), one line
+  per span, with microsecond timestamps from the system clock, so the
+  servers on a machine can share one file and it loads as is into
+  chrome://tracing or Perfetto. The trace and span ids are in each
+  event's args. A process that is not tracing still passes on the
+  traceparent it received.
+ */
+
+// Ids of a span and its trace, as hex; an empty trace_id means untraced
+struct trace_context_t {
+  std::string trace_id;
+  std::string span_id;
+};
+
+// Header carrying the caller's trace context to the receiver
+extern const std::string traceparent_header;
+
+// Value of traceparent_header for context, or an empty string if untraced
+std::string traceparent (const trace_context_t& context);
+
+// Context of a traceparent_header value, untraced if it is not valid
+trace_context_t parse_traceparent (const std::string& header);
+
+/*
+  Write spans to the file named by TRACE_FILE, if set, labelling this
+  process process_name in it. Returns whether spans are being written.
+ */
+bool start_tracing (const std::string& process_name);
+
+bool tracing ();
+
+// Write out the spans not yet in the file; also done at exit
+void flush_trace ();
+
+/*
+  A span begun but not yet recorded, for work that finishes on another
+  thread, such as an asynchronous request
+ */
+struct span_t {
+  std::string name;
+  std::string category;
+  trace_context_t context;
+  std::string parent_id;
+  std::string status;  // Recorded with the span if not empty
+  std::chrono::system_clock::time_point start;
+  std::chrono::steady_clock::time_point started;
+};
+
+// Context of the span open on this thread
+trace_context_t current_trace ();
+
+/*
+  Begin a child of parent. If this process is not tracing, the span is
+  never recorded and its context is parent's, to be passed on.
+ */
+span_t begin_span (const std::string& name, const std::string& category, const trace_context_t& parent);
+
+void end_span (const span_t& span);
+
+/*
+  Context of the span open on this thread while the scope is alive
+
+  Used to carry a span's context to work continuing on another thread.
+ */
+class TraceScope {
+private:
+  trace_context_t saved;
+public:
+  explicit TraceScope (const trace_context_t& context);
+  ~TraceScope ();
+
+  TraceScope (const TraceScope&) = delete;
+  TraceScope& operator= (const TraceScope&) = delete;
+};
+
+/*
+  A span covering the lifetime of the object, open on this thread
+  until then, and recorded when it ends
+ */
+class TraceSpan {
+private:
+  span_t span;
+  TraceScope scope;
+public:
+  // A child of the span open on this thread
+  TraceSpan (const std::string& name, const std::string& category);
+
+  TraceSpan (const std::string& name, const std::string& category, const trace_context_t& parent);
+
+  // A handler serving message, named for its method and operation
+  explicit TraceSpan (const web::http::http_request& message);
+
+  ~TraceSpan ();
+
+  TraceSpan (const TraceSpan&) = delete;
+  TraceSpan& operator= (const TraceSpan&) = delete;
+
+  void set_status (const std::string& status);
+};
+
+#endif
@@ -2,11 +2,18 @@
  User Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
 #include <exception>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -24,6 +31,8 @@
 #include "ServerUtils.h"
 #include "ClientUtils.h"
 #include "make_unique.h"
+#include "Trace.h"
+#include "WorkScheduler.h"
 
 using azure::storage::cloud_storage_account;
 using azure::storage::storage_credentials;
@@ -48,11 +57,16 @@ using std::getline;
 using std::make_pair;
 using std::pair;
 using std::string;
+using std::size_t;
 using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 using std::tuple;
 using std::get;
 using std::make_tuple;
+using std::function;
+
+using std::chrono::steady_clock;
 
 using web::http::http_headers;
 using web::http::http_request;
@@ -94,6 +108,25 @@ const string update_status {"UpdateStatus"};
 const string push_status {"PushStatus"};
 const string add_friend_user{"AddFriend"};
 const string un_friend_user{"UnFriend"};
+const string read_updates{"ReadUpdates"};
+const string subscribe{"Subscribe"};
+const string push_watermark{"Watermark"};
+const string read_entity_range {"ReadEntityRangeAdmin"};
+
+// Timeline entries ReadUpdates returns per page by default, and at most
+constexpr int default_updates_page {50};
+constexpr int max_updates_page {200};
+
+// How often ReadUpdates rereads the high-degree authors (0 for every
+// read; set from the command line), and how many BasicServer returns per read
+std::chrono::seconds high_degree_refresh {60};
+constexpr size_t high_degree_page {1000};
+
+// Most outboxes ReadUpdates reads at once
+constexpr size_t max_outbox_reads {8};
+
+// Longest a Subscribe may wait: PushServer's longest poll, plus a margin
+const std::chrono::milliseconds max_subscribe_time {65000};
 
 const string data_table_name {"DataTable"};
 const string auth_table_name {"AuthTable"};
@@ -105,51 +138,116 @@ const string token_prop {"token"};
 
 const string auth_table_partition {"Userid"};
 
+// Number of times a conditional friends-list write is retried after
+// losing a race with another write to the same entity
+constexpr int max_friends_update_attempts {8};
+
+/*
+  Workers that run the handlers. ReadUpdates, which reads the timeline
+  and the outboxes of high-degree friends, is bulk and may hold at most
+  bulk_workers of them; SignOn, ReadFriendList and the rest stay
+  responsive while many feeds are being read.
+ */
+enum work_class {interactive_work, bulk_work};
+constexpr size_t request_workers {16};
+constexpr size_t bulk_workers {12};
+WorkScheduler scheduler {{
+    work_class_t {"interactive", 4, request_workers, 10000},
+    work_class_t {"bulk", 1, bulk_workers, 1000}}};
+
 // Unordered map of users currently signed in
 unordered_map<string,tuple<string,string,string>> usersSignedIn;
+// Held by every access; handlers run on several scheduler workers at once
+critical_section_t signed_in_lock {};
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
+  Copy the token, partition and row of a signed-in user into data.
+  Returns false if user_id is not signed in.
+ */
+bool signed_in_user (const string& user_id, tuple<string,string,string>& data) {
+  scoped_critical_section_t lock {signed_in_lock};
+  auto it = usersSignedIn.find(user_id);
+  if (it == usersSignedIn.end())
+    return false;
+  data = it->second;
+  return true;
+}
+
+// Authors whose outboxes ReadUpdates merges in, and when they were read
+unordered_set<string> high_degree_cache {};
+steady_clock::time_point high_degree_read {};
+critical_section_t high_degree_lock {};
 
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
+/*
+  The friends lists of high-degree authors, as "<country>;<name>", so
+  ReadUpdates need not read an author's whole list on every call to
+  see whether the author lists the reader
  */
-unordered_map<string,string> get_json_body(http_request message) {
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-	  {
-            json = v;
-	    return true;
-	  })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-	results[v.first] = v.second.as_string();
-      }
-      else {
-	results[v.first] = v.second.serialize();
-      }
-    }
+struct author_readers_t {
+  unordered_set<string> readers;
+  steady_clock::time_point read;
+};
+unordered_map<string,author_readers_t> author_readers_cache {};
+critical_section_t author_readers_lock {};
+
+/*
+  Apply a modification to a signed-in user's friends list
+
+  The list is read along with its entity's ETag, passed to modify,
+  and written back with If-Match set to that ETag. If another request
+  changed the entity in between, BasicServer answers PreconditionFailed
+  and the whole read-modify-write is retried against the fresh list.
+  This way concurrent AddFriend/UnFriend calls for one user never
+  overwrite each other's changes.
+
+  modify returns false if the list needs no change, in which case
+  nothing is written.
+
+  Returns OK if the list was written or needed no change, the status of
+  a failed read or write, or Conflict if every attempt lost its race.
+ */
+status_code update_friends_list (const string& token, const string& partition, const string& row,
+                                 function<bool (friends_list_t&)> modify) {
+  const string entity_url {data_table_name + "/" + token + "/" + partition + "/" + row};
+  for (int attempt {0}; attempt < max_friends_update_attempts; ++attempt) {
+    header_vals_t read_headers {};
+    pair<status_code,value> result {
+      do_request(methods::GET, basic_def_url + "/" + read_entity_auth + "/" + entity_url,
+                 value {}, header_vals_t {}, read_headers)
+    };
+    if (result.first != status_codes::OK)
+      return result.first;
+
+    friends_list_t friends_list_val {parse_friends_list(get_json_object_string(result.second, "Friends"))};
+    if ( ! modify(friends_list_val))
+      return status_codes::OK;
+
+    value friend_json_object {build_json_value ("Friends", encode_friends_list(friends_list_val))};
+    header_vals_t write_headers {};
+    auto etag (read_headers.find("ETag"));
+    if (etag != read_headers.end())
+      write_headers["If-Match"] = etag->second;
+    header_vals_t resp_headers {};
+    pair<status_code,value> write_result {
+      do_request(methods::PUT, basic_def_url + "/" + update_entity_auth + "/" + entity_url,
+                 friend_json_object, write_headers, resp_headers)
+    };
+    if (write_result.first != status_codes::PreconditionFailed)
+      return write_result.first;
+    cout << "Friends list for " << partition << "/" << row << " changed concurrently, retrying" << endl;
   }
-  return results;
+  return status_codes::Conflict;
 }
 
 /*
   Top-level routine for processing all HTTP POST requests.
  */
 void handle_post(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
+  DeadlineScope deadline_scope {deadline};
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** POST " << path << endl;
   auto paths = uri::split_path(path);
@@ -163,14 +261,8 @@ void handle_post(http_request message) {
   string userid_name {paths[1]};
 
   // Flag for user in usersSignedIn
-  bool userFound {false};
-
-  // Look for user in usersSignedIn
-  for ( auto it = usersSignedIn.begin(); it != usersSignedIn.end(); ++it ) {
-    if ( it->first == userid_name ) {
-      userFound = true;
-    }
-  }
+  tuple<string,string,string> signedInData {};
+  bool userFound {signed_in_user(userid_name, signedInData)};
 
   unordered_map<string,string> json_body {get_json_body (message)};
   string passFromBody {json_body["Password"]};
@@ -249,6 +341,7 @@ void handle_post(http_request message) {
       // Once token has been created and user is confirmed to be in data table,
       // add user to usersSignedIn
       if ( !userFound ) {
+        scoped_critical_section_t lock {signed_in_lock};
         usersSignedIn.insert(
         {userid_name, make_tuple( dataToken->second,
                           dataPartition->second, dataRow->second )} );
@@ -291,14 +384,12 @@ void handle_post(http_request message) {
 
   else if ( paths[0] == sign_off ) {
 
-    // Check if user is signed in
-    auto isUserSignedIn {usersSignedIn.find( userid_name )};
-
     if( !userFound ) {
       message.reply(status_codes::NotFound);
       return;
     }
 
+    scoped_critical_section_t lock {signed_in_lock};
     auto isUserRemoved {usersSignedIn.erase( userid_name )};
 
     if( isUserRemoved.size() == 1 ) {
@@ -312,10 +403,119 @@ void handle_post(http_request message) {
 
 }
 
+/*
+  Whether the high-degree author lists reader, both as "<country>;<name>",
+  going by the author's friends list as read within high_degree_refresh.
+  Returns false if the list has not been read that recently.
+ */
+bool cached_reader (const string& author, const string& reader, bool& listed) {
+  scoped_critical_section_t lock {author_readers_lock};
+  auto cached (author_readers_cache.find(author));
+  if (cached == author_readers_cache.end() || steady_clock::now() - cached->second.read >= high_degree_refresh)
+    return false;
+  listed = cached->second.readers.find(reader) != cached->second.readers.end();
+  return true;
+}
+
+/*
+  Cache the friends on the list of the author's entity, as read from
+  DataTable, and return whether they include reader
+ */
+bool cache_readers (const string& author, const value& entity, const string& reader) {
+  friends_view_t friends {};
+  try {
+    friends = parse_friends_view(get_json_object_string(entity, "Friends"));
+  }
+  catch (const std::invalid_argument& e) {
+    cout << "ReadUpdates: " << e.what() << endl;
+    return false;
+  }
+  author_readers_t readers {unordered_set<string> {}, steady_clock::now()};
+  for (const auto& f : friends)
+    readers.readers.insert(f.first.to_string() + pair_delimiter + f.second.to_string());
+  bool listed {readers.readers.find(reader) != readers.readers.end()};
+  scoped_critical_section_t lock {author_readers_lock};
+  author_readers_cache[author] = std::move(readers);
+  return listed;
+}
+
+/*
+  URL reading up to limit entries of name's timeline (or outbox) in
+  table, after the time key since, or from the start if since is empty
+ */
+string timeline_range_url (const string& table, const string& partition, const string& name,
+                           const string& since, int limit) {
+  string after {since.empty() ? timeline_rows_after(name) : timeline_row(name, since)};
+  return basic_def_url + "/" + read_entity_range + "/" + table + "/" + partition + "/" +
+    after + "/" + timeline_rows_before(name) + "?limit=" + std::to_string(limit);
+}
+
+/*
+  Authors listed in the high-degree table, as "<country>;<name>".
+  The list changes rarely, so it is read from BasicServer at most
+  once per high_degree_refresh, or on every call if that is zero.
+ */
+unordered_set<string> high_degree_authors () {
+  {
+    scoped_critical_section_t lock {high_degree_lock};
+    if (high_degree_refresh.count() > 0 && high_degree_read != steady_clock::time_point {} &&
+        steady_clock::now() - high_degree_read < high_degree_refresh)
+      return high_degree_cache;
+  }
+
+  unordered_set<string> authors {};
+  string after {"*"};
+  for (;;) {
+    // Take the rows as they arrive rather than holding the whole page
+    size_t rows {0};
+    bool malformed {false};
+    status_code code {status_codes::OK};
+    try {
+      code = do_request_each(methods::GET, basic_def_url + "/" + read_entity_range + "/" + high_degree_table_name + "/" +
+                             high_degree_partition + "/" + after + "/*",
+                             [&after, &authors, &rows, &malformed] (const value& e) -> bool {
+                               const string& row {get_json_object_string(e, "Row")};
+                               if (row.empty()) {
+                                 malformed = true;
+                                 return false;
+                               }
+                               after = row;
+                               authors.insert(after);
+                               ++rows;
+                               return true;
+                             });
+    }
+    catch (const std::exception& e) {
+      cout << "High-degree authors: " << e.what() << endl;
+      code = status_codes::ServiceUnavailable;
+    }
+    // NotFound: no author has gone over the threshold yet
+    if (code == status_codes::NotFound)
+      break;
+    if (code != status_codes::OK || malformed) {
+      // Keep the list we had; try again on the next read
+      scoped_critical_section_t lock {high_degree_lock};
+      return high_degree_cache;
+    }
+    if (rows < high_degree_page)
+      break;
+  }
+
+  scoped_critical_section_t lock {high_degree_lock};
+  high_degree_cache = authors;
+  high_degree_read = steady_clock::now();
+  return authors;
+}
+
 /*
   Top-level routine for processing all HTTP GET requests.
  */
 void handle_get(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
+  DeadlineScope deadline_scope {deadline};
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** GET " << path << endl;
   auto paths = uri::split_path(path);
@@ -328,15 +528,9 @@ void handle_get(http_request message) {
   string user_id {paths[1]};
 
   if(paths[0] == read_friend_list){
-    // Flag for user in usersSignedIn
-    bool userFound {false};
-
-    // Look for user in usersSignedIn
-    for ( auto it = usersSignedIn.begin(); it != usersSignedIn.end(); ++it ) {
-      if ( it->first == user_id ) {
-        userFound = true;
-      }
-    }
+    // Token, partition and row of the user, if signed in
+    tuple<string,string,string> signedInData {};
+    bool userFound {signed_in_user(user_id, signedInData)};
 
     if (!userFound){
       message.reply(status_codes::Forbidden);
@@ -344,21 +538,232 @@ void handle_get(http_request message) {
     }
     //if user signed in, get friend list
     else{
-      string dataToken = get<0>(usersSignedIn[user_id]);
-      string dataPartition = get<1>(usersSignedIn[user_id]);
-      string dataRow = get<2>(usersSignedIn[user_id]);
+      string dataToken = get<0>(signedInData);
+      string dataPartition = get<1>(signedInData);
+      string dataRow = get<2>(signedInData);
 
+      // A read is safe to repeat, so hedge it against a slow BasicServer
       pair<status_code,value> result {
         do_request(methods::GET, basic_def_url + "/" + read_entity_auth + "/" +
-        data_table_name + "/" + dataToken + "/" + dataPartition + "/" + dataRow)
+        data_table_name + "/" + dataToken + "/" + dataPartition + "/" + dataRow,
+        value {}, call_opts_t {default_request_timeout, true})
       };
 
       string friends_list = get_json_object_prop(result.second, "Friends");
+      // Clients always get the text form
+      if (is_compact_friends_list(friends_list)) {
+        try {
+          friends_list = friends_list_to_string(parse_friends_list(friends_list));
+        }
+        catch (const std::invalid_argument& e) {
+          cout << "ReadFriendList: " << e.what() << endl;
+          message.reply(status_codes::InternalError);
+          return;
+        }
+      }
       value json_friends {build_json_value (vector<pair<string,string>> {make_pair("Friends", friends_list)})};
       message.reply(status_codes::OK, json_friends);
       return;
     }
   }
+  /*
+    A page of the user's timeline, oldest first:
+      GET ReadUpdates/<userid>[?since=<cursor>&limit=<n>]
+    Returns {"Updates": [{"Time", "Author", "Status"}...], "Next": <cursor>}.
+    Pass Next as since to get the entries after this page.
+
+    Entries are keyed by when PushServer accepted them but written
+    later, so Next never passes PushServer's watermark, read before the
+    entries: past it, an entry may still be written before ones already
+    returned. Updates after Next come again on the next page, with the
+    same Time. If any timeline, outbox or friends list cannot be read,
+    the reply is its status (or ServiceUnavailable) rather than a page
+    that may lack its entries.
+   */
+  if(paths[0] == read_updates){
+    tuple<string,string,string> signedInData {};
+    if ( ! signed_in_user(user_id, signedInData)){
+      message.reply(status_codes::Forbidden);
+      return;
+    }
+    string dataPartition = get<1>(signedInData);
+    string dataRow = get<2>(signedInData);
+
+    auto query_params = uri::split_query(message.relative_uri().query());
+    string since {};
+    auto since_param (query_params.find("since"));
+    if (since_param != query_params.end())
+      since = uri::decode(since_param->second);
+    int limit {default_updates_page};
+    auto limit_param (query_params.find("limit"));
+    if (limit_param != query_params.end())
+      limit = std::atoi(uri::decode(limit_param->second).c_str());
+    if (limit <= 0 || limit > max_updates_page)
+      limit = default_updates_page;
+
+    // The user's own timeline, then the outbox of each friend
+    // whose statuses are not pushed because they have too many friends,
+    // then the entities of those friends whose lists are not cached
+    vector<request_spec_t> reads {
+      request_spec_t {methods::GET, timeline_range_url(timeline_table_name, dataPartition, dataRow, since, limit), value {}}};
+    const string reader {dataPartition + pair_delimiter + dataRow};
+    vector<string> outbox_authors {};
+    vector<string> reread_authors {};
+    vector<request_spec_t> author_reads {};
+    // Friendship is one way, and an author's statuses are pushed to the
+    // friends on the author's list, so an outbox is merged in only if
+    // the author lists the user too
+    unordered_map<string,bool> listed {};
+    unordered_set<string> authors {high_degree_authors()};
+    if ( ! authors.empty()){
+      string dataToken = get<0>(signedInData);
+      pair<status_code,value> friends {
+        do_request(methods::GET, basic_def_url + "/" + read_entity_auth + "/" +
+                   data_table_name + "/" + dataToken + "/" + dataPartition + "/" + dataRow)};
+      if (friends.first != status_codes::OK){
+        message.reply(friends.first);
+        return;
+      }
+      const string& friends_prop {get_json_object_string(friends.second, "Friends")};
+      friends_view_t friends_list {};
+      try {
+        friends_list = parse_friends_view(friends_prop);
+      }
+      catch (const std::invalid_argument& e) {
+        cout << "ReadUpdates: " << e.what() << endl;
+      }
+      for (const auto& f : friends_list){
+        // "country;name", as high_degree_authors() has it; the compact
+        // form does not store the two next to each other
+        string author {f.first.to_string() + pair_delimiter + f.second.to_string()};
+        if (authors.find(author) == authors.end())
+          continue;
+        bool lists {false};
+        if ( ! cached_reader(author, reader, lists)){
+          reread_authors.push_back(author);
+          author_reads.push_back(request_spec_t {methods::GET,
+                basic_def_url + "/" + read_entity + "/" + data_table_name + "/" +
+                f.first.to_string() + "/" + f.second.to_string(),
+                value {}});
+        }
+        else if ( ! lists)
+          continue;
+        listed[author] = lists;
+        outbox_authors.push_back(author);
+        reads.push_back(request_spec_t {methods::GET,
+              timeline_range_url(outbox_table_name, f.first.to_string(), f.second.to_string(), since, limit),
+              value {}});
+      }
+    }
+    const size_t outboxes {outbox_authors.size()};
+    reads.insert(reads.end(), author_reads.begin(), author_reads.end());
+    pair<status_code,value> mark {do_request(methods::GET, push_def_url + "/" + push_watermark)};
+    const string watermark {get_json_object_string(mark.second, "Watermark")};
+    if (mark.first != status_codes::OK || watermark.empty()){
+      cout << "ReadUpdates: watermark read failed: " << mark.first << endl;
+      message.reply(status_codes::ServiceUnavailable);
+      return;
+    }
+    vector<req_res_t> results {do_requests (reads, max_outbox_reads)};
+    for (size_t k {0}; k < reread_authors.size(); ++k){
+      const req_res_t& author {results[1 + outboxes + k]};
+      if (author.first != status_codes::OK){
+        cout << "ReadUpdates: friends list read failed: " << author.first << endl;
+        message.reply(status_codes::ServiceUnavailable);
+        return;
+      }
+      listed[reread_authors[k]] = cache_readers(reread_authors[k], author.second, reader);
+    }
+
+    // NotFound: nothing has been pushed yet, so there is no timeline table
+    if (results[0].first != status_codes::OK && results[0].first != status_codes::NotFound){
+      message.reply(results[0].first);
+      return;
+    }
+
+    // Every source returned its first limit entries after since, so the
+    // first limit entries of them all are the page.
+    vector<value> entries {};
+    for (size_t i {0}; i <= outboxes; ++i){
+      // No table yet, as above, or no outbox table until some author
+      // has too many friends
+      if (results[i].first == status_codes::NotFound)
+        continue;
+      if (results[i].first != status_codes::OK || ! results[i].second.is_array()){
+        cout << "ReadUpdates: outbox read failed: " << results[i].first << endl;
+        message.reply(status_codes::ServiceUnavailable);
+        return;
+      }
+      if (i > 0 && ! listed[outbox_authors[i - 1]])
+        continue;
+      for (const auto& e : results[i].second.as_array())
+        entries.push_back(e);
+    }
+    std::sort(entries.begin(), entries.end(), [] (const value& a, const value& b) -> bool {
+        return get_json_object_string(a, "Time") < get_json_object_string(b, "Time");
+      });
+    if (entries.size() > static_cast<size_t>(limit))
+      entries.resize(limit);
+
+    vector<value> updates {};
+    string next {since};
+    for (const auto& e : entries){
+      next = get_json_object_string(e, "Time");
+      updates.push_back(value::object (prop_vals_t {
+            make_pair("Time", value::string(next)),
+            make_pair("Author", value::string(get_json_object_string(e, "Author"))),
+            make_pair("Status", value::string(get_json_object_string(e, "Status")))}));
+    }
+    if (next > watermark)
+      next = std::max(since, watermark);
+    message.reply(status_codes::OK,
+                  value::object (prop_vals_t {
+                      make_pair("Updates", value::array(updates)),
+                      make_pair("Next", value::string(next))}));
+    return;
+  }
+  /*
+    Wait for new statuses from friends, as a long poll:
+      GET Subscribe/<userid>[?after=<seq>&timeout=<ms>]
+    Returns {"Events": [...], "Next": <seq>} as soon as PushServer has
+    accepted a status for the user, or with no events after the timeout.
+    Each event is one status; the timeline may later hold it coalesced
+    with others from the same author.
+   */
+  if(paths[0] == subscribe){
+    tuple<string,string,string> signedInData {};
+    if ( ! signed_in_user(user_id, signedInData)){
+      message.reply(status_codes::Forbidden);
+      return;
+    }
+    string dataPartition = get<1>(signedInData);
+    string dataRow = get<2>(signedInData);
+    string query {message.relative_uri().query()};
+    // The poll holds the connection open for its timeout, so it gets a
+    // deadline and a client of its own, and this thread is not held
+    // while it waits
+    call_opts_t poll_opts {max_subscribe_time};
+    poll_opts.long_poll = true;
+    do_request_async(methods::GET,
+                     push_def_url + "/" + subscribe + "/" + dataPartition + "/" + dataRow +
+                     (query.empty() ? string {} : "?" + query),
+                     value {}, poll_opts)
+      .then([message] (pplx::task<req_res_t> poll)
+            {
+              try {
+                req_res_t result {poll.get()};
+                if (result.first == status_codes::OK)
+                  message.reply(status_codes::OK, result.second);
+                else
+                  message.reply(result.first);
+              }
+              catch (const std::exception& e) {
+                cout << "Subscribe: " << e.what() << endl;
+                message.reply(status_codes::ServiceUnavailable);
+              }
+            });
+    return;
+  }
   //to return bad request because of unrecognized request
   message.reply(status_codes::BadRequest);
   return;
@@ -368,6 +773,11 @@ void handle_get(http_request message) {
   Top-level routine for processing all HTTP PUT requests.
  */
 void handle_put(http_request message) {
+  TraceSpan trace_span {message};
+  deadline_t deadline {request_deadline(message)};
+  if (reply_if_expired(message, deadline))
+    return;
+  DeadlineScope deadline_scope {deadline};
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** PUT " << path << endl;
   auto paths = uri::split_path(path);
@@ -381,15 +791,9 @@ void handle_put(http_request message) {
   string status {paths[2]};
 
   if(paths[0] == update_status){
-    // Flag for user in usersSignedIn
-    bool userFound {false};
-
-    // Look for user in usersSignedIn
-    for ( auto it = usersSignedIn.begin(); it != usersSignedIn.end(); ++it ) {
-      if ( it->first == user_id ) {
-        userFound = true;
-      }
-    }
+    // Token, partition and row of the user, if signed in
+    tuple<string,string,string> signedInData {};
+    bool userFound {signed_in_user(user_id, signedInData)};
 
     if (!userFound){
       message.reply(status_codes::Forbidden);
@@ -397,30 +801,75 @@ void handle_put(http_request message) {
     }
     // If user signed in, update status
     else{
-      string dataToken = get<0>(usersSignedIn[user_id]);
-      string dataPartition = get<1>(usersSignedIn[user_id]);
-      string dataRow = get<2>(usersSignedIn[user_id]);
-
-      pair<status_code,value> result {
-        do_request(methods::GET, basic_def_url + "/" + read_entity_auth + "/" +
+      string dataToken = get<0>(signedInData);
+      string dataPartition = get<1>(signedInData);
+      string dataRow = get<2>(signedInData);
+
+      // Reading the friends list and writing the status are independent,
+      // so issue both before waiting on either
+      pplx::task<req_res_t> friends_read {
+        do_request_async(methods::GET, basic_def_url + "/" + read_entity_auth + "/" +
         data_table_name + "/" + dataToken + "/" + dataPartition + "/" + dataRow)
       };
 
       value json_status {build_json_value (vector<pair<string,string>> {make_pair("Status", status)})};
-      pair<status_code,value> result2 {
-        do_request(methods::PUT, basic_def_url + "/" + update_entity_auth + "/" +
+      pplx::task<req_res_t> status_write {
+        do_request_async(methods::PUT, basic_def_url + "/" + update_entity_auth + "/" +
         data_table_name + "/" + dataToken + "/" + dataPartition + "/" + dataRow, json_status)
       };
 
+      // Join both before acting on either, so a failure of one does not
+      // leave the other's exception unobserved. A passed deadline or an
+      // open breaker comes back as a status, not an exception, and
+      // either failure means there is nothing to push.
+      bool failed {false};
+      pair<status_code,value> result {};
+      pair<status_code,value> written {};
+      try {
+        result = friends_read.get();
+      } catch (const std::exception& e) {
+        cout << "UpdateStatus: reading friends: " << e.what() << endl;
+        failed = true;
+      }
+      try {
+        written = status_write.get();
+      } catch (const std::exception& e) {
+        cout << "UpdateStatus: writing status: " << e.what() << endl;
+        failed = true;
+      }
+      if (failed) {
+        message.reply(status_codes::InternalError);
+        return;
+      }
+      if (written.first != status_codes::OK) {
+        cout << "UpdateStatus: writing status: " << written.first << endl;
+        message.reply(written.first);
+        return;
+      }
+      if (result.first != status_codes::OK) {
+        cout << "UpdateStatus: reading friends: " << result.first << endl;
+        message.reply(result.first);
+        return;
+      }
+
       string friends_list = get_json_object_prop(result.second, "Friends");
       value json_friends {build_json_value (vector<pair<string,string>> {make_pair("Friends", friends_list)})};
 
       try {
+        // The key lets a retried POST through without the status
+        // being pushed twice
+        header_vals_t push_headers {{idempotency_key_header, new_idempotency_key()}};
+        header_vals_t push_resp_headers {};
         pair<status_code,value> result3 {
           do_request(methods::POST, push_def_url + "/" + push_status + "/" +
-          dataPartition + "/" + dataRow + "/" + status, json_friends)
+          dataPartition + "/" + dataRow + "/" + status, json_friends, push_headers, push_resp_headers)
         };
-      } catch (const web::uri_exception& e) {
+        // PushServer's circuit breaker is open
+        if (result3.first == status_codes::ServiceUnavailable) {
+          message.reply(status_codes::ServiceUnavailable);
+          return;
+        }
+      } catch (const std::exception& e) { // uri_exception or http_exception: PushServer unreachable
         message.reply(status_codes::ServiceUnavailable);
         return;
       }
@@ -439,16 +888,9 @@ void handle_put(http_request message) {
     string friend_full_name{paths[3]};
 
     //check if user is signed in
-    // Flag for user in usersSignedIn
-    bool userFound {false};
-
-    // Look for user in usersSignedIn
-    for ( auto it = usersSignedIn.begin(); it != usersSignedIn.end(); ++it ) {
-
-      if ( it->first == user_id ) {
-        userFound = true;
-      }
-    }
+    // Token, partition and row of the user, if signed in
+    tuple<string,string,string> signedInData {};
+    bool userFound {signed_in_user(user_id, signedInData)};
 
     if( !userFound ){
       //not signed-in
@@ -457,53 +899,31 @@ void handle_put(http_request message) {
     }
 
     else{ //user is signed-in
-      string friend_token = get<0>(usersSignedIn[user_id]);
-      string friend_partition = get<1>(usersSignedIn[user_id]);
-      string friend_row = get<2>(usersSignedIn[user_id]);
-
-      pair<status_code,value> result {
-        do_request(methods::GET, basic_def_url + "/" + read_entity_auth+"/"+
-          data_table_name+"/"+friend_token+"/"+friend_partition+"/"+friend_row)
+      string friend_token = get<0>(signedInData);
+      string friend_partition = get<1>(signedInData);
+      string friend_row = get<2>(signedInData);
+
+      status_code result {
+        update_friends_list(friend_token, friend_partition, friend_row,
+                            [&friend_country, &friend_full_name] (friends_list_t& friends_list_val) -> bool {
+          for(int i = 0; i < friends_list_val.size(); ++i){
+            if(friends_list_val[i].first == friend_country && friends_list_val[i].second == friend_full_name){
+              //already friends
+              //return OK anyways
+              return false;
+            }
+          }
+          //At this point, new friend is not already in the friends list
+          friends_list_val.push_back(make_pair(friend_country,friend_full_name));
+          return true;
+        })
       };
 
-      if( result.first == status_codes::NotFound ) {
-        message.reply(status_codes::NotFound);
+      if( result != status_codes::OK ) {
+        message.reply(result);
         return;
       }
 
-      string friend_list = get_json_object_prop(result.second, "Friends");
-
-      //getting a vector of country, name pairs
-      friends_list_t friends_list_val = parse_friends_list(friend_list);
-
-      bool checker = false;
-
-      for(int i = 0; i < friends_list_val.size(); ++i){
-        if(friends_list_val[i].first == friend_country && friends_list_val[i].second == friend_full_name){
-          checker = true;
-        }
-      }
-
-      if(checker == true){
-        //already friends
-        //return OK anyways
-        message.reply(status_codes::OK);
-        return;
-      }
-
-      //At this point, new friend is not already in the friends list
-      friends_list_val.push_back(make_pair(friend_country,friend_full_name));
-
-      //converting new friends list to string to replace the old friends list value
-      string friend_list_new = friends_list_to_string(friends_list_val);
-
-      value friend_json_object {build_json_value (vector<pair<string,string>>{make_pair("Friends",friend_list_new)})};
-
-      pair<status_code,value> result_a{
-        do_request(methods::PUT, basic_def_url + "/" + update_entity_auth +"/"+
-          data_table_name + "/" + friend_token + "/" + friend_partition + "/"+ friend_row,friend_json_object)
-      };
-
       //Successfully added as friend
       message.reply(status_codes::OK);
       return;
@@ -522,17 +942,17 @@ void handle_put(http_request message) {
     string unfriend_country{paths[2]};
     string unfriend_full_name{paths[3]};
 
-    auto check_signed = usersSignedIn.find(paths[1]);
-    if(check_signed == usersSignedIn.end()){
+    tuple<string,string,string> signedInData {};
+    if( ! signed_in_user(user_id, signedInData)){
       //User is not signed in
       message.reply(status_codes::Forbidden);
       return;
     }
     else{//user signed-in
 
-      string unfriend_token = {get<0>(usersSignedIn[user_id])};
-      string unfriend_partition = {get<1>(usersSignedIn[user_id])};
-      string unfriend_row = {get<2>(usersSignedIn[user_id])};
+      string unfriend_token = {get<0>(signedInData)};
+      string unfriend_partition = {get<1>(signedInData)};
+      string unfriend_row = {get<2>(signedInData)};
 
       //Checking if the friend exist
       pair<status_code,value> check{
@@ -545,42 +965,30 @@ void handle_put(http_request message) {
         return;
       }
 
-      pair<status_code,value> result {
-        do_request(methods::GET, basic_def_url + "/" + read_entity_auth+"/"+
-          data_table_name+"/"+unfriend_token+"/"+unfriend_partition+"/"+unfriend_row)
+      status_code result {
+        update_friends_list(unfriend_token, unfriend_partition, unfriend_row,
+                            [&unfriend_country, &unfriend_full_name] (friends_list_t& friends_list_val) -> bool {
+          bool checker = false;
+          for(int i = 0; i < friends_list_val.size(); ++i){
+            if(friends_list_val[i].first == unfriend_country && friends_list_val[i].second == unfriend_full_name){
+              //friend found
+              friends_list_val.erase(friends_list_val.begin()+i);
+              --i;
+              checker = true;
+            }
+          }
+          //friend doesnt exist: nothing to write, return OK anyways
+          return checker;
+        })
       };
 
-      string friend_list = get_json_object_prop(result.second, "Friends");
-
-      friends_list_t friends_list_val = parse_friends_list(friend_list);
-
-      bool checker = false;
-
-      for(int i = 0; i < friends_list_val.size(); ++i){
-        if(friends_list_val[i].first == unfriend_country && friends_list_val[i].second == unfriend_full_name){
-          //friend found
-          friends_list_val.erase(friends_list_val.begin()+i);
-          checker = true;
-        }
-      }
-      if(checker == false){
-        //friend doesnt exist
-        //return OK anyways
-        message.reply(status_codes::OK);
-        return;
-      }
-      else{
-        ///////*************** NOT SURE ABOUT THIS PART YET****************
-        string friend_list_new = friends_list_to_string(friends_list_val);
-        value friend_json_object {build_json_value (vector<pair<string,string>>{make_pair("Friends",friend_list_new)})};
-        pair<status_code,value> result_a{
-          do_request(methods::PUT, basic_def_url + "/" + update_entity_auth +"/"+
-            data_table_name + "/" + unfriend_token + "/" + unfriend_partition + "/"+ unfriend_row,friend_json_object)
-        };
-        //successfully un-friended
-        message.reply(status_codes::OK);
+      if( result != status_codes::OK ) {
+        message.reply(result);
         return;
       }
+      //successfully un-friended
+      message.reply(status_codes::OK);
+      return;
     }
   } // END OF UNFRIEND
   //to return bad request because of unrecognized request
@@ -591,17 +999,42 @@ void handle_put(http_request message) {
 /*
   Main server routine
 
+  Usage: userserver [compact|plain [high_degree_refresh_s]]
+
+  "compact" stores friends lists in the compact form as they are
+  written; "plain" (the default) keeps the original form.
+  high_degree_refresh_s is how long the high-degree authors are cached
+  (default 60); 0 rereads them on every ReadUpdates, as the tests need.
+
   Install handlers for the HTTP requests and open the listener,
   which processes each request asynchronously.
 
+  If TRACE_FILE is set, spans are written to it (see Trace.h). Each
+  request from a client starts a new trace.
+
   Wait for a carriage return, then shut the server down.
  */
 int main (int argc, char const * argv[]) {
+  start_tracing("UserServer");
+
+  // "compact": store friends lists in the compact form as they are written
+  if (argc > 1 && string {argv[1]} == "compact")
+    compact_friends_lists = true;
+  if (argc > 2)
+    high_degree_refresh = std::chrono::seconds {std::strtol(argv[2], nullptr, 10)};
+  cout << "UserServer: high-degree authors cached for " << high_degree_refresh.count() << " s" << endl;
+
+  scheduler.start(request_workers);
 
   http_listener listener {user_def_url};
-  listener.support(methods::GET, &handle_get);
-  listener.support(methods::POST, &handle_post);
-  listener.support(methods::PUT, &handle_put);
+  listener.support(methods::GET, [] (http_request message) {
+      auto paths = uri::split_path(uri::decode(message.relative_uri().path()));
+      size_t cls {! paths.empty() && paths[0] == read_updates ? bulk_work : interactive_work};
+      schedule_request(scheduler, cls, message, &handle_get); });
+  listener.support(methods::POST, [] (http_request message) {
+      schedule_request(scheduler, interactive_work, message, &handle_post); });
+  listener.support(methods::PUT, [] (http_request message) {
+      schedule_request(scheduler, interactive_work, message, &handle_put); });
   listener.open().wait(); // Wait for listener to complete starting
 
   cout << "Enter carriage return to stop server." << endl;
@@ -610,5 +1043,6 @@ int main (int argc, char const * argv[]) {
 
   // Shut it down
   listener.close().wait();
+  scheduler.stop();
   cout << "Closed" << endl;
 }
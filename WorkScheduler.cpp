@@ -0,0 +1,138 @@
+#include "WorkScheduler.h"
+
+#include <cstddef>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+using std::cerr;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+using web::http::http_request;
+using web::http::status_codes;
+
+WorkScheduler::WorkScheduler (vector<work_class_t> configs) :
+  classes {},
+  turn {0},
+  lock {},
+  ready {},
+  stopping {false},
+  threads {}
+{
+  for (auto& c : configs)
+    classes.push_back(class_state_t {std::move(c), {}, 0, 0});
+  if ( ! classes.empty())
+    classes[0].deficit = classes[0].config.weight;
+}
+
+WorkScheduler::~WorkScheduler () {
+  stop();
+}
+
+void WorkScheduler::start (size_t workers) {
+  for (size_t i {0}; i < workers; ++i)
+    threads.push_back(thread {&WorkScheduler::run, this});
+}
+
+void WorkScheduler::stop () {
+  {
+    std::lock_guard<std::mutex> guard {lock};
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto& t : threads)
+    t.join();
+  threads.clear();
+}
+
+bool WorkScheduler::submit (size_t cls, work_t work) {
+  {
+    std::lock_guard<std::mutex> guard {lock};
+    class_state_t& c = classes.at(cls);
+    if (c.queue.size() >= c.config.max_queued)
+      return false;
+    c.queue.push_back(std::move(work));
+  }
+  ready.notify_one();
+  return true;
+}
+
+/*
+  Take the next job, if some class has one and a worker to spare.
+  The class whose turn it is keeps it until it has used its deficit,
+  run out of jobs, or reached max_running; the next class then gets
+  weight jobs' worth. Unused deficit is not carried over, so a class
+  that was idle or held back cannot later take a burst beyond its weight.
+  Called with lock held.
+ */
+bool WorkScheduler::take (size_t& cls, work_t& work) {
+  for (size_t visits {0}; visits <= classes.size(); ++visits) {
+    class_state_t& c = classes[turn];
+    if (c.deficit > 0 && ! c.queue.empty() && c.running < c.config.max_running) {
+      --c.deficit;
+      ++c.running;
+      cls = turn;
+      work = std::move(c.queue.front());
+      c.queue.pop_front();
+      return true;
+    }
+    turn = (turn + 1) % classes.size();
+    classes[turn].deficit = classes[turn].config.weight;
+  }
+  return false;
+}
+
+void WorkScheduler::run () {
+  unique_lock<std::mutex> guard {lock};
+  while (true) {
+    size_t cls {0};
+    work_t work {};
+    ready.wait(guard, [this, &cls, &work] { return stopping || take(cls, work); });
+    if (stopping)
+      return;
+    guard.unlock();
+    try {
+      work();
+    }
+    catch (const std::exception& e) {
+      cerr << "WorkScheduler: " << classes[cls].config.name << " job failed: " << e.what() << endl;
+    }
+    work = work_t {};
+    guard.lock();
+    --classes[cls].running;
+    // A class held at max_running may now take another worker
+    ready.notify_one();
+  }
+}
+
+void schedule_request (WorkScheduler& scheduler, size_t cls, const http_request& message,
+                       void (*handler) (http_request)) {
+  bool queued {scheduler.submit(cls, [message, handler] ()
+                                {
+                                  try {
+                                    handler(message);
+                                  }
+                                  catch (const std::exception& e) {
+                                    cerr << "Request failed: " << e.what() << endl;
+                                    try {
+                                      message.reply(status_codes::InternalError);
+                                    }
+                                    catch (const std::exception&) {
+                                      // Already replied
+                                    }
+                                  }
+                                })};
+  if ( ! queued)
+    message.reply(status_codes::ServiceUnavailable);
+}
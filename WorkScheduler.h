@@ -0,0 +1,86 @@
+#ifndef WorkScheduler_h
+#define WorkScheduler_h
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+
+/*
+  One class of work and its share of the workers
+ */
+struct work_class_t {
+  std::string name;
+  unsigned weight;          // Jobs taken per turn when every class has work
+  std::size_t max_running;  // Most workers the class may hold at once
+  std::size_t max_queued;   // Jobs submitted past this are refused
+};
+
+/*
+  Fixed pool of worker threads shared by several classes of work
+
+  Each class has its own queue. Workers take jobs from the classes in
+  turn, weight jobs from a class per turn (deficit round robin with
+  every job costing one), so a class gets its weighted share of the
+  workers however many jobs the others have queued. A class never
+  holds more than max_running workers; giving a bulk class fewer than
+  all of them keeps some free for interactive work even while long
+  bulk jobs run.
+ */
+class WorkScheduler {
+public:
+  using work_t = std::function<void()>;
+
+  explicit WorkScheduler (std::vector<work_class_t> classes);
+  ~WorkScheduler ();
+
+  WorkScheduler (const WorkScheduler&) = delete;
+  WorkScheduler& operator= (const WorkScheduler&) = delete;
+
+  void start (std::size_t workers);
+
+  // Stop the workers once the jobs they are running finish; queued jobs are dropped
+  void stop ();
+
+  /*
+    Queue work in class cls, the index of its work_class_t.
+    Returns false if the class's queue is full.
+   */
+  bool submit (std::size_t cls, work_t work);
+
+private:
+  struct class_state_t {
+    work_class_t config;
+    std::deque<work_t> queue;
+    std::size_t running;
+    unsigned deficit;
+  };
+
+  std::vector<class_state_t> classes;
+  std::size_t turn;
+
+  std::mutex lock;
+  std::condition_variable ready;
+  bool stopping;
+  std::vector<std::thread> threads;
+
+  bool take (std::size_t& cls, work_t& work);
+  void run ();
+};
+
+/*
+  Run handler for message on scheduler's workers, in class cls.
+  Replies ServiceUnavailable if the class's queue is full.
+ */
+void schedule_request (WorkScheduler& scheduler, std::size_t cls,
+                       const web::http::http_request& message,
+                       void (*handler) (web::http::http_request));
+
+#endif
@@ -0,0 +1,399 @@
+/*
+  Microbenchmarks of the utility functions on the request path
+
+  Each case runs at several input sizes (or, for lookup_table, thread
+  counts). The memory_ and disk_ cases time MemoryTableStore and
+  DiskTableStore, without any network; the disk store lives in a
+  scratch directory under /tmp. The number of operations per
+  repetition is calibrated to take at least min_time_ms, then the
+  repetition is run several times; the median, fastest and slowest
+  time per operation are reported.
+  Inputs are generated from a fixed seed, so runs are comparable.
+
+  Results are written to standard output as JSON:
+
+    {"context": {...}, "benchmarks": [{"name", "param", "value",
+     "iterations", "repetitions", "ns_per_op", "min_ns_per_op",
+     "max_ns_per_op"}, ...]}
+
+  Progress goes to standard error.
+
+  Usage: bench [filter [min_time_ms]]
+    Runs only the cases whose name contains filter ("" for all).
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_msg.h>
+#include <cpprest/json.h>
+
+#include <was/table.h>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "ClientUtils.h"
+#include "DiskTableStore.h"
+#include "MemoryTableStore.h"
+#include "ServerUtils.h"
+#include "TableCache.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::size_t;
+using std::string;
+using std::thread;
+using std::vector;
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using web::http::http_request;
+using web::http::methods;
+
+using web::json::value;
+
+namespace {
+  constexpr unsigned repetitions {5};
+  constexpr std::uint64_t seed {276};
+
+  // Results are folded into this so the work is not optimized away
+  std::atomic<size_t> sink {0};
+
+  struct result_t {
+    string name;
+    string param;
+    size_t value;
+    size_t iterations;
+    double ns_per_op;
+    double min_ns_per_op;
+    double max_ns_per_op;
+  };
+
+  /*
+    Time op, which does iterations operations and returns the elapsed
+    seconds, calibrating iterations to take at least min_time
+   */
+  template<typename Op>
+  result_t measure (const string& name, const string& param, size_t param_value,
+                    duration<double> min_time, Op op) {
+    size_t iterations {1};
+    for (;;) {
+      double elapsed {op(iterations)};
+      if (elapsed >= min_time.count())
+        break;
+      double scale {elapsed > 0 ? min_time.count() / elapsed * 1.2 : 10.0};
+      iterations = static_cast<size_t>(iterations * std::min(10.0, std::max(2.0, scale)));
+    }
+
+    vector<double> ns {};
+    for (unsigned r {0}; r < repetitions; ++r)
+      ns.push_back(op(iterations) * 1e9 / iterations);
+    std::sort(ns.begin(), ns.end());
+    cerr << name << " " << param << "=" << param_value << ": " << ns[ns.size() / 2] << " ns/op" << endl;
+    return result_t {name, param, param_value, iterations, ns[ns.size() / 2], ns.front(), ns.back()};
+  }
+
+  // Time iterations calls of f on this thread
+  template<typename F>
+  double time_loop (size_t iterations, F f) {
+    steady_clock::time_point start {steady_clock::now()};
+    for (size_t i {0}; i < iterations; ++i)
+      f();
+    return duration<double> {steady_clock::now() - start}.count();
+  }
+
+  string random_name (std::mt19937_64& rng, size_t length) {
+    std::uniform_int_distribution<int> letter {'a', 'z'};
+    string name (length, ' ');
+    for (auto& c : name)
+      c = static_cast<char>(letter(rng));
+    return name;
+  }
+
+  friends_list_t make_friends (size_t n) {
+    std::mt19937_64 rng {seed};
+    const vector<string> countries {"USA", "Canada", "Korea", "Mexico", "Brazil", "France", "Japan"};
+    std::uniform_int_distribution<size_t> country {0, countries.size() - 1};
+    std::uniform_int_distribution<size_t> length {6, 24};
+    friends_list_t list {};
+    for (size_t i {0}; i < n; ++i)
+      list.push_back(make_pair(countries[country(rng)], random_name(rng, length(rng))));
+    return list;
+  }
+
+  vector<pair<string,string>> make_props (size_t n) {
+    std::mt19937_64 rng {seed};
+    std::uniform_int_distribution<size_t> length {4, 64};
+    vector<pair<string,string>> props {};
+    for (size_t i {0}; i < n; ++i)
+      props.push_back(make_pair("Prop" + std::to_string(i), random_name(rng, length(rng))));
+    return props;
+  }
+
+  // An entity's properties, of the types get_properties converts, in rotation
+  table_entity::properties_type make_entity_props (size_t n) {
+    std::mt19937_64 rng {seed};
+    table_entity::properties_type props {};
+    for (size_t i {0}; i < n; ++i) {
+      string name {"Prop" + std::to_string(i)};
+      switch (i % 4) {
+      case 0: props[name] = entity_property {random_name(rng, 32)}; break;
+      case 1: props[name] = entity_property {static_cast<int32_t>(rng())}; break;
+      case 2: props[name] = entity_property {static_cast<double>(rng() % 100000) / 7}; break;
+      default: props[name] = entity_property {rng() % 2 == 0}; break;
+      }
+    }
+    return props;
+  }
+
+  // Key of the ith of the entities fill_store() writes
+  string entity_partition (size_t i) {
+    return "Partition" + std::to_string(i / 100);
+  }
+
+  string entity_row (size_t i) {
+    return "Row" + std::to_string(i % 100);
+  }
+
+  // Table "Bench" of n entities, each with four string properties
+  void fill_store (TableStore& store, size_t n) {
+    std::mt19937_64 rng {seed};
+    store.create_table("Bench");
+    for (size_t i {0}; i < n; ++i) {
+      table_entity entity {entity_partition(i), entity_row(i)};
+      for (int p {0}; p < 4; ++p)
+        entity.properties()["Prop" + std::to_string(p)] = entity_property {random_name(rng, 16)};
+      store.write("Bench", store_op_t {store_op_t::insert, entity});
+    }
+  }
+  // Point reads of random entities of a store fill_store() has filled
+  result_t time_retrieve (const string& name, TableStore& store, size_t n, duration<double> min_time) {
+    std::mt19937_64 rng {seed};
+    std::uniform_int_distribution<size_t> pick {0, n - 1};
+    return measure(name, "entities", n, min_time, [&store, &rng, &pick] (size_t iterations) {
+        return time_loop(iterations, [&store, &rng, &pick]
+                         {
+                           size_t i {pick(rng)};
+                           table_entity entity {};
+                           store.retrieve("Bench", entity_partition(i), entity_row(i), entity);
+                           sink += entity.properties().size();
+                         });
+      });
+  }
+
+  // Reads of one whole partition of 100 entities
+  result_t time_scan_partition (const string& name, TableStore& store, size_t n, duration<double> min_time) {
+    scan_t partition {};
+    partition.partition = entity_partition(n / 2);
+    return measure(name, "entities", n, min_time, [&store, &partition] (size_t iterations) {
+        return time_loop(iterations, [&store, &partition]
+                         {
+                           store.scan("Bench", partition, [] (const table_entity& e) { sink += e.row_key().size(); return true; });
+                         });
+      });
+  }
+
+  // A new, empty directory under /tmp
+  string make_scratch_dir () {
+    char path[] {"/tmp/benchXXXXXX"};
+    if (::mkdtemp(path) == nullptr)
+      throw std::runtime_error("Cannot create a scratch directory");
+    return path;
+  }
+
+  // Remove dir and the files in it
+  void remove_dir (const string& dir) {
+    if (DIR* listing = ::opendir(dir.c_str())) {
+      while (struct dirent* entry = ::readdir(listing)) {
+        const string name {entry->d_name};
+        if (name != "." && name != "..")
+          ::unlink((dir + "/" + name).c_str());
+      }
+      ::closedir(listing);
+    }
+    ::rmdir(dir.c_str());
+  }
+
+}
+
+int main (int argc, char const * argv[]) {
+  const string filter {argc > 1 ? argv[1] : ""};
+  const duration<double> min_time {(argc > 2 ? std::strtod(argv[2], nullptr) : 100.0) / 1000.0};
+  auto wanted = [&filter] (const string& name) { return name.find(filter) != string::npos; };
+
+  const vector<size_t> list_sizes {10, 100, 1000, 10000};
+  const vector<size_t> prop_counts {4, 16, 64, 256};
+  const vector<size_t> thread_counts {1, 2, 4, 8};
+  const vector<size_t> store_sizes {1000, 10000, 100000};
+
+  vector<result_t> results {};
+
+  if (wanted("parse_friends_list")) {
+    for (auto n : list_sizes) {
+      const string encoded {friends_list_to_string(make_friends(n))};
+      results.push_back(measure("parse_friends_list", "entries", n, min_time, [&encoded] (size_t iterations) {
+            return time_loop(iterations, [&encoded] { sink += parse_friends_list(encoded).size(); });
+          }));
+    }
+  }
+
+  if (wanted("parse_friends_view")) {
+    for (auto n : list_sizes) {
+      const string encoded {friends_list_to_string(make_friends(n))};
+      results.push_back(measure("parse_friends_view", "entries", n, min_time, [&encoded] (size_t iterations) {
+            return time_loop(iterations, [&encoded] { sink += parse_friends_view(encoded).size(); });
+          }));
+    }
+  }
+
+  if (wanted("friends_list_to_string")) {
+    for (auto n : list_sizes) {
+      const friends_list_t list {make_friends(n)};
+      results.push_back(measure("friends_list_to_string", "entries", n, min_time, [&list] (size_t iterations) {
+            return time_loop(iterations, [&list] { sink += friends_list_to_string(list).size(); });
+          }));
+    }
+  }
+
+  if (wanted("build_json_value")) {
+    for (auto n : prop_counts) {
+      const vector<pair<string,string>> props {make_props(n)};
+      results.push_back(measure("build_json_value", "properties", n, min_time, [&props] (size_t iterations) {
+            return time_loop(iterations, [&props] { sink += build_json_value(props).size(); });
+          }));
+    }
+  }
+
+  if (wanted("unpack_json_object")) {
+    for (auto n : prop_counts) {
+      const value object {build_json_value(make_props(n))};
+      results.push_back(measure("unpack_json_object", "properties", n, min_time, [&object] (size_t iterations) {
+            return time_loop(iterations, [&object] { sink += unpack_json_object(object).size(); });
+          }));
+    }
+  }
+
+  if (wanted("get_properties")) {
+    for (auto n : prop_counts) {
+      const table_entity::properties_type props {make_entity_props(n)};
+      results.push_back(measure("get_properties", "properties", n, min_time, [&props] (size_t iterations) {
+            return time_loop(iterations, [&props] { sink += get_properties(props).size(); });
+          }));
+    }
+  }
+
+  // A request body can only be read once, so each operation includes
+  // building the request and setting its body
+  if (wanted("get_json_body")) {
+    for (auto n : prop_counts) {
+      const value body {build_json_value(make_props(n))};
+      results.push_back(measure("get_json_body", "properties", n, min_time, [&body] (size_t iterations) {
+            return time_loop(iterations, [&body]
+                             {
+                               http_request request {methods::PUT};
+                               request.set_body(body);
+                               sink += get_json_body(request).size();
+                             });
+          }));
+    }
+  }
+
+  // Point reads of random entities, 100 per partition
+  if (wanted("memory_retrieve")) {
+    for (auto n : store_sizes) {
+      MemoryTableStore store {"bench"};
+      fill_store(store, n);
+      results.push_back(time_retrieve("memory_retrieve", store, n, min_time));
+    }
+  }
+
+  if (wanted("memory_scan_partition")) {
+    for (auto n : store_sizes) {
+      MemoryTableStore store {"bench"};
+      fill_store(store, n);
+      results.push_back(time_scan_partition("memory_scan_partition", store, n, min_time));
+    }
+  }
+
+  // A small memtable, so most reads are from the mmap'd segments
+  if (wanted("disk_retrieve") || wanted("disk_scan_partition")) {
+    for (auto n : store_sizes) {
+      const string dir {make_scratch_dir()};
+      {
+        DiskTableStore store {dir, "bench", false, 64 << 10};
+        fill_store(store, n);
+        if (wanted("disk_retrieve"))
+          results.push_back(time_retrieve("disk_retrieve", store, n, min_time));
+        if (wanted("disk_scan_partition"))
+          results.push_back(time_scan_partition("disk_scan_partition", store, n, min_time));
+      }
+      remove_dir(dir);
+    }
+  }
+
+  // Every thread looks up the same few tables, as the server threads do
+  if (wanted("lookup_table")) {
+    TableCache cache {};
+    cache.init("UseDevelopmentStorage=true");
+    vector<string> tables {};
+    for (size_t i {0}; i < 16; ++i)
+      tables.push_back("Table" + std::to_string(i));
+    for (auto n : thread_counts) {
+      results.push_back(measure("lookup_table", "threads", n, min_time, [&cache, &tables, n] (size_t iterations) {
+            vector<thread> threads {};
+            steady_clock::time_point start {steady_clock::now()};
+            for (size_t t {0}; t < n; ++t)
+              threads.push_back(thread {[&cache, &tables, iterations, t]
+                                        {
+                                          for (size_t i {0}; i < iterations; ++i)
+                                            sink += cache.lookup_table(tables[(i + t) % tables.size()]).name().size();
+                                        }});
+            for (auto& th : threads)
+              th.join();
+            // Wall time per lookup on each thread: the latency a handler sees
+            return duration<double> {steady_clock::now() - start}.count();
+          }));
+    }
+  }
+
+  vector<value> benchmarks {};
+  for (const auto& r : results)
+    benchmarks.push_back(value::object(vector<pair<string,value>> {
+          make_pair("name", value::string(r.name)),
+          make_pair("param", value::string(r.param)),
+          make_pair("value", value::number(static_cast<uint64_t>(r.value))),
+          make_pair("iterations", value::number(static_cast<uint64_t>(r.iterations))),
+          make_pair("repetitions", value::number(static_cast<uint64_t>(repetitions))),
+          make_pair("ns_per_op", value::number(r.ns_per_op)),
+          make_pair("min_ns_per_op", value::number(r.min_ns_per_op)),
+          make_pair("max_ns_per_op", value::number(r.max_ns_per_op))}));
+
+  value context {value::object(vector<pair<string,value>> {
+        make_pair("time", value::number(static_cast<int64_t>(std::time(nullptr)))),
+        make_pair("seed", value::number(seed)),
+        make_pair("min_time_ms", value::number(min_time.count() * 1000)),
+        make_pair("hardware_concurrency", value::number(static_cast<uint64_t>(thread::hardware_concurrency())))})};
+  cout << value::object(vector<pair<string,value>> {
+      make_pair("context", context),
+      make_pair("benchmarks", value::array(benchmarks))}).serialize() << endl;
+}
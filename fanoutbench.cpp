@@ -0,0 +1,171 @@
+/*
+  Cost model of fan-out on write versus the hybrid with outboxes
+
+  For several friend-count (degree) distributions and degree thresholds,
+  simulates authors posting statuses and readers reading one page of
+  their feed, counting the BasicServer requests and the storage
+  operations (entities written, queries run) that PushServer and
+  UserServer would issue:
+
+    Author at or under the threshold: one insert per friend, batched
+      per country partition, push_batch_size to a request.
+    Author over the threshold: one outbox insert and one update of the
+      high-degree table.
+    Reader: one timeline range query, and, once any author is over the
+      threshold, a friends-list read and one outbox range query per
+      friend who is over it.
+
+  Friends are picked in proportion to their degree (a user with twice
+  the friends is twice as likely to be someone's friend), so
+  high-degree authors appear in many more friend lists than their
+  share of users.
+
+  This is a model; it talks to no server. Costs are per status posted
+  and per feed read, plus the total per status given reads_per_status.
+
+  Usage: fanoutbench [users [average_degree [reads_per_status [seed]]]]
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using std::setw;
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+  constexpr size_t countries {50};       // Partitions friends are spread over
+  constexpr size_t batch_size {100};     // PushServer's push_batch_size
+  constexpr size_t statuses {20000};     // Statuses simulated per case
+  constexpr size_t reads {20000};        // Feed reads simulated per case
+
+  struct cost_t {
+    double write_requests;   // BasicServer requests per status
+    double entity_writes;    // Entities written per status
+    double read_requests;    // BasicServer requests per feed read
+    double read_queries;     // Storage queries per feed read
+  };
+
+  /*
+    Degree of each of users users, drawn from the named distribution
+    with about average_degree on average, at least 1 and below users
+   */
+  vector<size_t> degrees (const string& distribution, size_t users, double average_degree, std::mt19937_64& rng) {
+    vector<size_t> result (users);
+    std::uniform_real_distribution<double> uniform {0.0, 1.0};
+    const double alpha {1.5};
+    const double sigma {1.5};
+    std::lognormal_distribution<double> lognormal {std::log(average_degree) - sigma * sigma / 2, sigma};
+    for (auto& d : result) {
+      double x {average_degree};
+      if (distribution == "powerlaw")
+        // Pareto with shape alpha and mean average_degree
+        x = average_degree * (alpha - 1) / alpha * std::pow(1.0 - uniform(rng), -1.0 / alpha);
+      else if (distribution == "lognormal")
+        x = lognormal(rng);
+      d = std::min(users - 1, std::max<size_t>(1, static_cast<size_t>(std::llround(x))));
+    }
+    return result;
+  }
+
+  cost_t simulate (const vector<size_t>& degree, size_t threshold, std::mt19937_64& rng) {
+    // Chance that a friend, picked in proportion to degree, is over the threshold
+    double all {0}, over {0};
+    for (auto d : degree) {
+      all += d;
+      if (d > threshold)
+        over += d;
+    }
+    double p_over {over / all};
+    bool any_over {over > 0};
+
+    std::uniform_int_distribution<size_t> pick_user {0, degree.size() - 1};
+    std::uniform_int_distribution<size_t> pick_country {0, countries - 1};
+    cost_t cost {0, 0, 0, 0};
+
+    vector<size_t> per_country (countries);
+    for (size_t s {0}; s < statuses; ++s) {
+      size_t d {degree[pick_user(rng)]};
+      if (d > threshold) {
+        cost.write_requests += 2;
+        cost.entity_writes += 2;
+        continue;
+      }
+      std::fill(per_country.begin(), per_country.end(), 0);
+      for (size_t f {0}; f < d; ++f)
+        ++per_country[pick_country(rng)];
+      for (auto n : per_country)
+        cost.write_requests += (n + batch_size - 1) / batch_size;
+      cost.entity_writes += d;
+    }
+
+    for (size_t r {0}; r < reads; ++r) {
+      cost.read_requests += 1;
+      cost.read_queries += 1;
+      if ( ! any_over)
+        continue;
+      std::binomial_distribution<size_t> friends_over {degree[pick_user(rng)], p_over};
+      size_t outboxes {friends_over(rng)};
+      cost.read_requests += 1 + outboxes;
+      cost.read_queries += 1 + outboxes;
+    }
+
+    cost.write_requests /= statuses;
+    cost.entity_writes /= statuses;
+    cost.read_requests /= reads;
+    cost.read_queries /= reads;
+    return cost;
+  }
+}
+
+int main (int argc, char const * argv[]) {
+  const size_t users {argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000};
+  const double average_degree {argc > 2 ? std::strtod(argv[2], nullptr) : 200.0};
+  const double reads_per_status {argc > 3 ? std::strtod(argv[3], nullptr) : 10.0};
+  std::mt19937_64 rng {argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 276};
+
+  const size_t no_threshold {std::numeric_limits<size_t>::max()};
+  const vector<size_t> thresholds {no_threshold, 10000, 1000, 100};
+
+  cout << users << " users, average degree " << average_degree << ", "
+       << reads_per_status << " feed reads per status" << endl;
+  for (const string distribution : {"uniform", "lognormal", "powerlaw"}) {
+    vector<size_t> degree {degrees(distribution, users, average_degree, rng)};
+    double mean {0};
+    size_t max {0};
+    for (auto d : degree) {
+      mean += d;
+      max = std::max(max, d);
+    }
+    mean /= users;
+    cout << endl << distribution << " (mean " << std::fixed << std::setprecision(1) << mean
+         << ", max " << max << ")" << endl;
+    cout << setw(10) << "threshold" << setw(8) << "over"
+         << setw(12) << "write reqs" << setw(12) << "ent writes"
+         << setw(12) << "read reqs" << setw(12) << "read qrys"
+         << setw(14) << "reqs/status" << setw(14) << "ops/status" << endl;
+    for (auto threshold : thresholds) {
+      size_t over {static_cast<size_t>(std::count_if(degree.begin(), degree.end(),
+                                                     [threshold] (size_t d) { return d > threshold; }))};
+      cost_t c {simulate(degree, threshold, rng)};
+      cout << setw(10) << (threshold == no_threshold ? string {"none"} : std::to_string(threshold))
+           << setw(8) << over
+           << std::setprecision(2)
+           << setw(12) << c.write_requests << setw(12) << c.entity_writes
+           << setw(12) << c.read_requests << setw(12) << c.read_queries
+           << setw(14) << c.write_requests + reads_per_status * c.read_requests
+           << setw(14) << c.entity_writes + reads_per_status * c.read_queries << endl;
+    }
+  }
+}
@@ -0,0 +1,150 @@
+/*
+  Benchmark of the friends-list parsers
+
+  Builds a friends list of the given number of entries and parses it
+  repeatedly with
+    substr:  the earlier parse_friends_list, two find()s and two
+             substr()s per pair
+    list:    parse_friends_list, copying each pair into strings
+    view:    parse_friends_view, slices into the list
+    compact: parse_friends_view of the list's compact form
+  checking that they all agree, and prints microseconds per parse
+  and megabytes parsed per second for each. Then times encoding the
+  list in each form, and prints the size of each.
+
+  Usage: friendsbench [entries [iterations]]
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "ClientUtils.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::setw;
+using std::size_t;
+using std::string;
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+namespace {
+  using pos_t = string::size_type;
+
+  // parse_friends_list as it was before it was built on parse_friends_view
+  friends_list_t substr_parse (const string& friends_list) {
+    friends_list_t res {};
+
+    pos_t start {0};
+    if (friends_list[start] == pair_separator)
+      start++;
+    for (pos_t delim {friends_list.find (pair_delimiter, start)};
+         delim != string::npos;
+         delim = friends_list.find (pair_delimiter, start)) {
+      pos_t end {friends_list.find (pair_separator, start)};
+      if (end == string::npos)
+        end = friends_list.size();
+      if (end <= delim+1)
+        throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+      string country {friends_list.substr (start, delim-start)};
+      string name {friends_list.substr (delim+1, end-delim-1)};
+      res.push_back (make_pair (country, name));
+      start = end+1;
+    }
+    return res;
+  }
+
+  /*
+    A friends list of entries friends, spread over a handful of
+    countries, with names of realistic and varying length
+   */
+  string make_friends_list (size_t entries) {
+    const char* countries[] {"USA", "Canada", "Korea", "Mexico", "Brazil", "France", "Japan"};
+    friends_list_t list {};
+    for (size_t i {0}; i < entries; ++i)
+      list.push_back(make_pair(string {countries[i % 7]},
+                               "Surname" + std::to_string(i * 7919 % 100003) + ",Given" + std::to_string(i)));
+    return friends_list_to_string(list);
+  }
+
+  // friends_list_to_string as it was before it was sized up front
+  string append_encode (const friends_list_t& list) {
+    string result {};
+    bool started {false};
+    for (const auto& p : list) {
+      if (started)
+        result += pair_separator;
+      result += p.first + pair_delimiter + p.second;
+      started = true;
+    }
+    return result;
+  }
+
+  template<typename Parse>
+  void run (const string& label, const string& friends_list, size_t iterations, Parse parse) {
+    size_t pairs {0};
+    steady_clock::time_point start {steady_clock::now()};
+    for (size_t i {0}; i < iterations; ++i)
+      pairs += parse(friends_list).size();
+    duration<double> elapsed {steady_clock::now() - start};
+    cout << setw(8) << label
+         << setw(14) << std::fixed << std::setprecision(1) << elapsed.count() * 1e6 / iterations
+         << setw(14) << friends_list.size() * iterations / elapsed.count() / 1e6
+         << setw(12) << pairs / iterations << endl;
+  }
+
+  template<typename Encode>
+  void run_encode (const string& label, const friends_list_t& list, size_t iterations, Encode encode) {
+    size_t bytes {0};
+    steady_clock::time_point start {steady_clock::now()};
+    for (size_t i {0}; i < iterations; ++i)
+      bytes = encode(list).size();
+    duration<double> elapsed {steady_clock::now() - start};
+    cout << setw(8) << label
+         << setw(14) << std::fixed << std::setprecision(1) << elapsed.count() * 1e6 / iterations
+         << setw(12) << bytes << endl;
+  }
+}
+
+int main (int argc, char const * argv[]) {
+  const size_t entries {argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000};
+  const size_t iterations {argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000};
+
+  const string friends_list {make_friends_list(entries)};
+
+  friends_list_t expected {substr_parse(friends_list)};
+  const string compact {friends_list_to_compact(expected)};
+  friends_view_t view {parse_friends_view(friends_list)};
+  friends_view_t compact_view {parse_friends_view(compact)};
+  bool same {expected == parse_friends_list(friends_list) && expected == parse_friends_list(compact) &&
+             append_encode(expected) == friends_list &&
+             expected.size() == view.size() && expected.size() == compact_view.size()};
+  for (size_t i {0}; same && i < view.size(); ++i)
+    same = expected[i].first == view[i].first && expected[i].second == view[i].second &&
+      expected[i].first == compact_view[i].first && expected[i].second == compact_view[i].second;
+  if ( ! same) {
+    cerr << "Parsers disagree" << endl;
+    return EXIT_FAILURE;
+  }
+
+  cout << entries << " friends, " << friends_list.size() << " bytes, "
+       << compact.size() << " bytes compact, " << iterations << " runs each" << endl;
+  cout << setw(8) << "parser" << setw(14) << "us/parse" << setw(14) << "MB/s" << setw(12) << "pairs" << endl;
+  run("substr", friends_list, iterations, substr_parse);
+  run("list", friends_list, iterations, parse_friends_list);
+  run("view", friends_list, iterations, parse_friends_view);
+  run("compact", compact, iterations, parse_friends_view);
+
+  cout << endl << setw(8) << "encoder" << setw(14) << "us/encode" << setw(12) << "bytes" << endl;
+  run_encode("append", expected, iterations, append_encode);
+  run_encode("sized", expected, iterations, friends_list_to_string);
+  run_encode("compact", expected, iterations, friends_list_to_compact);
+}
@@ -0,0 +1,304 @@
+/*
+  Open-loop load generator for the UserServer/PushServer stack
+
+  Sends a mix of SignOn, ReadFriendList, UpdateStatus, AddFriend and
+  PushStatus requests at a fixed average rate, with exponentially
+  distributed gaps between them (a Poisson arrival process). Requests
+  are sent on schedule whether or not earlier ones have been answered,
+  and each latency is measured from when the request was due to be
+  sent, so a slow server shows up as latency rather than as a lower
+  sending rate.
+
+  At the end, prints for each operation the requests sent, the
+  failures (exceptions or statuses other than OK), the throughput of
+  successful requests over the sending period and the p50, p99 and
+  p999 latency in ms, then how long the last requests took to drain.
+
+  Usage: loadgen [rate [seconds [mix [users_file [friends]]]]]
+
+    rate:       requests per second, over all operations (default 100)
+    seconds:    how long to send for (default 30)
+    mix:        relative weights, for example
+                  SignOn=1,ReadFriendList=50,UpdateStatus=20,AddFriend=5,PushStatus=24
+                (the default); operations left out are not sent
+    users_file: lines of "userid password country name" for users in
+                AuthTable and DataTable. Requests go to users picked
+                uniformly at random. Defaults to tester's user, with
+                password "user", whose entity is USA/Franklin,Aretha.
+    friends:    size of the friends list sent with each PushStatus
+                (default 100)
+
+  Every user is signed on before the run. The servers are expected on
+  their usual ports on localhost. Requests are not retried, so that
+  failures are counted as they happen.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "ClientUtils.h"
+
+using std::atomic;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::setw;
+using std::shared_ptr;
+using std::size_t;
+using std::string;
+using std::vector;
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+using web::http::method;
+using web::http::methods;
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::json::value;
+
+namespace {
+  const string user_url {"http://localhost:34572/"};
+  const string push_url {"http://localhost:34574/"};
+
+  struct user_t {
+    string userid;
+    string password;
+    string country;
+    string name;
+  };
+
+  // Latencies and failures of one operation
+  struct op_stats_t {
+    string name;
+    double weight;
+    std::mutex lock;
+    vector<double> latencies_ms;   // Successful requests only
+    size_t sent;
+    size_t failed;
+
+    op_stats_t (const string& name, double weight) :
+      name {name},
+      weight {weight},
+      lock {},
+      latencies_ms {},
+      sent {0},
+      failed {0}
+      {};
+  };
+
+  // One request: method, URL and body
+  struct call_t {
+    method http_method;
+    string uri_string;
+    value body;
+  };
+
+  vector<user_t> read_users (const string& path) {
+    vector<user_t> users {};
+    std::ifstream in {path};
+    string line {};
+    while (std::getline(in, line)) {
+      std::istringstream fields {line};
+      user_t u {};
+      if (fields >> u.userid >> u.password >> u.country >> u.name)
+        users.push_back(u);
+    }
+    return users;
+  }
+
+  // Parse "Op=weight,Op=weight" into the weight of each of ops
+  bool parse_mix (const string& mix, vector<shared_ptr<op_stats_t>>& ops) {
+    for (auto& op : ops)
+      op->weight = 0;
+    std::istringstream items {mix};
+    string item {};
+    while (std::getline(items, item, ',')) {
+      auto eq (item.find('='));
+      if (eq == string::npos)
+        return false;
+      auto op (std::find_if(ops.begin(), ops.end(),
+                            [&item, eq] (const shared_ptr<op_stats_t>& o) { return o->name == item.substr(0, eq); }));
+      if (op == ops.end())
+        return false;
+      (*op)->weight = std::strtod(item.c_str() + eq + 1, nullptr);
+    }
+    return true;
+  }
+
+  string friends_list_of (size_t n) {
+    friends_list_t list {};
+    for (size_t i {0}; i < n; ++i)
+      list.push_back(make_pair(string {"Country"} + std::to_string(i % 10), "Friend,Load" + std::to_string(i)));
+    return friends_list_to_string(list);
+  }
+
+  double percentile (const vector<double>& sorted, double p) {
+    if (sorted.empty())
+      return 0;
+    size_t rank {std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))};
+    return sorted[rank];
+  }
+}
+
+int main (int argc, char const * argv[]) {
+  const double rate {argc > 1 ? std::strtod(argv[1], nullptr) : 100.0};
+  const double run_seconds {argc > 2 ? std::strtod(argv[2], nullptr) : 30.0};
+  const string mix {argc > 3 ? argv[3] : "SignOn=1,ReadFriendList=50,UpdateStatus=20,AddFriend=5,PushStatus=24"};
+  vector<user_t> users {argc > 4 ? read_users(argv[4]) : vector<user_t> {user_t {"user", "user", "USA", "Franklin,Aretha"}}};
+  const size_t friends {argc > 5 ? std::strtoul(argv[5], nullptr, 10) : 100};
+
+  enum op_index {sign_on, read_friend_list, update_status, add_friend, push_status};
+  vector<shared_ptr<op_stats_t>> ops {
+    std::make_shared<op_stats_t>("SignOn", 0),
+    std::make_shared<op_stats_t>("ReadFriendList", 0),
+    std::make_shared<op_stats_t>("UpdateStatus", 0),
+    std::make_shared<op_stats_t>("AddFriend", 0),
+    std::make_shared<op_stats_t>("PushStatus", 0)};
+  if (rate <= 0 || run_seconds <= 0 || users.empty() || ! parse_mix(mix, ops)) {
+    cerr << "Usage: loadgen [rate [seconds [mix [users_file [friends]]]]]" << endl;
+    return 1;
+  }
+  vector<double> weights {};
+  for (const auto& op : ops)
+    weights.push_back(op->weight);
+
+  max_retries = 0;
+
+  for (const auto& u : users) {
+    pair<status_code,value> result {
+      do_request(methods::POST, user_url + "SignOn/" + u.userid,
+                 build_json_value(make_pair(string {"Password"}, u.password)))};
+    if (result.first != status_codes::OK)
+      cerr << "SignOn of " << u.userid << " failed: " << result.first << endl;
+  }
+
+  const value push_body {build_json_value(make_pair(string {"Friends"}, friends_list_of(friends)))};
+
+  std::mt19937_64 rng {276};
+  std::exponential_distribution<double> gap {rate};
+  std::discrete_distribution<size_t> pick_op (weights.begin(), weights.end());
+  std::uniform_int_distribution<size_t> pick_user {0, users.size() - 1};
+
+  cout << "loadgen: " << rate << " req/s for " << run_seconds << " s, "
+       << users.size() << " users, mix " << mix << endl;
+
+  atomic<size_t> outstanding {0};
+  size_t max_outstanding {0};
+  const steady_clock::time_point start {steady_clock::now()};
+  const steady_clock::time_point end {start + duration_cast<steady_clock::duration>(duration<double> {run_seconds})};
+  steady_clock::time_point due {start};
+  for (size_t n {0}; ; ++n) {
+    due += duration_cast<steady_clock::duration>(duration<double> {gap(rng)});
+    if (due >= end)
+      break;
+    std::this_thread::sleep_until(due);
+
+    size_t which {pick_op(rng)};
+    const user_t& u {users[pick_user(rng)]};
+    const string tag {std::to_string(n)};
+    call_t call {};
+    switch (which) {
+    case sign_on:
+      call = call_t {methods::POST, user_url + "SignOn/" + u.userid,
+                     build_json_value(make_pair(string {"Password"}, u.password))};
+      break;
+    case read_friend_list:
+      call = call_t {methods::GET, user_url + "ReadFriendList/" + u.userid, value {}};
+      break;
+    case update_status:
+      call = call_t {methods::PUT, user_url + "UpdateStatus/" + u.userid + "/Load" + tag, value {}};
+      break;
+    case add_friend:
+      call = call_t {methods::PUT, user_url + "AddFriend/" + u.userid + "/Country" + std::to_string(n % 10) +
+                     "/Friend,Added" + std::to_string(n % 1000), value {}};
+      break;
+    default:
+      call = call_t {methods::POST, push_url + "PushStatus/" + u.country + "/" + u.name + "/Load" + tag, push_body};
+      break;
+    }
+
+    shared_ptr<op_stats_t> op {ops[which]};
+    {
+      std::lock_guard<std::mutex> guard {op->lock};
+      ++op->sent;
+    }
+    max_outstanding = std::max(max_outstanding, ++outstanding);
+    do_request_async(call.http_method, call.uri_string, call.body)
+      .then([op, due, &outstanding] (pplx::task<req_res_t> result)
+            {
+              bool ok {false};
+              try {
+                ok = result.get().first == status_codes::OK;
+              }
+              catch (const std::exception&) {
+              }
+              double ms {duration<double, std::milli> {steady_clock::now() - due}.count()};
+              {
+                std::lock_guard<std::mutex> guard {op->lock};
+                if (ok)
+                  op->latencies_ms.push_back(ms);
+                else
+                  ++op->failed;
+              }
+              --outstanding;
+            });
+  }
+
+  // Give the last requests time to finish, up to the request timeout.
+  // Rates are over the run alone; the drain is reported separately.
+  const steady_clock::time_point drain_start {steady_clock::now()};
+  const steady_clock::time_point drain_end {drain_start + default_request_timeout + seconds {1}};
+  while (outstanding > 0 && steady_clock::now() < drain_end)
+    std::this_thread::sleep_for(std::chrono::milliseconds {10});
+  const double drain {duration<double> {steady_clock::now() - drain_start}.count()};
+
+  cout << setw(16) << "operation" << setw(9) << "sent" << setw(9) << "failed"
+       << setw(11) << "ok/s" << setw(10) << "p50 ms" << setw(10) << "p99 ms" << setw(10) << "p999 ms" << endl;
+  for (const auto& op : ops) {
+    std::lock_guard<std::mutex> guard {op->lock};
+    if (op->sent == 0)
+      continue;
+    vector<double> sorted {op->latencies_ms};
+    std::sort(sorted.begin(), sorted.end());
+    cout << setw(16) << op->name << setw(9) << op->sent << setw(9) << op->failed
+         << std::fixed << std::setprecision(1)
+         << setw(11) << sorted.size() / run_seconds
+         << std::setprecision(2)
+         << setw(10) << percentile(sorted, 0.50)
+         << setw(10) << percentile(sorted, 0.99)
+         << setw(10) << percentile(sorted, 0.999) << endl;
+  }
+  cout << "drained in " << std::fixed << std::setprecision(2) << drain << " s; most outstanding at once: " << max_outstanding;
+  if (outstanding > 0)
+    cout << ", " << outstanding << " still outstanding at exit";
+  cout << endl;
+  // Requests still outstanding refer to outstanding; wait for them rather than return
+  while (outstanding > 0)
+    std::this_thread::sleep_for(std::chrono::milliseconds {10});
+}
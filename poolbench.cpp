@@ -0,0 +1,102 @@
+/*
+  Throughput benchmark for do_request()'s client pool
+
+  Sends the same GET repeatedly from several threads, first with a new
+  http_client per request (the behaviour before pooling) and then
+  through the shared client_cache, and prints requests/second for each.
+
+  Usage: poolbench URL [requests [threads [max_connections]]]
+
+  URL should name a cheap request on a running server, for example
+
+    poolbench http://localhost:34568/ReadEntityAdmin/DataTable/USA/Franklin,Aretha
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cpprest/http_client.h>
+
+#include "ClientUtils.h"
+
+using std::atomic;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::size_t;
+using std::string;
+using std::thread;
+using std::vector;
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+using web::http::methods;
+using web::http::status_codes;
+
+/*
+  Run requests GETs of url spread over threads threads
+
+  Returns requests per second. Requests that throw or do not
+  return OK are counted in failures.
+ */
+double run (const string& url, size_t requests, size_t threads, atomic<size_t>& failures) {
+  atomic<size_t> next {0};
+  vector<thread> workers {};
+  auto start (steady_clock::now());
+  for (size_t t {0}; t < threads; ++t) {
+    workers.push_back(thread {[&url, requests, &next, &failures] () {
+          while (next++ < requests) {
+            try {
+              if (do_request(methods::GET, url).first != status_codes::OK)
+                ++failures;
+            }
+            catch (const std::exception& e) {
+              ++failures;
+            }
+          }
+        }});
+  }
+  for (auto& w : workers)
+    w.join();
+  duration<double> elapsed {steady_clock::now() - start};
+  return requests / elapsed.count();
+}
+
+int main (int argc, char const * argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: poolbench URL [requests [threads [max_connections]]]" << endl;
+    return 1;
+  }
+  const string url {argv[1]};
+  const size_t requests {argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000};
+  const size_t threads {argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 8};
+  const size_t max_connections {argc > 4 ? std::strtoul(argv[4], nullptr, 10) : threads};
+
+  cout << "poolbench: " << requests << " GETs of " << url
+       << " from " << threads << " threads" << endl;
+
+  // Warm up the server (and its table cache) before timing anything
+  atomic<size_t> warmup_failures {0};
+  run (url, threads, threads, warmup_failures);
+
+  atomic<size_t> unpooled_failures {0};
+  client_cache.init(0, true, false);
+  double unpooled {run (url, requests, threads, unpooled_failures)};
+  cout << "client per request: " << unpooled << " req/s ("
+       << unpooled_failures << " failed)" << endl;
+
+  atomic<size_t> pooled_failures {0};
+  client_cache.init(max_connections, true, true);
+  double pooled {run (url, requests, threads, pooled_failures)};
+  cout << "pooled clients (" << max_connections << " connections/host): "
+       << pooled << " req/s (" << pooled_failures << " failed)" << endl;
+
+  cout << "speedup: " << pooled / unpooled << "x" << endl;
+}
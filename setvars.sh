@@ -8,3 +8,5 @@ P='http://localhost:34574'
 export P
 H='Content-type: application/json'
 export H
+T='http://127.0.0.1:10002/devstoreaccount1'
+export T
@@ -3,9 +3,11 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <unordered_map>
@@ -63,8 +65,11 @@ const string sign_on {"SignOn"};
 const string read_friend_list {"ReadFriendList"};
 const string update_status {"UpdateStatus"};
 const string push_status {"PushStatus"};
+const string push_metrics {"PushMetrics"};
 const string add_friend_user{"AddFriend"};
 const string un_friend_user{"UnFriend"};
+const string read_updates{"ReadUpdates"};
+const string subscribe{"Subscribe"};
 
 const string statusNormal {"Hello"};
 const string statusLarge {"ThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatusThisIsALongStatus"};
@@ -992,6 +997,33 @@ SUITE(POST){
     cout << "PushStatus returned status_code: " << result.first << endl;
     CHECK_EQUAL (status_codes::OK, result.first);
   }
+
+  // Repeat a PushStatus with the same idempotency key; the repeat
+  // is acknowledged with the first request's status, and only the
+  // first is queued for delivery
+  TEST_FIXTURE(BasicFixture, PushStatusRepeated) {
+    cout << "PushStatusRepeated" << endl;
+    pair<status_code,value> before {do_request (methods::GET, push_def_url + push_metrics)};
+    CHECK_EQUAL (status_codes::OK, before.first);
+
+    header_vals_t req_headers {{idempotency_key_header, new_idempotency_key()}};
+    header_vals_t resp_headers {};
+    string url {push_def_url + push_status + "/"
+                + string(BasicFixture::partition) + "/"
+                + string(BasicFixture::row) + "/"
+                + statusNormal};
+    pair<status_code,value> first {do_request (methods::POST, url, value::object(), req_headers, resp_headers)};
+    pair<status_code,value> repeat {do_request (methods::POST, url, value::object(), req_headers, resp_headers)};
+    cout << "PushStatus returned status_codes: " << first.first << ", " << repeat.first << endl;
+    CHECK_EQUAL (status_codes::OK, first.first);
+    CHECK_EQUAL (first.first, repeat.first);
+
+    pair<status_code,value> after {do_request (methods::GET, push_def_url + push_metrics)};
+    CHECK_EQUAL (status_codes::OK, after.first);
+    if (before.first == status_codes::OK && after.first == status_codes::OK)
+      CHECK_EQUAL (before.second.at("Enqueued").as_number().to_uint64() + 1,
+                   after.second.at("Enqueued").as_number().to_uint64());
+  }
 }
 
 SUITE(PUT) {
@@ -1311,6 +1343,199 @@ SUITE(GET) {
     cout << "ReadFriendList returned status_code: " << result.first << endl;
     CHECK_EQUAL (status_codes::OK, result.first);
   }
+
+  // ReadUpdates merges in the outbox of a friend with too many friends
+  // to push to, with the reader's friends list in the compact form, but
+  // only once the author lists the reader as a friend too. UserServer
+  // must be run with a high_degree_refresh_s of 0 ("userserver plain 0")
+  // so it sees the high-degree row and the author's lists made here,
+  // whatever ran before.
+  TEST_FIXTURE(BasicFixture, ReadUpdatesCompactFriends){
+    cout << "ReadUpdatesCompactFriends" << endl;
+    const string author_country {BasicFixture::partition2};
+    const string author_name {BasicFixture::row2};
+    const string author {author_country + pair_delimiter + author_name};
+    const string time {timeline_key(1, 1)};
+    create_table(string(BasicFixture::addr), outbox_table_name);
+    create_table(string(BasicFixture::addr), high_degree_table_name);
+    CHECK_EQUAL (status_codes::OK,
+                 put_entity (string(BasicFixture::addr), high_degree_table_name, high_degree_partition, author,
+                             "Degree", "1000"));
+    CHECK_EQUAL (status_codes::OK,
+                 put_entity (string(BasicFixture::addr), outbox_table_name, author_country,
+                             timeline_row(author_name, time),
+                             vector<pair<string,value>> {
+                               make_pair("Status", value::string(statusNormal)),
+                               make_pair("Author", value::string(author)),
+                               make_pair("Time", value::string(time)),
+                               make_pair("Count", value::string("1"))}));
+    friends_list_t friends {
+      make_pair(string(BasicFixture::partition3), string(BasicFixture::row3)),
+      make_pair(author_country, author_name)};
+    CHECK_EQUAL (status_codes::OK,
+                 put_entity (string(BasicFixture::addr), string(BasicFixture::table),
+                             string(BasicFixture::partition), string(BasicFixture::row),
+                             string(BasicFixture::prop_friends), friends_list_to_compact(friends)));
+
+    auto outbox_read = [&author] () -> bool {
+      pair<status_code,value> result {
+        do_request (methods::GET,
+                    user_def_url
+                    + read_updates + "/"
+                    + string(BasicFixture::userid)
+                    + "?limit=10")};
+      cout << "ReadUpdates returned status_code: " << result.first << endl;
+      CHECK_EQUAL (status_codes::OK, result.first);
+      if (result.second.has_field("Updates"))
+        for (const auto& u : result.second.at("Updates").as_array())
+          if (get_json_object_prop(u, "Author") == author && get_json_object_prop(u, "Status") == statusNormal)
+            return true;
+      return false;
+    };
+
+    // The author does not list the reader
+    CHECK_EQUAL (status_codes::OK,
+                 put_entity (string(BasicFixture::addr), string(BasicFixture::table), author_country, author_name,
+                             string(BasicFixture::prop_friends),
+                             friends_list_to_string(friends_list_t {
+                                 make_pair(string(BasicFixture::partition3), string(BasicFixture::row3))})));
+    CHECK ( ! outbox_read());
+
+    CHECK_EQUAL (status_codes::OK,
+                 put_entity (string(BasicFixture::addr), string(BasicFixture::table), author_country, author_name,
+                             string(BasicFixture::prop_friends),
+                             friends_list_to_string(friends_list_t {
+                                 make_pair(string(BasicFixture::partition3), string(BasicFixture::row3)),
+                                 make_pair(string(BasicFixture::partition), string(BasicFixture::row))})));
+    CHECK (outbox_read());
+
+    CHECK_EQUAL (status_codes::OK,
+                 delete_entity (string(BasicFixture::addr), outbox_table_name, author_country,
+                                timeline_row(author_name, time)));
+    CHECK_EQUAL (status_codes::OK,
+                 delete_entity (string(BasicFixture::addr), high_degree_table_name, high_degree_partition, author));
+    CHECK_EQUAL (status_codes::OK,
+                 delete_entity (string(BasicFixture::addr), string(BasicFixture::table), author_country, author_name));
+  }
+
+  // ReadUpdates returns a page of the timeline and a cursor for the next
+  // one. A status pushed to the user turns up on some page, once
+  // PushServer has delivered it. The cursor after that page passes it
+  // once PushServer's watermark does, and then the next page lacks it.
+  TEST_FIXTURE(BasicFixture, ReadUpdates){
+    cout << "ReadUpdates" << endl;
+    const string status {"ReadBack" + new_idempotency_key()};
+    value friends {build_json_object (vector<pair<string,string>> {
+          make_pair("Friends", friends_list_to_string(friends_list_t {
+                make_pair(string(BasicFixture::partition), string(BasicFixture::row))}))})};
+    pair<status_code,value> pushed {
+      do_request (methods::POST,
+                  push_def_url
+                  + push_status + "/"
+                  + string(BasicFixture::partition2) + "/"
+                  + string(BasicFixture::row2) + "/"
+                  + status,
+                  friends)};
+    CHECK_EQUAL (status_codes::OK, pushed.first);
+
+    // Statuses pushed close together share an entry, one per line;
+    // the Time of the status's entry, or empty if the page lacks it
+    auto status_time = [&status] (const value& page) -> string {
+      for (const auto& u : page.at("Updates").as_array())
+        if (get_json_object_prop(u, "Status").find(status) != string::npos)
+          return get_json_object_prop(u, "Time");
+      return string {};
+    };
+    auto read_page = [] (const string& since) -> pair<status_code,value> {
+      return do_request (methods::GET,
+                         user_def_url
+                         + read_updates + "/"
+                         + string(BasicFixture::userid)
+                         + "?limit=10&since=" + web::uri::encode_data_string(since));
+    };
+
+    // Page through the timeline until the status is found, for up to 5 s
+    string found_since {};
+    string time {};
+    string next {};
+    for (int attempt {0}; attempt < 50 && time.empty(); ++attempt) {
+      if (attempt > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds {100});
+      string since {};
+      for (;;) {
+        pair<status_code,value> result {read_page(since)};
+        CHECK_EQUAL (status_codes::OK, result.first);
+        if (result.first != status_codes::OK ||
+            ! result.second.has_field("Updates") || ! result.second.has_field("Next"))
+          break;
+        next = get_json_object_prop(result.second, "Next");
+        time = status_time(result.second);
+        if ( ! time.empty()) {
+          found_since = since;
+          break;
+        }
+        if (next == since)
+          break;
+        since = next;
+      }
+    }
+    CHECK ( ! time.empty());
+    if (time.empty())
+      return;
+
+    // Other pushes still being delivered may hold the cursor back a while
+    for (int attempt {0}; attempt < 50 && next < time; ++attempt) {
+      std::this_thread::sleep_for(std::chrono::milliseconds {100});
+      pair<status_code,value> result {read_page(found_since)};
+      if (result.first == status_codes::OK && result.second.has_field("Next"))
+        next = get_json_object_prop(result.second, "Next");
+    }
+    CHECK (next >= time);
+
+    pair<status_code,value> after {read_page(next)};
+    CHECK_EQUAL (status_codes::OK, after.first);
+    CHECK (after.second.has_field("Updates"));
+    if (after.second.has_field("Updates"))
+      CHECK (status_time(after.second).empty());
+  }
+
+  // Forbidden status code with inactive user aka incorrect user
+  TEST_FIXTURE(BasicFixture, ReadUpdatesForbidden){
+    cout << "ReadUpdatesForbidden" << endl;
+    pair<status_code,value> result {
+          do_request (methods::GET,
+                      user_def_url
+                      + read_updates + "/"
+                      + invalidValue)};
+    cout << "ReadUpdates returned status_code: " << result.first << endl;
+    CHECK_EQUAL (status_codes::Forbidden, result.first);
+  }
+
+  // A poll with no new entries returns no events once its timeout passes
+  TEST_FIXTURE(BasicFixture, SubscribeTimeout){
+    cout << "SubscribeTimeout" << endl;
+    pair<status_code,value> result {
+          do_request (methods::GET,
+                      user_def_url
+                      + subscribe + "/"
+                      + string(BasicFixture::userid)
+                      + "?timeout=100")};
+    cout << "Subscribe returned status_code: " << result.first << endl;
+    CHECK_EQUAL (status_codes::OK, result.first);
+    CHECK (result.second.has_field("Next"));
+  }
+
+  // Forbidden status code with inactive user aka incorrect user
+  TEST_FIXTURE(BasicFixture, SubscribeForbidden){
+    cout << "SubscribeForbidden" << endl;
+    pair<status_code,value> result {
+          do_request (methods::GET,
+                      user_def_url
+                      + subscribe + "/"
+                      + invalidValue)};
+    cout << "Subscribe returned status_code: " << result.first << endl;
+    CHECK_EQUAL (status_codes::Forbidden, result.first);
+  }
 }
 
 // SUITE(UPDATE_AUTH) {
@@ -1505,3 +1730,98 @@ SUITE(GET) {
 //
 //   }
 //}
+
+/*
+  Tests for the Table service stand-in, tableserver, run with the
+  emulator account in azure_keys.h. They use http_client rather than
+  do_request() to see the service's headers.
+ */
+SUITE(TABLESERVER) {
+  const string table_addr {"http://127.0.0.1:10002/devstoreaccount1/"};
+  const string stand_in_table {"StandInTable"};
+
+  // A request to the stand-in, as the storage library would make it
+  http_response table_request (const method& m, const string& path, const value& body) {
+    http_client client {table_addr};
+    http_request request {m};
+    request.set_request_uri(path);
+    request.headers().add("Accept", "application/json;odata=minimalmetadata");
+    if ( ! body.is_null())
+      request.set_body(body);
+    return client.request(request).get();
+  }
+
+  // The stand-in creates, and then finds, a table
+  TEST(CreateTable) {
+    table_request(methods::DEL, "Tables('" + stand_in_table + "')", value::null());
+    value table {value::object()};
+    table["TableName"] = value::string(stand_in_table);
+    CHECK_EQUAL (status_codes::Created, table_request(methods::POST, "Tables", table).status_code());
+    CHECK_EQUAL (status_codes::Conflict, table_request(methods::POST, "Tables", table).status_code());
+    CHECK_EQUAL (status_codes::OK,
+                 table_request(methods::GET, "Tables('" + stand_in_table + "')", value::null()).status_code());
+  }
+
+  // A query pages through its matches with continuation headers
+  TEST(QueryContinuation) {
+    for (const string row : {"A", "B", "C"}) {
+      value entity {build_json_value("Song", "RESPECT")};
+      entity["Count"] = value::number(row == "B" ? 2 : 1);
+      CHECK_EQUAL (status_codes::NoContent,
+                   table_request(methods::PUT, stand_in_table + "(PartitionKey='USA',RowKey='" + row + "')",
+                                 entity).status_code());
+    }
+    const string query {stand_in_table + "()?$filter=" + web::http::uri::encode_data_string("Count lt 2") + "&$top=1"};
+    http_response first {table_request(methods::GET, query, value::null())};
+    CHECK_EQUAL (status_codes::OK, first.status_code());
+    CHECK_EQUAL (1u, first.extract_json().get().at("value").as_array().size());
+    CHECK (first.headers().has("x-ms-continuation-NextPartitionKey"));
+
+    http_response second {table_request(methods::GET, query
+                                        + "&NextPartitionKey=" + first.headers()["x-ms-continuation-NextPartitionKey"]
+                                        + "&NextRowKey=" + first.headers()["x-ms-continuation-NextRowKey"],
+                                        value::null())};
+    CHECK_EQUAL (status_codes::OK, second.status_code());
+    value page {second.extract_json().get()};
+    CHECK_EQUAL (1u, page.at("value").as_array().size());
+    CHECK_EQUAL ("C", page.at("value").as_array().at(0).at("RowKey").as_string());
+    CHECK ( ! second.headers().has("x-ms-continuation-NextPartitionKey"));
+  }
+
+  // A change set that writes one row twice is refused, and neither write is applied
+  TEST(BatchSameRow) {
+    table_request(methods::DEL, stand_in_table + "(PartitionKey='USA',RowKey='D')", value::null());
+    string change_set {};
+    for (const string song : {"RESPECT", "Chain of Fools"}) {
+      change_set += "--changeset_same_row\r\n"
+        "Content-Type: application/http\r\n"
+        "Content-Transfer-Encoding: binary\r\n\r\n"
+        "PUT " + table_addr + stand_in_table + "(PartitionKey='USA',RowKey='D') HTTP/1.1\r\n"
+        "Content-Type: application/json\r\n\r\n" +
+        build_json_value("Song", song).serialize() + "\r\n";
+    }
+    const string body {"--batch_same_row\r\n"
+        "Content-Type: multipart/mixed; boundary=changeset_same_row\r\n\r\n" +
+        change_set + "--changeset_same_row--\r\n--batch_same_row--\r\n"};
+
+    http_client client {table_addr};
+    http_request request {methods::POST};
+    request.set_request_uri("$batch");
+    request.set_body(body, "multipart/mixed; boundary=batch_same_row");
+    http_response response {client.request(request).get()};
+    CHECK_EQUAL (status_codes::Accepted, response.status_code());
+    CHECK (response.extract_string().get().find("HTTP/1.1 400") != string::npos);
+    CHECK_EQUAL (status_codes::NotFound,
+                 table_request(methods::GET, stand_in_table + "(PartitionKey='USA',RowKey='D')",
+                               value::null()).status_code());
+  }
+
+  // A shared access signature that is not signed with the account key is refused
+  TEST(BadSignature) {
+    http_response response {table_request(methods::GET, stand_in_table + "(PartitionKey='USA',RowKey='A')"
+                                          "?sv=2015-04-05&tn=" + stand_in_table +
+                                          "&sp=r&se=2099-01-01T00:00:00Z&sig=bm90IGEgc2lnbmF0dXJl",
+                                          value::null())};
+    CHECK_EQUAL (status_codes::Forbidden, response.status_code());
+  }
+}